@@ -0,0 +1,53 @@
+#!/bin/bash
+# Compare block layouts for random access: blocks cut at the block size
+# against blocks aligned to tar entries (--align). Extracts a sample of
+# regular files with -x, eg:
+#
+#   bench/align.sh src/pixz INPUT.tar [FILES] [-- PIXZ_ARGS...]
+#
+# Reports compressed size, and the mean and worst extraction time.
+
+pixz=$1
+input=$2
+files=${3:-50}
+shift 3 2>/dev/null || shift $#
+[ "$1" = "--" ] && shift
+
+if [ ! -x "$pixz" -o ! -f "$input" ]; then
+    echo "usage: $0 PIXZ INPUT.tar [FILES] [-- PIXZ_ARGS...]" >&2
+    exit 2
+fi
+
+tmp=$(mktemp -d)
+trap "rm -rf $tmp" EXIT
+
+# The same sample of regular files each time
+tar -tvf "$input" | awk '/^-/ { print $NF }' \
+    | awk -v n=$files 'BEGIN { srand(1) } { a[NR] = $0 }
+        END { for (i = 0; i < n && NR; ++i) print a[int(rand() * NR) + 1] }' \
+    > $tmp/files
+
+now() { date +%s%N; }
+
+printf "%-8s %7s %12s %10s %10s\n" layout blocks bytes "mean ms" "max ms"
+for layout in size align; do
+    flags=
+    [ $layout = align ] && flags=--align
+    rm -f $tmp/out.tpxz
+    "$pixz" "$@" $flags -i "$input" -o $tmp/out.tpxz || exit 1
+    blocks=$(xz --robot -lv $tmp/out.tpxz 2>/dev/null \
+        | awk '$1 == "totals" { print $3 }')
+
+    total=0 max=0
+    while read -r f; do
+        s=$(now)
+        "$pixz" -x "$f" -i $tmp/out.tpxz > /dev/null || exit 1
+        t=$(( ($(now) - s) / 1000 ))
+        total=$(( total + t ))
+        [ $t -gt $max ] && max=$t
+    done < $tmp/files
+    n=$(wc -l < $tmp/files)
+    printf "%-8s %7s %12s %10.1f %10.1f\n" $layout $blocks \
+        $(stat -c %s $tmp/out.tpxz) \
+        $(awk "BEGIN { print $total / $n / 1000; print $max / 1000 }")
+done
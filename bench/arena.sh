@@ -0,0 +1,58 @@
+#!/bin/bash
+# Compare per-block coder setup with liblzma's own malloc (PIXZ_DISABLE=arena)
+# against pixz's pooled allocator, at high presets. Small blocks (-f) make
+# setup a bigger share of the work, eg:
+#
+#   bench/arena.sh src/pixz INPUT [RUNS] [-- PIXZ_ARGS...]
+#
+# Setup cost per block is estimated as the difference in best wall time,
+# divided by the number of blocks.
+
+pixz=$1
+input=$2
+runs=${3:-3}
+shift 3 2>/dev/null || shift $#
+[ "$1" = "--" ] && shift
+[ $# -eq 0 ] && set -- -f 0.25
+
+if [ ! -x "$pixz" -o ! -f "$input" ]; then
+    echo "usage: $0 PIXZ INPUT [RUNS] [-- PIXZ_ARGS...]" >&2
+    exit 2
+fi
+
+tmp=$(mktemp -d)
+trap "rm -rf $tmp" EXIT
+
+# Best wall time of several runs, in seconds
+TIMEFORMAT=%R
+best() {
+    local best= t
+    for i in $(seq $runs); do
+        t=$( { time "$@" > /dev/null 2> /dev/null; } 2>&1 )
+        if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+            best=$t
+        fi
+    done
+    echo $best
+}
+
+printf "%-6s %7s %-9s %10s %10s %12s\n" level blocks op malloc arena \
+    "ms/block"
+for level in -6 -7 -8 -9 -9e; do
+    "$pixz" $level "$@" -i "$input" > $tmp/out.xz || exit 1
+    blocks=$(xz --robot -lv $tmp/out.xz 2>/dev/null \
+        | awk '$1 == "totals" { print $3 }')
+    [ -n "$blocks" ] || blocks=1
+
+    for op in compress decompress; do
+        if [ $op = compress ]; then
+            cmd=("$pixz" $level "$@" -i "$input")
+        else
+            cmd=("$pixz" -d -i $tmp/out.xz)
+        fi
+        m=$(PIXZ_DISABLE=arena best "${cmd[@]}")
+        a=$(PIXZ_DISABLE= best "${cmd[@]}")
+        printf "%-6s %7s %-9s %9ss %9ss %12s\n" $level $blocks $op $m $a \
+            $(awk "BEGIN { printf \"%.2f\", ($m - $a) * 1000 / $blocks }")
+    done
+done
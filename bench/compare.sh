@@ -0,0 +1,43 @@
+#!/bin/bash
+# Compare the compression and decompression speed of two pixz builds, eg:
+# one configured with --enable-probes and one without.
+#
+#   bench/compare.sh OLD_PIXZ NEW_PIXZ INPUT [RUNS] [-- PIXZ_ARGS...]
+
+old=$1
+new=$2
+input=$3
+runs=${4:-5}
+shift 4 2>/dev/null || shift $#
+[ "$1" = "--" ] && shift
+
+if [ ! -x "$old" -o ! -x "$new" -o ! -f "$input" ]; then
+    echo "usage: $0 OLD_PIXZ NEW_PIXZ INPUT [RUNS] [-- PIXZ_ARGS...]" >&2
+    exit 2
+fi
+
+tmp=$(mktemp -d)
+trap "rm -rf $tmp" EXIT
+
+# Best wall time of several runs, in seconds
+TIMEFORMAT=%R
+best() {
+    local best= t
+    for i in $(seq $runs); do
+        t=$( { time "$@" > /dev/null 2> /dev/null; } 2>&1 )
+        if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+            best=$t
+        fi
+    done
+    echo $best
+}
+
+"$old" "$@" < "$input" > $tmp/in.xz || exit 1
+
+printf "%-6s %10s %10s\n" "" compress decompress
+for which in old new; do
+    pixz=${!which}
+    c=$(best "$pixz" "$@" -i "$input")
+    d=$(best "$pixz" -d -i $tmp/in.xz)
+    printf "%-6s %9ss %9ss\n" $which $c $d
+done
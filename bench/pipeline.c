@@ -0,0 +1,95 @@
+// How many blocks per second can the pipeline move, when the work itself
+// is trivial? This isolates the cost of handing blocks between threads.
+//
+//   make -C bench pipeline-bench
+//   bench/pipeline-bench [-p THREADS] [-q QSIZE] [-b BLOCK_KIB] [-n BLOCKS]
+//       [-B BATCH]
+//
+// THREADS may exceed the number of CPUs, to see how hand-off scales with
+// contention. A BATCH of 1 turns batching off.
+
+#include "pixz.h"
+
+#include <unistd.h>
+
+static size_t gThreads = 32;
+static size_t gBlockSize = 512 * 1024;
+static size_t gBlocks = 20000;
+
+// Pretend to have as many CPUs as asked for, and no cgroup limits
+size_t num_threads(void) {
+    return gThreads;
+}
+
+uint64_t memory_limit(void) {
+    return 0;
+}
+
+static void *bench_create(size_t node) {
+    return pool_alloc(gBlockSize, node, NULL);
+}
+
+static void bench_free(void *data) {
+    pool_free(data);
+}
+
+static void bench_split(pipeline_t *pl) {
+    for (size_t i = 0; i < gBlocks; ++i) {
+        pipeline_item_t *pi = pipeline_fetch(pl);
+        ((uint8_t*)pi->data)[0] = i;
+        pipeline_split(pl, pi);
+    }
+    pipeline_stop(pl);
+}
+
+static void bench_process(pipeline_t *pl, size_t thnum) {
+    pipeline_item_t *pi;
+    while ((pi = pipeline_next(pl, thnum))) {
+        // Stand-in for a codec: touch each page
+        uint8_t *data = (uint8_t*)pi->data;
+        for (size_t i = 0; i < gBlockSize; i += 4096)
+            ++data[i];
+        pipeline_done(pl, thnum, pi);
+    }
+}
+
+static size_t bench_arg(const char *arg) {
+    char *end;
+    long v = strtol(arg, &end, 10);
+    if (*end || v <= 0)
+        die("Need a positive integer argument");
+    return v;
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    while ((ch = getopt(argc, argv, "p:q:b:n:B:")) != -1) {
+        switch (ch) {
+            case 'p': gThreads = bench_arg(optarg); break;
+            case 'q': gPipelineQSize = bench_arg(optarg); break;
+            case 'b': gBlockSize = bench_arg(optarg) * 1024; break;
+            case 'n': gBlocks = bench_arg(optarg); break;
+            case 'B': gPipelineBatch = bench_arg(optarg); break;
+            default: die("usage: %s [-p THREADS] [-q QSIZE] [-b BLOCK_KIB] "
+                "[-n BLOCKS] [-B BATCH]", argv[0]);
+        }
+    }
+
+    uint64_t start = monotonic_ns();
+    pipeline_t *pl = pipeline_create(bench_create, bench_free, bench_split,
+        bench_process, NULL, 0, 0);
+    size_t qsize = pl->qsize, batch = pl->batch, merged = 0;
+    pipeline_item_t *pi;
+    while ((pi = pipeline_merged(pl))) {
+        if (pi->seq != merged++)
+            die("Out of order: got %zu", pi->seq);
+        pipeline_recycle(pl, pi);
+    }
+    pipeline_destroy(pl);
+    double secs = (monotonic_ns() - start) / 1e9;
+
+    printf("%zu threads, %zu KiB blocks, queue %zu, batch %zu: "
+        "%.0f blocks/s, %.0f MiB/s\n", gThreads, gBlockSize / 1024, qsize,
+        batch, merged / secs, merged * (gBlockSize / 1048576.0) / secs);
+    return 0;
+}
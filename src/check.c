@@ -0,0 +1,140 @@
+#include "pixz.h"
+
+// Integrity checks of block contents, computed a piece at a time, so they
+// can be worked out as data passes by. liblzma has CRCs for us, but keeps
+// its SHA-256 to itself.
+
+lzma_check gCheck = LZMA_CHECK_CRC32;
+
+static const uint32_t gSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+
+#pragma mark DECLARE
+
+static void sha256_block(uint32_t state[8], const uint8_t *p);
+
+
+#pragma mark DEFINE
+
+bool check_supported(lzma_check type) {
+    return type == LZMA_CHECK_NONE || type == LZMA_CHECK_CRC32
+        || type == LZMA_CHECK_CRC64 || type == LZMA_CHECK_SHA256;
+}
+
+void check_init(check_t *c, lzma_check type) {
+    if (!check_supported(type))
+        die("Unsupported integrity check");
+    *c = (check_t){ .type = type, .sha256 = { 0x6a09e667, 0xbb67ae85,
+        0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab,
+        0x5be0cd19 } };
+}
+
+void check_update(check_t *c, const uint8_t *buf, size_t size) {
+    switch (c->type) {
+        case LZMA_CHECK_CRC32:
+            c->crc32 = lzma_crc32(buf, size, c->crc32);
+            break;
+        case LZMA_CHECK_CRC64:
+            c->crc64 = lzma_crc64(buf, size, c->crc64);
+            break;
+        case LZMA_CHECK_SHA256: {
+            size_t fill = c->size % 64;
+            c->size += size;
+            if (fill) {
+                size_t n = 64 - fill < size ? 64 - fill : size;
+                memcpy(c->buf + fill, buf, n);
+                buf += n;
+                size -= n;
+                if (fill + n < 64)
+                    return;
+                sha256_block(c->sha256, c->buf);
+            }
+            for (; size >= 64; buf += 64, size -= 64)
+                sha256_block(c->sha256, buf);
+            memcpy(c->buf, buf, size);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+size_t check_finish(check_t *c, uint8_t *out) {
+    switch (c->type) {
+        case LZMA_CHECK_CRC32:
+            for (size_t i = 0; i < 4; ++i)
+                out[i] = c->crc32 >> (8 * i);
+            return 4;
+        case LZMA_CHECK_CRC64:
+            for (size_t i = 0; i < 8; ++i)
+                out[i] = c->crc64 >> (8 * i);
+            return 8;
+        case LZMA_CHECK_SHA256: {
+            // Pad with a one bit, zeros, and the length in bits
+            uint64_t bits = c->size * 8;
+            uint8_t pad[72] = { 0x80 };
+            size_t n = 64 - (c->size + 8) % 64;
+            for (size_t i = 0; i < 8; ++i)
+                pad[n + i] = bits >> (56 - 8 * i);
+            check_update(c, pad, n + 8);
+            for (size_t i = 0; i < 32; ++i)
+                out[i] = c->sha256[i / 4] >> (24 - 8 * (i % 4));
+            return 32;
+        }
+        default:
+            return 0;
+    }
+}
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t state[8], const uint8_t *p) {
+    uint32_t w[64];
+    for (size_t i = 0; i < 16; ++i)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16
+            | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (size_t i = 16; i < 64; ++i) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18)
+            ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19)
+            ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+        e = state[4], f = state[5], g = state[6], h = state[7];
+    for (size_t i = 0; i < 64; ++i) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25))
+            + ((e & f) ^ (~e & g)) + gSha256K[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22))
+            + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
@@ -3,6 +3,8 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <math.h>
+#include <sched.h>
+#include <time.h>
 
 #if HAVE__GET_OSFHANDLE
     #include <windows.h>
@@ -10,8 +12,7 @@
 
 #pragma mark UTILS
 
-FILE *gInFile = NULL, *gOutFile = NULL;
-lzma_stream gStream = LZMA_STREAM_INIT;
+unsigned gDisable = 0;
 
 
 void die(const char *fmt, ...) {
@@ -31,6 +32,12 @@ void *xmalloc(size_t size) {
     return r;
 }
 
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 char *xstrdup(const char *s) {
     if (!s)
         return NULL;
@@ -52,25 +59,29 @@ bool is_multi_header(const char *name) {
 
 #pragma mark INDEX
 
-lzma_index *gIndex = NULL;
-file_index_t *gFileIndex = NULL, *gLastFile = NULL;
-
-static uint8_t *gFileIndexBuf = NULL;
-static size_t gFIBSize = CHUNKSIZE, gFIBPos = 0;
-static lzma_ret gFIBErr = LZMA_OK;
-static uint8_t gFIBInputBuf[CHUNKSIZE];
-static size_t gMoved = 0;
+// State for reading the pixz file index out of its block
+typedef struct {
+    FILE *in;
+    lzma_stream stream;
+    uint8_t *buf;
+    size_t size, pos;
+    lzma_ret err;
+    uint8_t input[CHUNKSIZE];
+    size_t moved;
+} file_index_reader_t;
 
-static void *decode_file_index_start(off_t block_seek, lzma_check check);
-static lzma_vli find_file_index(void **bdatap);
+static void *decode_file_index_start(file_index_reader_t *r, off_t block_seek,
+    lzma_check check);
+static lzma_vli find_file_index(file_index_reader_t *r, lzma_index *index,
+    void **bdatap);
 
-static char *read_file_index_name(void);
-static void read_file_index_make_space(void);
-static void read_file_index_data(void);
+static char *read_file_index_name(file_index_reader_t *r);
+static void read_file_index_make_space(file_index_reader_t *r);
+static void read_file_index_data(file_index_reader_t *r);
 
 
-void dump_file_index(FILE *out, bool verbose) {
-    for (file_index_t *f = gFileIndex; f != NULL; f = f->next) {
+void dump_file_index(FILE *out, file_index_t *files, bool verbose) {
+    for (file_index_t *f = files; f != NULL; f = f->next) {
         if (verbose) {
             fprintf(out, "%10"PRIuMAX" %s\n", (uintmax_t)f->offset,
                 f->name ? f->name : "");
@@ -81,14 +92,13 @@ void dump_file_index(FILE *out, bool verbose) {
     }    
 }
 
-void free_file_index(void) {
-    for (file_index_t *f = gFileIndex; f != NULL; ) {
+void free_file_index(file_index_t *files) {
+    for (file_index_t *f = files; f != NULL; ) {
         file_index_t *next = f->next;
         free(f->name);
         free(f);
         f = next;
     }
-    gFileIndex = gLastFile = NULL;
 }
 
 typedef struct {
@@ -96,8 +106,9 @@ typedef struct {
     lzma_filter filters[LZMA_FILTERS_MAX + 1];
 } block_wrapper_t;
 
-static void *decode_file_index_start(off_t block_seek, lzma_check check) {
-    if (fseeko(gInFile, block_seek, SEEK_SET) == -1)
+static void *decode_file_index_start(file_index_reader_t *r, off_t block_seek,
+        lzma_check check) {
+    if (fseeko(r->in, block_seek, SEEK_SET) == -1)
         die("Error seeking to block");
     
     // Some memory in which to keep the discovered filters safe
@@ -105,49 +116,51 @@ static void *decode_file_index_start(off_t block_seek, lzma_check check) {
     bw->block = (lzma_block){ .check = check, .filters = bw->filters,
 	 	.version = 0 };
     
-    int b = fgetc(gInFile);
+    int b = fgetc(r->in);
     if (b == EOF || b == 0)
         die("Error reading block size");
     bw->block.header_size = lzma_block_header_size_decode(b);
     uint8_t hdrbuf[bw->block.header_size];
     hdrbuf[0] = (uint8_t)b;
-    if (fread(hdrbuf + 1, bw->block.header_size - 1, 1, gInFile) != 1)
+    if (fread(hdrbuf + 1, bw->block.header_size - 1, 1, r->in) != 1)
         die("Error reading block header");
     if (lzma_block_header_decode(&bw->block, NULL, hdrbuf) != LZMA_OK)
         die("Error decoding file index block header");
     
-    if (lzma_block_decoder(&gStream, &bw->block) != LZMA_OK)
+    if (lzma_block_decoder(&r->stream, &bw->block) != LZMA_OK)
         die("Error initializing file index stream");
     
     return bw;
 }
 
-static lzma_vli find_file_index(void **bdatap) {
-    if (!gIndex)
-        decode_index();
-        
+static lzma_vli find_file_index(file_index_reader_t *r, lzma_index *index,
+        void **bdatap) {
     // find the last block
     lzma_index_iter iter;
-	lzma_index_iter_init(&iter, gIndex);
-    lzma_vli loc = lzma_index_uncompressed_size(gIndex) - 1;
+	lzma_index_iter_init(&iter, index);
+    lzma_vli loc = lzma_index_uncompressed_size(index) - 1;
     if (lzma_index_iter_locate(&iter, loc))
         die("Can't locate file index block");
     if (iter.stream.number != 1)
 		return 0; // Too many streams for one file index
 	
-    void *bdata = decode_file_index_start(iter.block.compressed_file_offset,
+    void *bdata = decode_file_index_start(r, iter.block.compressed_file_offset,
 		iter.stream.flags->check);
     
-    gFileIndexBuf = xmalloc(gFIBSize);
-    gStream.avail_out = gFIBSize;
-    gStream.avail_in = 0;
+    r->size = CHUNKSIZE;
+    r->pos = 0;
+    r->err = LZMA_OK;
+    r->moved = 0;
+    r->buf = xmalloc(r->size);
+    r->stream.avail_out = r->size;
+    r->stream.avail_in = 0;
     
     // Check if this is really an index
-    read_file_index_data();
+    read_file_index_data(r);
     lzma_vli ret = iter.block.compressed_file_offset;
-    if (xle64dec(gFileIndexBuf + gFIBPos) != PIXZ_INDEX_MAGIC)
+    if (xle64dec(r->buf + r->pos) != PIXZ_INDEX_MAGIC)
         ret = 0;
-    gFIBPos += sizeof(uint64_t);
+    r->pos += sizeof(uint64_t);
     
     if (bdatap && ret) {
         *bdatap = bdata;
@@ -156,101 +169,105 @@ static lzma_vli find_file_index(void **bdatap) {
         if (bdatap)
             *bdatap = NULL;
         free(bdata);
-        free(gFileIndexBuf);
-        gLastFile = gFileIndex = NULL;
-        lzma_end(&gStream);
+        free(r->buf);
+        lzma_end(&r->stream);
     }
     return ret; 
 }  
 
-lzma_vli read_file_index() {
+lzma_vli read_file_index(FILE *in, lzma_index *index, file_index_t **files) {
+    file_index_reader_t r = { .in = in, .stream = LZMA_STREAM_INIT };
+    *files = NULL;
+    
     void *bdata = NULL;
-	lzma_vli offset = find_file_index(&bdata);
+	lzma_vli offset = find_file_index(&r, index, &bdata);
     if (!offset)
         return 0;
     
+    file_index_t *last = NULL;
     while (true) {
-        char *name = read_file_index_name();
+        char *name = read_file_index_name(&r);
         if (!name)
             break;
         
         file_index_t *f = xmalloc(sizeof(file_index_t));
         f->name = strlen(name) ? xstrdup(name) : NULL;
-        f->offset = xle64dec(gFileIndexBuf + gFIBPos);
-        gFIBPos += sizeof(uint64_t);
+        f->offset = xle64dec(r.buf + r.pos);
+        f->next = NULL;
+        r.pos += sizeof(uint64_t);
         
-        if (gLastFile) {
-            gLastFile->next = f;
+        if (last) {
+            last->next = f;
         } else {
-            gFileIndex = f;
+            *files = f;
         }
-        gLastFile = f;
+        last = f;
     }
-    free(gFileIndexBuf);
-    lzma_end(&gStream);
+    free(r.buf);
+    lzma_end(&r.stream);
     free(bdata);
     
     return offset;
 }
 
-static char *read_file_index_name(void) {
+static char *read_file_index_name(file_index_reader_t *r) {
     while (true) {
         // find a nul that ends a name
-        uint8_t *eos, *haystack = gFileIndexBuf + gFIBPos;
-        ssize_t len = gFIBSize - gStream.avail_out - gFIBPos - sizeof(uint64_t);
+        uint8_t *eos, *haystack = r->buf + r->pos;
+        ssize_t len = r->size - r->stream.avail_out - r->pos - sizeof(uint64_t);
         if (len > 0 && (eos = memchr(haystack, '\0', len))) { // found it
-            gFIBPos += eos - haystack + 1;
+            r->pos += eos - haystack + 1;
             return (char*)haystack;
-        } else if (gFIBErr == LZMA_STREAM_END) { // nothing left
+        } else if (r->err == LZMA_STREAM_END) { // nothing left
             return NULL;
         } else { // need more data
-            if (gStream.avail_out == 0)
-                read_file_index_make_space();
-            read_file_index_data();            
+            if (r->stream.avail_out == 0)
+                read_file_index_make_space(r);
+            read_file_index_data(r);
         }
     }
 }
 
-static void read_file_index_make_space(void) {
-    bool expand = (gFIBPos == 0);
-    if (gFIBPos != 0) { // clear more space
-        size_t move = gFIBSize - gStream.avail_out - gFIBPos;        
-        memmove(gFileIndexBuf, gFileIndexBuf + gFIBPos, move);
-        gMoved += move;
-        gStream.avail_out += gFIBPos;
-        gFIBPos = 0;
+static void read_file_index_make_space(file_index_reader_t *r) {
+    bool expand = (r->pos == 0);
+    if (r->pos != 0) { // clear more space
+        size_t move = r->size - r->stream.avail_out - r->pos;
+        memmove(r->buf, r->buf + r->pos, move);
+        r->moved += move;
+        r->stream.avail_out += r->pos;
+        r->pos = 0;
     }
     // Try to reduce number of moves by expanding proactively
-    if (expand || gMoved >= gFIBSize) { // malloc more space
-        gStream.avail_out += gFIBSize;
-        gFIBSize *= 2;
+    if (expand || r->moved >= r->size) { // malloc more space
+        r->stream.avail_out += r->size;
+        r->size *= 2;
 
-        uint8_t *new_gFileIndexBuf = realloc(gFileIndexBuf, gFIBSize);
+        uint8_t *new_buf = realloc(r->buf, r->size);
 
-        if (new_gFileIndexBuf == NULL) {
+        if (new_buf == NULL) {
           // TODO is recovery possible? does it even make sense?
           // @see https://github.com/vasi/pixz/issues/8#issuecomment-134113347
           die("memory re-allocation failure: %s", strerror(errno));
         } else {
-          gFileIndexBuf = new_gFileIndexBuf;
+          r->buf = new_buf;
         }
     }
 }
 
-static void read_file_index_data(void) {
-    gStream.next_out = gFileIndexBuf + gFIBSize - gStream.avail_out;
-    while (gFIBErr != LZMA_STREAM_END && gStream.avail_out) {
-        if (gStream.avail_in == 0) {
+static void read_file_index_data(file_index_reader_t *r) {
+    r->stream.next_out = r->buf + r->size - r->stream.avail_out;
+    while (r->err != LZMA_STREAM_END && r->stream.avail_out) {
+        if (r->stream.avail_in == 0) {
             // It's ok to read past the end of the block, we'll still
             // get LZMA_STREAM_END at the right place
-            gStream.avail_in = fread(gFIBInputBuf, 1, CHUNKSIZE, gInFile);
-            if (ferror(gInFile))
+            r->stream.avail_in = fread(r->input, 1, CHUNKSIZE, r->in);
+            if (ferror(r->in))
                 die("Error reading file index data");
-            gStream.next_in = gFIBInputBuf;
+            r->stream.next_in = r->input;
         }
         
-        gFIBErr = lzma_code(&gStream, LZMA_RUN);
-        if (gFIBErr != LZMA_OK && gFIBErr != LZMA_STREAM_END)
+        r->err = lzma_code(&r->stream, LZMA_RUN);
+        if (r->err != LZMA_OK && r->err != LZMA_STREAM_END)
             die("Error decoding file index data");
     }
 }
@@ -259,6 +276,7 @@ static void read_file_index_data(void) {
 #define BWCHUNK 512
 
 typedef struct {
+	FILE *in;
 	uint8_t buf[BWCHUNK];
 	off_t pos;
 	size_t size;
@@ -271,9 +289,9 @@ static uint32_t *bw_read(bw *b) {
 			return NULL; // EOF
 		b->size = (b->pos > BWCHUNK) ? BWCHUNK : b->pos;
 		b->pos -= b->size;
-		if (fseeko(gInFile, b->pos, SEEK_SET) == -1)
+		if (fseeko(b->in, b->pos, SEEK_SET) == -1)
 			return NULL;
-		if (fread(b->buf, b->size, 1, gInFile) != 1)
+		if (fread(b->buf, b->size, 1, b->in) != 1)
 			return NULL;
 	}
 	
@@ -309,15 +327,15 @@ static void stream_footer(bw *b, lzma_stream_flags *flags) {
         die("Error decoding stream footer");
 }
 
-static lzma_index *next_index(off_t *pos) {
-	bw b;
+static lzma_index *next_index(FILE *in, off_t *pos) {
+	bw b = { .in = in };
 	off_t pad = stream_padding(&b, *pos);
 	off_t eos = *pos - pad;
 	
 	lzma_stream_flags flags;
 	stream_footer(&b, &flags);
 	*pos = eos - LZMA_STREAM_HEADER_SIZE - flags.backward_size;
-    if (fseeko(gInFile, *pos, SEEK_SET) == -1)
+    if (fseeko(in, *pos, SEEK_SET) == -1)
         die("Error seeking to index");
 	
     lzma_stream strm = LZMA_STREAM_INIT;
@@ -330,8 +348,8 @@ static lzma_index *next_index(off_t *pos) {
     lzma_ret err = LZMA_OK;
     while (err != LZMA_STREAM_END) {
         if (strm.avail_in == 0) {
-            strm.avail_in = fread(ibuf, 1, CHUNKSIZE, gInFile);
-            if (ferror(gInFile))
+            strm.avail_in = fread(ibuf, 1, CHUNKSIZE, in);
+            if (ferror(in))
                 die("Error reading index");
             strm.next_in = ibuf;
         }
@@ -340,9 +358,10 @@ static lzma_index *next_index(off_t *pos) {
         if (err != LZMA_OK && err != LZMA_STREAM_END)
             die("Error decoding index");
     }
+    lzma_end(&strm);
 	
 	*pos = eos - lzma_index_stream_size(index);
-	if (fseeko(gInFile, *pos, SEEK_SET) == -1)
+	if (fseeko(in, *pos, SEEK_SET) == -1)
 		die("Error seeking to beginning of stream");
 	
 	
@@ -353,173 +372,359 @@ static lzma_index *next_index(off_t *pos) {
 	return index;
 }
 
-bool decode_index(void) {
+lzma_index *decode_index(FILE *in) {
 #if HAVE__GET_OSFHANDLE
     // windows pretends that seeking works on pipes, but then it doesn't
     // try to check that this is a "regular" file with win api
-    intptr_t hdl = _get_osfhandle(_fileno(gInFile));
+    intptr_t hdl = _get_osfhandle(_fileno(in));
     DWORD ftype = GetFileType((HANDLE)hdl);
     if (ftype != FILE_TYPE_DISK) {
         fprintf(stderr, "can not seek in input\n");
-        return false;
+        return NULL;
     }
 #endif
 
-	if (fseeko(gInFile, 0, SEEK_END) == -1) {
+	if (fseeko(in, 0, SEEK_END) == -1) {
 		fprintf(stderr, "can not seek in input: %s\n", strerror(errno));
-		return false; // not seekable
+		return NULL; // not seekable
 	}
 
-	off_t pos = ftello(gInFile);
+	off_t pos = ftello(in);
 
-	gIndex = NULL;
+	lzma_index *index = NULL;
 	while (pos > 0) {
-		lzma_index *index = next_index(&pos);
-		if (gIndex && lzma_index_cat(index, gIndex, NULL) != LZMA_OK)
+		lzma_index *prev = next_index(in, &pos);
+		if (index && lzma_index_cat(prev, index, NULL) != LZMA_OK)
 			die("Error concatenating indices");
-		gIndex = index;
+		index = prev;
 	}
 
-	return (gIndex != NULL);
+	return index;
 }
 
 
 #pragma mark QUEUE
 
-queue_t *queue_new(queue_free_t freer) {
-    queue_t *q = xmalloc(sizeof(queue_t));
-    q->first = q->last = NULL;
+// How many times to poll before going to sleep
+#define QUEUE_SPIN 128
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static void *xmalloc_aligned(size_t size) {
+    void *r;
+    if (posix_memalign(&r, CACHELINE, size) != 0)
+        die("Out of memory");
+    return r;
+}
+
+queue_t *queue_new(size_t size, queue_free_t freer, void *ctx) {
+    size_t cap = 1;
+    while (cap < size)
+        cap <<= 1;
+    
+    queue_t *q = xmalloc_aligned(sizeof(queue_t));
+    q->cells = xmalloc_aligned(cap * sizeof(queue_cell_t));
+    for (size_t i = 0; i < cap; ++i)
+        atomic_init(&q->cells[i].seq, i);
+    q->mask = cap - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->pop_waiters, 0);
+    atomic_init(&q->push_waiters, 0);
     q->freer = freer;
+    q->ctx = ctx;
+    atomic_init(&q->wait_ns, 0);
+    atomic_init(&q->high_water, 0);
     pthread_mutex_init(&q->mutex, NULL);
     pthread_cond_init(&q->pop_cond, NULL);
+    pthread_cond_init(&q->push_cond, NULL);
     return q;
 }
 
 void queue_free(queue_t *q) {
-    for (queue_item_t *i = q->first; i; ) {
-        queue_item_t *tmp = i->next;
+    size_t tail = atomic_load(&q->tail);
+    for (size_t pos = atomic_load(&q->head); pos != tail; ++pos) {
+        queue_cell_t *c = &q->cells[pos & q->mask];
         if (q->freer)
-            q->freer(i->type, i->data);
-        free(i);
-        i = tmp;
+            q->freer(q->ctx, c->type, c->data);
     }
     pthread_mutex_destroy(&q->mutex);
     pthread_cond_destroy(&q->pop_cond);
+    pthread_cond_destroy(&q->push_cond);
+    free(q->cells);
     free(q);
 }
 
-void queue_push(queue_t *q, int type, void *data) {
-    queue_item_t *i = xmalloc(sizeof(queue_item_t));
-    i->type = type;
-    i->data = data;
-    i->next = NULL;
-    
-    pthread_mutex_lock(&q->mutex);
-    
-    if (q->last) {
-        q->last->next = i;
-    } else {
-        q->first = i;
+static bool queue_can_push(queue_t *q) {
+    // Load head first, so tail can't appear to be behind it
+    size_t head = atomic_load(&q->head);
+    return atomic_load(&q->tail) - head <= q->mask;
+}
+
+static bool queue_can_pop(queue_t *q) {
+    size_t head = atomic_load(&q->head);
+    return atomic_load(&q->tail) != head;
+}
+
+// Spin for a bit, then sleep until ready(q) holds
+static void queue_wait(queue_t *q, bool (*ready)(queue_t*),
+        pthread_cond_t *cond, atomic_size_t *waiters) {
+    for (size_t i = 0; i < QUEUE_SPIN; ++i) {
+        if (ready(q))
+            return;
+        cpu_relax();
     }
-    q->last = i;
     
-    pthread_cond_signal(&q->pop_cond);
+    pthread_mutex_lock(&q->mutex);
+    atomic_fetch_add(waiters, 1);
+    while (!ready(q))
+        pthread_cond_wait(cond, &q->mutex);
+    atomic_fetch_sub(waiters, 1);
     pthread_mutex_unlock(&q->mutex);
 }
 
-int queue_pop(queue_t *q, void **datap) {
+static void queue_wake(queue_t *q, pthread_cond_t *cond,
+        atomic_size_t *waiters, bool all) {
+    // Pairs with the increment in queue_wait: either we see the waiter, or
+    // it sees our change to head/tail
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(waiters) == 0)
+        return;
     pthread_mutex_lock(&q->mutex);
-    while (!q->first)
-        pthread_cond_wait(&q->pop_cond, &q->mutex);
-    
-    queue_item_t *i = q->first;
-    q->first = i->next;
-    if (!q->first)
-        q->last = NULL;
+    if (all)
+        pthread_cond_broadcast(cond);
+    else
+        pthread_cond_signal(cond);
     pthread_mutex_unlock(&q->mutex);
+}
+
+// Wait for the other side to finish with a cell we've claimed
+static void queue_cell_wait(queue_cell_t *c, size_t seq) {
+    for (size_t i = 0; atomic_load_explicit(&c->seq, memory_order_acquire)
+            != seq; ++i) {
+        if (i < QUEUE_SPIN)
+            cpu_relax();
+        else
+            sched_yield();
+    }
+}
+
+static void queue_high_water(queue_t *q, size_t depth) {
+    size_t hw = atomic_load_explicit(&q->high_water, memory_order_relaxed);
+    while (depth > hw && !atomic_compare_exchange_weak_explicit(
+            &q->high_water, &hw, depth, memory_order_relaxed,
+            memory_order_relaxed))
+        ; // retry
+}
+
+size_t queue_depth(queue_t *q) {
+    size_t head = atomic_load(&q->head);
+    return atomic_load(&q->tail) - head;
+}
+
+void queue_push_n(queue_t *q, int type, void **data, size_t n) {
+    while (n) {
+        // Claim as many cells as there's room for
+        size_t pos = atomic_load(&q->tail);
+        size_t head, k;
+        while (true) {
+            head = atomic_load(&q->head);
+            if (pos - head > q->mask) { // full
+                queue_wait(q, queue_can_push, &q->push_cond, &q->push_waiters);
+                pos = atomic_load(&q->tail);
+                continue;
+            }
+            k = q->mask + 1 - (pos - head);
+            if (k > n)
+                k = n;
+            if (atomic_compare_exchange_weak(&q->tail, &pos, pos + k))
+                break;
+        }
+        queue_high_water(q, pos + k - head);
+        
+        for (size_t i = 0; i < k; ++i) {
+            queue_cell_t *c = &q->cells[(pos + i) & q->mask];
+            queue_cell_wait(c, pos + i);
+            c->type = type;
+            c->data = data[i];
+            atomic_store_explicit(&c->seq, pos + i + 1, memory_order_release);
+        }
+        PROBE(queue_push, q, pos, pos + k - head, type);
+        
+        // Wake before waiting for more room, or we could both sleep
+        queue_wake(q, &q->pop_cond, &q->pop_waiters, k > 1);
+        data += k;
+        n -= k;
+    }
+}
+
+size_t queue_pop_n(queue_t *q, int *types, void **datap, size_t max) {
+    size_t pos = atomic_load(&q->head);
+    size_t k;
+    uint64_t waited = 0;
+    while (true) {
+        size_t tail = atomic_load(&q->tail);
+        if (tail == pos) { // empty
+            uint64_t start = monotonic_ns();
+            queue_wait(q, queue_can_pop, &q->pop_cond, &q->pop_waiters);
+            waited += monotonic_ns() - start;
+            pos = atomic_load(&q->head);
+            continue;
+        }
+        k = tail - pos;
+        if (k > max)
+            k = max;
+        if (atomic_compare_exchange_weak(&q->head, &pos, pos + k))
+            break;
+    }
     
-    *datap = i->data;
-    int type = i->type;
-    free(i);
+    for (size_t i = 0; i < k; ++i) {
+        queue_cell_t *c = &q->cells[(pos + i) & q->mask];
+        queue_cell_wait(c, pos + i + 1);
+        datap[i] = c->data;
+        types[i] = c->type;
+        atomic_store_explicit(&c->seq, pos + i + q->mask + 1,
+            memory_order_release);
+    }
+    if (waited)
+        atomic_fetch_add_explicit(&q->wait_ns, waited, memory_order_relaxed);
+    PROBE(queue_pop, q, pos, types[0], waited);
     
+    queue_wake(q, &q->push_cond, &q->push_waiters, k > 1);
+    return k;
+}
+
+void queue_push(queue_t *q, int type, void *data) {
+    queue_push_n(q, type, &data, 1);
+}
+
+int queue_pop(queue_t *q, void **datap) {
+    int type;
+    queue_pop_n(q, &type, datap, 1);
     return type;
 }
 
 
 #pragma mark PIPELINE
 
-queue_t *gPipelineStartQ = NULL,
-    *gPipelineSplitQ = NULL,
-    *gPipelineMergeQ = NULL;
-
 size_t gPipelineProcessMax = 0;
 size_t gPipelineQSize = 0;
+bool gPipelineAdaptive = false;
+uint64_t gPipelineMemory = 0;
+size_t gPipelineBatch = 0;
 
-pipeline_data_free_t gPLFreer = NULL;
-pipeline_split_t gPLSplit = NULL;
-pipeline_process_t gPLProcess = NULL;
-
-size_t gPLProcessCount = 0;
-pthread_t *gPLProcessThreads = NULL;
-pthread_t gPLSplitThread;
+#define ADAPT_INTERVAL_NS 250000000 // how often to reconsider
 
-ssize_t gPLSplitSeq = 0;
-ssize_t gPLMergeSeq = 0;
-pipeline_item_t *gPLMergedItems = NULL;
-
-static void pipeline_qfree(int type, void *p);
-static void *pipeline_thread_split(void *);
+static void pipeline_qfree(void *ctx, int type, void *p);
+static void *pipeline_thread_split(void *arg);
 static void *pipeline_thread_process(void *arg);
+static size_t pipeline_default_qsize(size_t workers);
+static size_t pipeline_fit_memory(pipeline_t *pl, size_t qsize,
+    size_t item_mem, size_t worker_mem, uint64_t reserved_mem);
+static void pipeline_set_inflight(pipeline_t *pl, size_t limit);
+static void pipeline_adapt(pipeline_t *pl);
+static void pipeline_flush_split(pipeline_t *pl, size_t node);
+static void pipeline_flush_done(pipeline_worker_t *w);
 
-void pipeline_create(
+pipeline_t *pipeline_create(
         pipeline_data_create_t create,
         pipeline_data_free_t destroy,
         pipeline_split_t split,
-        pipeline_process_t process) {
-    gPLFreer = destroy;
-    gPLSplit = split;
-    gPLProcess = process;
-    
-    gPipelineStartQ = queue_new(pipeline_qfree);
-    gPipelineSplitQ = queue_new(pipeline_qfree);
-    gPipelineMergeQ = queue_new(pipeline_qfree);
-    
-    gPLSplitSeq = 0;
-    gPLMergeSeq = 0;
-    gPLMergedItems = NULL;
-    
-    gPLProcessCount = num_threads();
-	if (gPipelineProcessMax > 0 && gPipelineProcessMax < gPLProcessCount)
-		gPLProcessCount = gPipelineProcessMax;
+        pipeline_process_t process,
+        void *ctx,
+        size_t item_mem,
+        size_t worker_mem,
+        uint64_t reserved_mem) {
+    pipeline_t *pl = xmalloc(sizeof(pipeline_t));
+    *pl = (pipeline_t){ .ctx = ctx, .freer = destroy, .split = split,
+        .process = process, .start_ns = monotonic_ns() };
+    
+    pl->process_count = num_threads();
+	if (gPipelineProcessMax > 0 && gPipelineProcessMax < pl->process_count)
+		pl->process_count = gPipelineProcessMax;
 	
-    gPLProcessThreads = xmalloc(gPLProcessCount * sizeof(pthread_t));
-    int qsize = gPipelineQSize ? gPipelineQSize
-        : ceil(gPLProcessCount * 1.3 + 1);
-    if (qsize < gPLProcessCount) {
+    size_t qsize = gPipelineQSize ? gPipelineQSize
+        : pipeline_default_qsize(pl->process_count);
+    qsize = pipeline_fit_memory(pl, qsize, item_mem, worker_mem,
+        reserved_mem);
+    pl->workers = xmalloc(pl->process_count * sizeof(pipeline_worker_t));
+    if (qsize < pl->process_count) {
         fprintf(stderr, "Warning: queue size is less than thread count, "
             "performance will suffer!\n");
     }
+    
+    // Each queue must hold every item, plus the stop messages
+    size_t qcap = qsize + pl->process_count + 1;
+    pl->start_q = queue_new(qcap, pipeline_qfree, pl);
+    pl->merge_q = queue_new(qcap, pipeline_qfree, pl);
+    
+    // Every node needs a worker, or its items would never be processed
+    pl->nodes = numa_node_count();
+    if (pl->nodes > pl->process_count)
+        pl->nodes = pl->process_count;
+    pl->split_q = xmalloc(pl->nodes * sizeof(queue_t*));
+    for (size_t i = 0; i < pl->nodes; ++i)
+        pl->split_q[i] = queue_new(qcap, pipeline_qfree, pl);
+    
+    // Only batch when each worker has several items queued
+    pl->batch = gPipelineBatch ? gPipelineBatch
+        : qsize / (2 * pl->process_count);
+    if (pl->batch < 1)
+        pl->batch = 1;
+    if (pl->batch > PIPELINE_BATCH_MAX)
+        pl->batch = PIPELINE_BATCH_MAX;
+    pl->split_held = xmalloc(pl->nodes * pl->batch
+        * sizeof(pipeline_item_t*));
+    pl->split_held_count = xmalloc(pl->nodes * sizeof(size_t));
+    memset(pl->split_held_count, 0, pl->nodes * sizeof(size_t));
+    
+    pl->merge_window_size = qsize;
+    pl->merge_window = xmalloc(qsize * sizeof(pipeline_item_t*));
+    memset(pl->merge_window, 0, qsize * sizeof(pipeline_item_t*));
+    
+    // Start with everything running, adaptive mode may scale back
+    pl->qsize = pl->inflight_limit = qsize;
+    pl->held = xmalloc(qsize * sizeof(pipeline_item_t*));
+    atomic_init(&pl->active_workers, pl->process_count);
+    pthread_mutex_init(&pl->park_mutex, NULL);
+    pthread_cond_init(&pl->park_cond, NULL);
+    pl->adapt.time = pl->start_ns;
+    
     for (size_t i = 0; i < qsize; ++i) {
         // create blocks, including a margin of error
         pipeline_item_t *item = xmalloc(sizeof(pipeline_item_t));
-        item->data = create();
-        // seq and next are garbage
-        queue_push(gPipelineStartQ, PIPELINE_ITEM, item);
+        item->node = i % pl->nodes;
+        item->data = create(item->node);
+        // seq is garbage
+        queue_push(pl->start_q, PIPELINE_ITEM, item);
     }
-    for (size_t i = 0; i < gPLProcessCount; ++i) {
-        if (pthread_create(&gPLProcessThreads[i], NULL,
-                &pipeline_thread_process, (void*)(uintptr_t)i))
+    for (size_t i = 0; i < pl->process_count; ++i) {
+        pipeline_worker_t *w = &pl->workers[i];
+        *w = (pipeline_worker_t){ .pl = pl, .thnum = i,
+            .node = i % pl->nodes };
+        if (pthread_create(&w->thread, NULL, &pipeline_thread_process, w))
             die("Error creating encode thread");
     }
-    if (pthread_create(&gPLSplitThread, NULL, &pipeline_thread_split, NULL))
+    if (pthread_create(&pl->split_thread, NULL, &pipeline_thread_split, pl))
         die("Error creating read thread");
+    if (gStatsFormat != STATS_NONE)
+        stats_register(pl);
+    trace_thread("writer");
+    return pl;
 }
 
-static void pipeline_qfree(int type, void *p) {
+static void pipeline_qfree(void *ctx, int type, void *p) {
+    pipeline_t *pl = (pipeline_t*)ctx;
     switch (type) {
         case PIPELINE_ITEM: {
             pipeline_item_t *item = (pipeline_item_t*)p;
-            gPLFreer(item->data);
+            pl->freer(item->data);
             free(item);
             break;
         }
@@ -530,68 +735,368 @@ static void pipeline_qfree(int type, void *p) {
     }
 }
 
-static void *pipeline_thread_split(void *ignore) {
-    gPLSplit();
+static void *pipeline_thread_split(void *arg) {
+    pipeline_t *pl = (pipeline_t*)arg;
+    atomic_store(&pl->split_start_ns, monotonic_ns());
+    trace_thread("reader");
+    pl->split(pl);
+    if (!atomic_load(&pl->split_end_ns))
+        atomic_store(&pl->split_end_ns, monotonic_ns());
     return NULL;
 }
 
 static void *pipeline_thread_process(void *arg) {
-    size_t thnum = (uintptr_t)arg;
-    gPLProcess(thnum);
+    pipeline_worker_t *w = (pipeline_worker_t*)arg;
+    atomic_store(&w->start_ns, monotonic_ns());
+    trace_thread("worker %zu", w->thnum);
+    numa_bind_thread(w->node);
+    w->pl->process(w->pl, w->thnum);
+    pipeline_flush_done(w);
+    atomic_store(&w->end_ns, monotonic_ns());
     return NULL;
 }
 
-void pipeline_stop(void) {
+void pipeline_stop(pipeline_t *pl) {
+    for (size_t i = 0; i < pl->nodes; ++i)
+        pipeline_flush_split(pl, i);
+    
+    // waiting for the workers doesn't count as splitting
+    atomic_store(&pl->split_end_ns, monotonic_ns());
+    
+    // wake parked workers, so they see the stop messages
+    pthread_mutex_lock(&pl->park_mutex);
+    pl->stopping = true;
+    atomic_store(&pl->active_workers, pl->process_count);
+    pthread_cond_broadcast(&pl->park_cond);
+    pthread_mutex_unlock(&pl->park_mutex);
+    
     // ask the other threads to stop
-    for (size_t i = 0; i < gPLProcessCount; ++i)
-        queue_push(gPipelineSplitQ, PIPELINE_STOP, NULL);
-    for (size_t i = 0; i < gPLProcessCount; ++i) {
-        if (pthread_join(gPLProcessThreads[i], NULL))
+    for (size_t i = 0; i < pl->process_count; ++i)
+        queue_push(pl->split_q[pl->workers[i].node], PIPELINE_STOP, NULL);
+    for (size_t i = 0; i < pl->process_count; ++i) {
+        if (pthread_join(pl->workers[i].thread, NULL))
             die("Error joining processing thread");
     }
-    queue_push(gPipelineMergeQ, PIPELINE_STOP, NULL);
+    queue_push(pl->merge_q, PIPELINE_STOP, NULL);
 }
 
-void pipeline_destroy(void) {
-    if (pthread_join(gPLSplitThread, NULL))
+void pipeline_destroy(pipeline_t *pl) {
+    if (pthread_join(pl->split_thread, NULL))
         die("Error joining splitter thread");
+    if (!atomic_load(&pl->merge_end_ns))
+        atomic_store(&pl->merge_end_ns, monotonic_ns());
+    if (gStatsFormat != STATS_NONE) {
+        stats_unregister(pl);
+        stats_print(stderr, pl);
+    }
     
-    queue_free(gPipelineStartQ);
-    queue_free(gPipelineSplitQ);
-    queue_free(gPipelineMergeQ);
-    free(gPLProcessThreads);
+    queue_free(pl->start_q);
+    for (size_t i = 0; i < pl->nodes; ++i)
+        queue_free(pl->split_q[i]);
+    free(pl->split_q);
+    free(pl->split_held);
+    free(pl->split_held_count);
+    queue_free(pl->merge_q);
+    for (size_t i = 0; i < pl->held_count; ++i)
+        pipeline_qfree(pl, PIPELINE_ITEM, pl->held[i]);
+    free(pl->held);
+    pthread_mutex_destroy(&pl->park_mutex);
+    pthread_cond_destroy(&pl->park_cond);
+    free(pl->workers);
+    free(pl->merge_window);
+    debug("merge: stalled %zu times, %.3fs", atomic_load(&pl->merge_stalls),
+        atomic_load(&pl->merge_stall_ns) / 1e9);
+    free(pl);
 }
 
-void pipeline_dispatch(pipeline_item_t *item, queue_t *q) {
-    item->seq = gPLSplitSeq++;
-    item->next = NULL;
+void pipeline_dispatch(pipeline_t *pl, pipeline_item_t *item, queue_t *q) {
+    item->seq = pl->split_seq++;
     queue_push(q, PIPELINE_ITEM, item);
 }
 
-void pipeline_split(pipeline_item_t *item) {
-	pipeline_dispatch(item, gPipelineSplitQ);
+void pipeline_split(pipeline_t *pl, pipeline_item_t *item) {
+    item->seq = pl->split_seq++;
+    size_t node = item->node;
+    size_t *count = &pl->split_held_count[node];
+    pl->split_held[node * pl->batch + (*count)++] = item;
+    
+    // Hold on to the item only while this node's workers have plenty to do
+    if (*count == pl->batch || queue_depth(pl->split_q[node])
+            < atomic_load(&pl->active_workers))
+        pipeline_flush_split(pl, node);
+}
+
+static void pipeline_flush_split(pipeline_t *pl, size_t node) {
+    size_t *count = &pl->split_held_count[node];
+    if (*count)
+        queue_push_n(pl->split_q[node], PIPELINE_ITEM,
+            (void**)&pl->split_held[node * pl->batch], *count);
+    *count = 0;
+}
+
+pipeline_item_t *pipeline_fetch(pipeline_t *pl) {
+    // Don't sit on held items while waiting
+    if (queue_depth(pl->start_q) == 0) {
+        for (size_t i = 0; i < pl->nodes; ++i)
+            pipeline_flush_split(pl, i);
+    }
+    pipeline_item_t *item;
+    queue_pop(pl->start_q, (void**)&item);
+    return item;
 }
 
-pipeline_item_t *pipeline_merged() {
+pipeline_item_t *pipeline_merged(pipeline_t *pl) {
+    size_t slot = pl->merge_seq % pl->merge_window_size;
     pipeline_item_t *item;
-    while (!gPLMergedItems || gPLMergedItems->seq != gPLMergeSeq) {
-        // We don't have the next item, wait for a new one
-        pipeline_tag_t tag = queue_pop(gPipelineMergeQ, (void**)&item);
-        if (tag == PIPELINE_STOP)
-            return NULL; // Done processing items
+    bool stalled = false;
+    while (!(item = pl->merge_window[slot])) {
+        // Everything arrives before the stop message
+        if (pl->merge_stopped)
+            return NULL;
         
-        // Insert the item into the queue
-        pipeline_item_t **prev = &gPLMergedItems;
-        while (*prev && (*prev)->seq < item->seq) {
-            prev = &(*prev)->next;
+        // We don't have the next item, wait for a new one. If later items
+        // are already here, we're stuck behind a slow one.
+        uint64_t start = 0;
+        if (pl->merge_pending) {
+            if (!stalled)
+                atomic_fetch_add(&pl->merge_stalls, 1);
+            stalled = true;
+            start = monotonic_ns();
+        }
+        int tags[PIPELINE_BATCH_MAX];
+        pipeline_item_t *items[PIPELINE_BATCH_MAX];
+        size_t n = queue_pop_n(pl->merge_q, tags, (void**)items,
+            PIPELINE_BATCH_MAX);
+        if (start) {
+            atomic_fetch_add(&pl->merge_stall_ns, monotonic_ns() - start);
+            if (gTraceFile)
+                trace_span("stall", start, pl->merge_seq, 0, 0);
+        }
+        
+        for (size_t i = 0; i < n; ++i) {
+            if (tags[i] == PIPELINE_STOP) {
+                atomic_store(&pl->merge_end_ns, monotonic_ns());
+                pl->merge_stopped = true;
+                continue;
+            }
+            pipeline_item_t **dest =
+                &pl->merge_window[items[i]->seq % pl->merge_window_size];
+            if (*dest)
+                die("Merge window overflow at %zu", items[i]->seq);
+            *dest = items[i];
+            ++pl->merge_pending;
         }
-        item->next = *prev;
-        *prev = item;
     }
     
     // Got the next item
-    item = gPLMergedItems;
-    gPLMergedItems = item->next;
-    ++gPLMergeSeq;
+    PROBE(pipeline_merged, item->seq, pl->merge_pending);
+    pl->merge_window[slot] = NULL;
+    --pl->merge_pending;
+    ++pl->merge_seq;
+    if (gPipelineAdaptive)
+        pipeline_adapt(pl);
     return item;
 }
+
+pipeline_item_t *pipeline_next(pipeline_t *pl, size_t thnum) {
+    pipeline_worker_t *w = &pl->workers[thnum];
+    if (w->todo_next < w->todo_count)
+        return w->todo[w->todo_next++];
+    
+    // Hand back what we've done before waiting for more
+    pipeline_flush_done(w);
+    if (w->stopped)
+        return NULL;
+    
+    if (thnum >= atomic_load(&pl->active_workers)) {
+        uint64_t start = monotonic_ns();
+        pthread_mutex_lock(&pl->park_mutex);
+        while (thnum >= atomic_load(&pl->active_workers))
+            pthread_cond_wait(&pl->park_cond, &pl->park_mutex);
+        pthread_mutex_unlock(&pl->park_mutex);
+        atomic_fetch_add(&pl->park_ns, monotonic_ns() - start);
+    }
+    
+    // Take no more than our share, so other workers aren't left idle
+    queue_t *q = pl->split_q[w->node];
+    size_t want = queue_depth(q) / atomic_load(&pl->active_workers);
+    if (want > pl->batch)
+        want = pl->batch;
+    if (want < 1)
+        want = 1;
+    
+    int tags[PIPELINE_BATCH_MAX];
+    size_t n = queue_pop_n(q, tags, (void**)w->todo, want);
+    w->todo_next = 0;
+    w->todo_count = n;
+    for (size_t i = 0; i < n; ++i) {
+        if (tags[i] != PIPELINE_STOP)
+            continue;
+        // Items all come before the stop messages. Just one is ours.
+        w->stopped = true;
+        w->todo_count = i;
+        for (++i; i < n; ++i)
+            queue_push(q, PIPELINE_STOP, NULL);
+    }
+    
+    if (w->todo_count == 0)
+        return NULL;
+    return w->todo[w->todo_next++];
+}
+
+void pipeline_done(pipeline_t *pl, size_t thnum, pipeline_item_t *item) {
+    pipeline_worker_t *w = &pl->workers[thnum];
+    w->done[w->done_count++] = item;
+    if (w->done_count == pl->batch)
+        pipeline_flush_done(w);
+}
+
+static void pipeline_flush_done(pipeline_worker_t *w) {
+    if (w->done_count)
+        queue_push_n(w->pl->merge_q, PIPELINE_ITEM, (void**)w->done,
+            w->done_count);
+    w->done_count = 0;
+}
+
+void pipeline_recycle(pipeline_t *pl, pipeline_item_t *item) {
+    if (pl->qsize - pl->held_count > pl->inflight_limit)
+        pl->held[pl->held_count++] = item;
+    else
+        queue_push(pl->start_q, PIPELINE_ITEM, item);
+}
+
+
+#pragma mark ADAPTIVE
+
+// How much memory the pipeline may use: the -m budget, and most of our
+// cgroup's limit, leaving room for everything else. Zero if unlimited.
+uint64_t pipeline_memory_budget(void) {
+    uint64_t budget = gPipelineMemory;
+    uint64_t limit = memory_limit() / 4 * 3;
+    if (limit && (!budget || limit < budget))
+        budget = limit;
+    return budget;
+}
+
+// Shrink the defaults until we fit in the memory budget, less what's used
+// outside the pipeline. An explicit -q is honoured, -p is only a maximum
+// anyhow.
+static size_t pipeline_fit_memory(pipeline_t *pl, size_t qsize,
+        size_t item_mem, size_t worker_mem, uint64_t reserved_mem) {
+    uint64_t budget = pipeline_memory_budget();
+    if (!budget || !item_mem)
+        return qsize;
+    // Leave at least something, fitting will warn if it's not enough
+    budget = budget > reserved_mem ? budget - reserved_mem : 1;
+    
+    size_t workers = pl->process_count, orig = qsize;
+    while ((uint64_t)workers * worker_mem + (uint64_t)qsize * item_mem
+            > budget) {
+        if (!gPipelineQSize && qsize > PIPELINE_MIN_QSIZE(workers)) {
+            --qsize;
+        } else if (workers > 1) {
+            --workers;
+            if (!gPipelineQSize && qsize > pipeline_default_qsize(workers))
+                qsize = pipeline_default_qsize(workers);
+        } else {
+            fprintf(stderr, "Warning: memory use may exceed the limit of "
+                "%" PRIu64 " MiB\n", budget >> 20);
+            break;
+        }
+    }
+    if (workers != pl->process_count || qsize != orig)
+        debug("memory budget %" PRIu64 " MiB: %zu workers, %zu blocks",
+            budget >> 20, workers, qsize);
+    pl->process_count = workers;
+    return qsize;
+}
+
+static size_t pipeline_default_qsize(size_t workers) {
+    return ceil(workers * 1.3 + 1);
+}
+
+static void pipeline_set_inflight(pipeline_t *pl, size_t limit) {
+    pl->inflight_limit = limit;
+    while (pl->held_count && pl->qsize - pl->held_count < limit)
+        queue_push(pl->start_q, PIPELINE_ITEM, pl->held[--pl->held_count]);
+}
+
+// Size the active workers to match the rate the reader can supply data,
+// and put more items in flight if the merger stalls while the reader is
+// starved of them.
+static void pipeline_adapt(pipeline_t *pl) {
+    pipeline_adapt_t *prev = &pl->adapt;
+    uint64_t now = monotonic_ns();
+    uint64_t items = atomic_load(&pl->counts[PIPELINE_STAGE_PROCESS].items);
+    if (now - prev->time < ADAPT_INTERVAL_NS || items == prev->process_items)
+        return; // not enough to go on
+    
+    pipeline_adapt_t cur = {
+        .time = now,
+        .start_wait = atomic_load(&pl->start_q->wait_ns),
+        .split_wait = pipeline_split_wait(pl),
+        .split_bytes = atomic_load(&pl->counts[PIPELINE_STAGE_SPLIT].bytes_in),
+        .process_bytes =
+            atomic_load(&pl->counts[PIPELINE_STAGE_PROCESS].bytes_in),
+        .process_items = items,
+        .stalls = atomic_load(&pl->merge_stalls),
+        .extra = prev->extra,
+    };
+    double dt = cur.time - prev->time;
+    size_t active = atomic_load(&pl->active_workers);
+    
+    // Time the reader spends waiting for free items says nothing about how
+    // fast it can read
+    double reader_wait = cur.start_wait - prev->start_wait;
+    double reader_busy = fmax(dt - reader_wait, dt / 100);
+    double worker_busy = fmax(active * dt - (cur.split_wait - prev->split_wait),
+        dt / 100);
+    double reader_rate = (cur.split_bytes - prev->split_bytes) / reader_busy;
+    double worker_rate = (cur.process_bytes - prev->process_bytes) / worker_busy;
+    
+    size_t want = worker_rate > 0 ? ceil(reader_rate / worker_rate) : active;
+    if (want > pl->process_count)
+        want = pl->process_count;
+    // One step at a time, to damp oscillation. Keep a worker on each node.
+    if (want < pl->nodes)
+        want = pl->nodes;
+    pthread_mutex_lock(&pl->park_mutex);
+    if (!pl->stopping && want != active) {
+        active += (want > active) ? 1 : -1;
+        atomic_store(&pl->active_workers, active);
+        pthread_cond_broadcast(&pl->park_cond);
+    }
+    pthread_mutex_unlock(&pl->park_mutex);
+    
+    bool starved = reader_wait > dt / 10;
+    if (cur.stalls != prev->stalls && starved)
+        ++cur.extra;
+    else if (cur.stalls == prev->stalls && cur.extra)
+        --cur.extra;
+    size_t base = pipeline_default_qsize(active);
+    if (base > pl->qsize)
+        base = pl->qsize;
+    if (base + cur.extra > pl->qsize)
+        cur.extra = pl->qsize - base;
+    pipeline_set_inflight(pl, base + cur.extra);
+    
+    debug("adapt: reader %.1f MB/s, worker %.1f MB/s, %zu workers, "
+        "%zu in flight", reader_rate * 1e3, worker_rate * 1e3, active,
+        pl->inflight_limit);
+    *prev = cur;
+}
+
+uint64_t pipeline_split_wait(pipeline_t *pl) {
+    uint64_t wait = 0;
+    for (size_t i = 0; i < pl->nodes; ++i)
+        wait += atomic_load(&pl->split_q[i]->wait_ns);
+    return wait;
+}
+
+void pipeline_account(pipeline_t *pl, pipeline_stage_t stage, size_t in,
+        size_t out) {
+    pipeline_counts_t *c = &pl->counts[stage];
+    atomic_fetch_add_explicit(&c->items, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->bytes_in, in, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->bytes_out, out, memory_order_relaxed);
+}
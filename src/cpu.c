@@ -2,34 +2,180 @@
 
 #include "config.h"
 
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #ifdef HAVE_SCHED_GETAFFINITY
 #include <sched.h>
 #endif
 
-#ifdef HAVE_SYSCONF
-#include <unistd.h>
-#endif
-
 #ifdef HAVE_GETSYSTEMINFO
 #include <sysinfoapi.h>
 #endif
 
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+// cgroup v1 reports no memory limit as a huge number
+#define CGROUP_V1_UNLIMITED (1ULL << 60)
+
+static size_t cgroup_cpus(void);
+static void cgroup_dir(const char *controller, char *dir, size_t size,
+    size_t *mountlen, bool *v2);
+static bool cgroup_parent(char *dir, size_t mountlen);
+static bool cgroup_read(const char *dir, const char *file, char *buf,
+    size_t size);
+
 size_t num_threads(void) {
+    size_t cpus = 0;
 #ifdef HAVE_SCHED_GETAFFINITY
     cpu_set_t cpu_set;
     CPU_ZERO(&cpu_set);
     if (sched_getaffinity(0, sizeof cpu_set, &cpu_set) == 0)
-        return CPU_COUNT(&cpu_set);
+        cpus = CPU_COUNT(&cpu_set);
 #endif
 
+    if (!cpus) {
 #ifdef HAVE_SYSCONF
-    return sysconf(_SC_NPROCESSORS_ONLN);
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
 #elif HAVE_GETSYSTEMINFO
-    SYSTEM_INFO sysinfo;
-    GetSystemInfo(&sysinfo);
-    return sysinfo.dwNumberOfProcessors;
+        SYSTEM_INFO sysinfo;
+        GetSystemInfo(&sysinfo);
+        cpus = sysinfo.dwNumberOfProcessors;
 #else
 #warning "No processor-detection enabled! Assuming 2 CPUs"
-    return 2;
+        cpus = 2;
 #endif
+    }
+
+    // A CPU quota means extra threads just get throttled
+    size_t quota = cgroup_cpus();
+    if (quota && quota < cpus)
+        cpus = quota;
+    return cpus;
+}
+
+
+#pragma mark CGROUPS
+
+// Find our cgroup directory for a controller. With PIXZ_CGROUP_DIR set,
+// that directory is used as-is, for testing.
+static void cgroup_dir(const char *controller, char *dir, size_t size,
+        size_t *mountlen, bool *v2) {
+    const char *root = getenv("PIXZ_CGROUP_DIR");
+    bool fake = root;
+    if (!root)
+        root = CGROUP_ROOT;
+
+    char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "%s/cgroup.controllers", root);
+    *v2 = access(buf, F_OK) == 0;
+    if (*v2)
+        snprintf(dir, size, "%s", root);
+    else
+        snprintf(dir, size, "%s/%s", root, controller);
+    *mountlen = strlen(dir);
+    if (fake)
+        return;
+
+    // Lines look like "4:memory:/path" (v1) or "0::/path" (v2)
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f)
+        return; // just use the root
+    char line[PATH_MAX];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *ctls = strchr(line, ':');
+        char *path = ctls ? strchr(ctls + 1, ':') : NULL;
+        if (!path)
+            continue;
+        *path++ = '\0';
+        ++ctls;
+
+        bool match = false;
+        if (*v2) {
+            match = !*ctls;
+        } else {
+            for (char *c = strtok(ctls, ","); c; c = strtok(NULL, ","))
+                match = match || strcmp(c, controller) == 0;
+        }
+        if (match && strcmp(path, "/") != 0) {
+            snprintf(dir + *mountlen, size - *mountlen, "%s", path);
+            break;
+        }
+    }
+    fclose(f);
+}
+
+// Move to the parent cgroup, limits there apply to us too
+static bool cgroup_parent(char *dir, size_t mountlen) {
+    char *slash = strrchr(dir + mountlen, '/');
+    if (!slash)
+        return false;
+    *slash = '\0';
+    return true;
+}
+
+static bool cgroup_read(const char *dir, const char *file, char *buf,
+        size_t size) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+    bool ok = fgets(buf, size, f);
+    fclose(f);
+    return ok;
+}
+
+// The CPU quota, rounded up, or zero if there is none
+static size_t cgroup_cpus(void) {
+    char dir[PATH_MAX], buf[64];
+    size_t mountlen;
+    bool v2;
+    cgroup_dir("cpu", dir, sizeof(dir), &mountlen, &v2);
+
+    double cpus = 0;
+    do {
+        double quota = -1, period = 0;
+        if (v2) {
+            // "max 100000" or "400000 100000"
+            if (cgroup_read(dir, "cpu.max", buf, sizeof(buf))
+                    && strncmp(buf, "max", 3) != 0)
+                sscanf(buf, "%lf %lf", &quota, &period);
+        } else {
+            if (cgroup_read(dir, "cpu.cfs_quota_us", buf, sizeof(buf)))
+                quota = atof(buf);
+            if (cgroup_read(dir, "cpu.cfs_period_us", buf, sizeof(buf)))
+                period = atof(buf);
+        }
+        if (quota > 0 && period > 0 && (!cpus || quota / period < cpus))
+            cpus = quota / period;
+    } while (cgroup_parent(dir, mountlen));
+    return ceil(cpus);
+}
+
+uint64_t memory_limit(void) {
+    char dir[PATH_MAX], buf[64];
+    size_t mountlen;
+    bool v2;
+    cgroup_dir("memory", dir, sizeof(dir), &mountlen, &v2);
+
+    uint64_t limit = 0;
+    do {
+        uint64_t l = 0;
+        if (cgroup_read(dir, v2 ? "memory.max" : "memory.limit_in_bytes",
+                buf, sizeof(buf)) && strncmp(buf, "max", 3) != 0)
+            l = strtoull(buf, NULL, 10);
+        if (l >= CGROUP_V1_UNLIMITED)
+            l = 0;
+        if (l && (!limit || l < limit))
+            limit = l;
+    } while (cgroup_parent(dir, mountlen));
+    return limit;
 }
@@ -0,0 +1,222 @@
+#include "pixz.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Identical blocks within one run, found by a 128-bit hash of their input.
+// The first block with some contents is encoded as usual, and the writer
+// keeps a copy of its output. Later copies skip the encoder, and the writer
+// emits the kept output for them instead. Blocks reach the writer in order,
+// so a copy only ever waits on an earlier block.
+//
+// Matches aren't compared byte for byte, the input is gone by then. So the
+// hash is SipHash with a random key, which input can't be crafted to
+// collide with. It's still far faster than any encoder.
+//
+// Kept outputs are bounded in total size. Once over, the oldest outputs no
+// block is waiting on are dropped.
+
+#define DEDUP_BUCKETS 4096
+
+size_t gDedupSize = 0;
+
+struct dedup_entry_t {
+    uint64_t hash[2];
+    size_t size;        // of the input
+    size_t seq;         // the block that's encoded
+    bool written;
+    uint8_t *output;    // a copy of its output, once written and kept
+    size_t outsize;
+    lzma_vli unpadded;
+    size_t refs;        // blocks in flight that point here
+    dedup_entry_t *next;            // in the bucket
+    dedup_entry_t *older, *newer;   // kept outputs
+};
+
+struct dedup_t {
+    pthread_mutex_t mutex;
+    uint64_t key[2];
+    size_t budget, kept;
+    dedup_entry_t *buckets[DEDUP_BUCKETS];
+    dedup_entry_t *oldest, *newest;
+};
+
+
+#pragma mark DECLARE
+
+static void dedup_hash(const uint64_t key[2], const uint8_t *in, size_t size,
+    uint64_t hash[2]);
+static void dedup_release(dedup_t *d, dedup_entry_t *e);
+static void dedup_drop(dedup_t *d, dedup_entry_t *e);
+
+
+#pragma mark DEFINE
+
+dedup_t *dedup_new(size_t budget) {
+    dedup_t *d = xmalloc(sizeof(dedup_t));
+    *d = (dedup_t){ .budget = budget };
+    pthread_mutex_init(&d->mutex, NULL);
+
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, d->key, sizeof(d->key)) != sizeof(d->key)) {
+        d->key[0] = monotonic_ns();
+        d->key[1] = getpid() ^ (uintptr_t)d;
+    }
+    if (fd >= 0)
+        close(fd);
+    return d;
+}
+
+void dedup_free(dedup_t *d) {
+    for (size_t i = 0; i < DEDUP_BUCKETS; ++i) {
+        dedup_entry_t *e = d->buckets[i], *next;
+        for (; e; e = next) {
+            next = e->next;
+            free(e->output);
+            free(e);
+        }
+    }
+    pthread_mutex_destroy(&d->mutex);
+    free(d);
+}
+
+dedup_entry_t *dedup_find(dedup_t *d, const uint8_t *in, size_t size,
+        size_t seq, bool *dup) {
+    uint64_t hash[2];
+    dedup_hash(d->key, in, size, hash);
+    dedup_entry_t **bucket = &d->buckets[hash[0] % DEDUP_BUCKETS], *e;
+
+    pthread_mutex_lock(&d->mutex);
+    for (e = *bucket; e; e = e->next)
+        if (e->hash[0] == hash[0] && e->hash[1] == hash[1] && e->size == size)
+            break;
+    *dup = false;
+    if (!e) {
+        e = xmalloc(sizeof(dedup_entry_t));
+        *e = (dedup_entry_t){ .hash = { hash[0], hash[1] }, .size = size,
+            .seq = seq, .next = *bucket };
+        *bucket = e;
+    } else if (e->seq < seq && (!e->written || e->output)) {
+        *dup = true;
+    } else if (e->seq > seq || !e->output) {
+        // We're written first, or its output is gone, so use ours
+        e->seq = seq;
+        e->written = false;
+    }
+    ++e->refs;
+    pthread_mutex_unlock(&d->mutex);
+    return e;
+}
+
+void dedup_written(dedup_t *d, dedup_entry_t *e, size_t seq,
+        const uint8_t *out, size_t outsize, lzma_vli unpadded) {
+    pthread_mutex_lock(&d->mutex);
+    if (e->seq == seq) {
+        e->written = true;
+        // Make room, but always keep what a later block is waiting for
+        for (dedup_entry_t *o = d->oldest, *newer; o
+                && d->kept + outsize > d->budget; o = newer) {
+            newer = o->newer;
+            if (!o->refs)
+                dedup_drop(d, o);
+        }
+        if (e->refs > 1 || d->kept + outsize <= d->budget) {
+            e->output = xmalloc(outsize);
+            memcpy(e->output, out, outsize);
+            e->outsize = outsize;
+            e->unpadded = unpadded;
+            d->kept += outsize;
+            e->older = d->newest;
+            if (d->newest)
+                d->newest->newer = e;
+            else
+                d->oldest = e;
+            d->newest = e;
+        }
+    }
+    dedup_release(d, e);
+    pthread_mutex_unlock(&d->mutex);
+}
+
+size_t dedup_copy(dedup_t *d, dedup_entry_t *e, uint8_t *out,
+        lzma_vli *unpadded) {
+    pthread_mutex_lock(&d->mutex);
+    if (!e->output)
+        die("Duplicate block has no output to copy");
+    size_t outsize = e->outsize;
+    memcpy(out, e->output, outsize);
+    *unpadded = e->unpadded;
+    dedup_release(d, e);
+    pthread_mutex_unlock(&d->mutex);
+    return outsize;
+}
+
+// A block is done with an entry. Forget it, if it's no use to anyone.
+static void dedup_release(dedup_t *d, dedup_entry_t *e) {
+    if (!--e->refs && !e->output && e->written)
+        dedup_drop(d, e);
+}
+
+static void dedup_drop(dedup_t *d, dedup_entry_t *e) {
+    if (e->output) {
+        d->kept -= e->outsize;
+        free(e->output);
+        if (e->older)
+            e->older->newer = e->newer;
+        else
+            d->oldest = e->newer;
+        if (e->newer)
+            e->newer->older = e->older;
+        else
+            d->newest = e->older;
+    }
+    dedup_entry_t **p = &d->buckets[e->hash[0] % DEDUP_BUCKETS];
+    while (*p != e)
+        p = &(*p)->next;
+    *p = e->next;
+    free(e);
+}
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND do { \
+        v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+        v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+    } while (0)
+
+// SipHash-2-4, with 128-bit output. Words are read in native byte order,
+// hashes never leave this run.
+static void dedup_hash(const uint64_t key[2], const uint8_t *in, size_t size,
+        uint64_t hash[2]) {
+    uint64_t v0 = 0x736f6d6570736575ull ^ key[0];
+    uint64_t v1 = 0x646f72616e646f6dull ^ key[1] ^ 0xee;
+    uint64_t v2 = 0x6c7967656e657261ull ^ key[0];
+    uint64_t v3 = 0x7465646279746573ull ^ key[1];
+
+    const uint8_t *end = in + size - size % 8;
+    for (; in < end; in += 8) {
+        uint64_t m;
+        memcpy(&m, in, sizeof(m));
+        v3 ^= m;
+        SIP_ROUND;
+        SIP_ROUND;
+        v0 ^= m;
+    }
+    uint64_t m = (uint64_t)size << 56;
+    for (size_t i = 0; i < size % 8; ++i)
+        m |= (uint64_t)in[i] << (8 * i);
+    v3 ^= m;
+    SIP_ROUND;
+    SIP_ROUND;
+    v0 ^= m;
+
+    v2 ^= 0xee;
+    for (int i = 0; i < 4; ++i)
+        SIP_ROUND;
+    hash[0] = v0 ^ v1 ^ v2 ^ v3;
+    v1 ^= 0xdd;
+    for (int i = 0; i < 4; ++i)
+        SIP_ROUND;
+    hash[1] = v0 ^ v1 ^ v2 ^ v3;
+}
@@ -2,16 +2,18 @@
 
 #pragma mark FUNCTION DEFINITIONS
 
-void pixz_list(bool tar) {
-    if (!decode_index())
+void pixz_list(FILE *in, bool tar) {
+    lzma_index *index = decode_index(in);
+    if (!index)
 		die("Can't list non-seekable input");
 	
     lzma_index_iter iter;
-    lzma_index_iter_init(&iter, gIndex);
+    lzma_index_iter_init(&iter, index);
 
-    if (tar && read_file_index()) {
-        dump_file_index(stdout, false);
-        free_file_index();
+    file_index_t *files;
+    if (tar && read_file_index(in, index, &files)) {
+        dump_file_index(stdout, files, false);
+        free_file_index(files);
     } else {
         while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
             printf("%9"PRIuMAX" / %9"PRIuMAX"\n",
@@ -20,6 +22,5 @@ void pixz_list(bool tar) {
         }
     }
     
-    lzma_index_end(gIndex, NULL);
-    lzma_end(&gStream);
+    lzma_index_end(index, NULL);
 }
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+
+#include "pixz.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_MEMPOLICY_H
+#include <linux/mempolicy.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+#if defined(HAVE_LINUX_MEMPOLICY_H) && defined(SYS_mbind)
+	#define NUMA_MBIND 1
+#endif
+
+#define NUMA_SYSFS "/sys/devices/system/node"
+
+bool gNuma = false;
+
+typedef struct {
+    size_t id;
+    size_t ncpus;
+    int *cpus;
+} numa_node_t;
+
+static numa_node_t *gNumaNodes = NULL;
+static size_t gNumaNodeCount = 0;
+
+
+#pragma mark DECLARE
+
+static bool numa_parse_cpulist(const char *path, numa_node_t *node);
+static int numa_node_cmp(const void *a, const void *b);
+
+
+#pragma mark TOPOLOGY
+
+// Parse a list like "0-3,8-11"
+static bool numa_parse_cpulist(const char *path, numa_node_t *node) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    node->ncpus = 0;
+    node->cpus = NULL;
+    size_t cap = 0;
+    unsigned long lo, hi;
+    int c;
+    while (fscanf(f, "%lu", &lo) == 1) {
+        hi = lo;
+        if ((c = fgetc(f)) == '-') {
+            if (fscanf(f, "%lu", &hi) != 1)
+                break;
+            c = fgetc(f);
+        }
+        for (unsigned long cpu = lo; cpu <= hi; ++cpu) {
+            if (node->ncpus == cap) {
+                cap = cap ? cap * 2 : 16;
+                node->cpus = realloc(node->cpus, cap * sizeof(int));
+                if (!node->cpus)
+                    die("Out of memory");
+            }
+            node->cpus[node->ncpus++] = cpu;
+        }
+        if (c != ',')
+            break;
+    }
+    fclose(f);
+    return node->ncpus > 0;
+}
+
+static int numa_node_cmp(const void *a, const void *b) {
+    const numa_node_t *na = a, *nb = b;
+    return (na->id > nb->id) - (na->id < nb->id);
+}
+
+void numa_init(void) {
+    const char *dir = getenv("PIXZ_NUMA_DIR");
+    if (!dir)
+        dir = NUMA_SYSFS;
+
+    DIR *d = opendir(dir);
+    size_t cap = 0;
+    if (d) {
+        struct dirent *ent;
+        while ((ent = readdir(d))) {
+            if (strncmp(ent->d_name, "node", 4) != 0
+                    || !isdigit((unsigned char)ent->d_name[4]))
+                continue;
+
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s/cpulist", dir, ent->d_name);
+            numa_node_t node = { .id = strtoul(ent->d_name + 4, NULL, 10) };
+            if (!numa_parse_cpulist(path, &node))
+                continue; // memory-only node, no use to us
+
+            if (gNumaNodeCount == cap) {
+                cap = cap ? cap * 2 : 4;
+                gNumaNodes = realloc(gNumaNodes, cap * sizeof(numa_node_t));
+                if (!gNumaNodes)
+                    die("Out of memory");
+            }
+            gNumaNodes[gNumaNodeCount++] = node;
+        }
+        closedir(d);
+    }
+
+    if (gNumaNodeCount == 0) {
+        fprintf(stderr, "Warning: no NUMA topology found, ignoring --numa\n");
+        gNuma = false;
+        return;
+    }
+    qsort(gNumaNodes, gNumaNodeCount, sizeof(numa_node_t), numa_node_cmp);
+    gNuma = true;
+    for (size_t i = 0; i < gNumaNodeCount; ++i)
+        debug("numa: node %zu has %zu cpus", gNumaNodes[i].id,
+            gNumaNodes[i].ncpus);
+}
+
+size_t numa_node_count(void) {
+    return gNuma ? gNumaNodeCount : 1;
+}
+
+void numa_bind_thread(size_t node) {
+    if (!gNuma)
+        return;
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    numa_node_t *n = &gNumaNodes[node % gNumaNodeCount];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < n->ncpus; ++i) {
+        if (n->cpus[i] < CPU_SETSIZE)
+            CPU_SET(n->cpus[i], &set);
+    }
+    // Not fatal, the CPUs may be offline or outside our cgroup
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+        debug("numa: can't bind thread to node %zu", n->id);
+#endif
+}
+
+
+#pragma mark MEMORY
+
+void numa_bind_memory(void *ptr, size_t len, size_t node) {
+    if (!gNuma)
+        return;
+#ifdef NUMA_MBIND
+    // Failure just means we get the kernel's default placement
+    size_t id = gNumaNodes[node % gNumaNodeCount].id;
+    unsigned long mask[id / (8 * sizeof(unsigned long)) + 1];
+    memset(mask, 0, sizeof(mask));
+    mask[id / (8 * sizeof(unsigned long))] |=
+        1UL << (id % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_mbind, ptr, len, MPOL_PREFERRED, mask, id + 2, 0) != 0)
+        debug("numa: mbind to node %zu failed: %s", id, strerror(errno));
+#else
+    (void)ptr; (void)len; (void)node;
+#endif
+}
@@ -0,0 +1,406 @@
+#define _GNU_SOURCE
+
+#include "pixz.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(SYS_io_uring_setup)
+	#define OUTPUT_URING 1
+#endif
+
+// Writing happens on a thread of its own, so the merger can keep taking
+// blocks from the workers while the kernel is busy. Blocks are handed over
+// in the pool buffers they were encoded into, and freed once written.
+//
+// Regular files are written with io_uring, several writes in flight at
+// their own offsets. Anything else, or without io_uring, gets a thread
+// gathering whatever is queued into one writev.
+
+#define OUTPUT_IOV 16
+#define OUTPUT_META SIZE_MAX // seq of writes that aren't blocks
+
+enum { OUTPUT_BUF, OUTPUT_STOP };
+
+typedef struct {
+    uint8_t *data;
+    size_t len, done;
+    size_t seq;
+    bool pooled;
+    off_t offset;
+    uint64_t trace;
+    struct iovec iov;
+} output_buf_t;
+
+#ifdef OUTPUT_URING
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len, sqes_len;
+    size_t pending; // submissions not yet entered
+} output_ring_t;
+#endif
+
+struct output_t {
+    FILE *file;
+    int fd;
+    queue_t *q;
+    pthread_t thread;
+
+    // Buffers handed over and not yet written, at most OUTPUT_MAX blocks
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    size_t blocks;
+
+    off_t offset; // where the next write goes, with io_uring
+#ifdef OUTPUT_URING
+    bool uring;
+    output_ring_t ring;
+#endif
+};
+
+
+#pragma mark DECLARE
+
+static void output_push(output_t *o, output_buf_t *buf);
+static void output_done(output_t *o, output_buf_t *buf);
+static void output_qfree(void *ctx, int type, void *p);
+static void *output_thread_writev(void *arg);
+
+#ifdef OUTPUT_URING
+static bool ring_open(output_ring_t *r, unsigned entries);
+static void ring_close(output_ring_t *r);
+static void ring_submit(output_t *o, output_buf_t *buf);
+static void ring_enter(output_t *o, unsigned wait);
+static size_t ring_reap(output_t *o);
+static void *output_thread_uring(void *arg);
+#endif
+
+
+#pragma mark API
+
+output_t *output_open(FILE *file) {
+    output_t *o = xmalloc(sizeof(output_t));
+    *o = (output_t){ .file = file, .fd = fileno(file) };
+    fflush(file);
+    // Room for every block and some small writes. Small writes aren't
+    // counted, so a long run of them, like a big index, can fill the queue,
+    // and then waits for the output thread to catch up.
+    o->q = queue_new(OUTPUT_MAX * 4, output_qfree, o);
+    pthread_mutex_init(&o->mutex, NULL);
+    pthread_cond_init(&o->cond, NULL);
+
+    void *(*thread)(void *) = output_thread_writev;
+#ifdef OUTPUT_URING
+    // Writes at explicit offsets need a seekable file, and O_APPEND would
+    // ignore the offsets
+    struct stat st;
+    int flags = fcntl(o->fd, F_GETFL);
+    if (!(gDisable & DISABLE_URING) && fstat(o->fd, &st) == 0
+            && S_ISREG(st.st_mode) && flags != -1 && !(flags & O_APPEND)
+            && (o->offset = lseek(o->fd, 0, SEEK_CUR)) != -1
+            && ring_open(&o->ring, OUTPUT_MAX * 2)) {
+        o->uring = true;
+        thread = output_thread_uring;
+    }
+    debug("output: %s", o->uring ? "io_uring" : "writev");
+#endif
+
+    if (pthread_create(&o->thread, NULL, thread, o))
+        die("Error creating output thread");
+    return o;
+}
+
+void output_write(output_t *o, const void *data, size_t len) {
+    if (!len)
+        return;
+    output_buf_t *buf = xmalloc(sizeof(output_buf_t));
+    *buf = (output_buf_t){ .data = xmalloc(len), .len = len,
+        .seq = OUTPUT_META };
+    memcpy(buf->data, data, len);
+    output_push(o, buf);
+}
+
+void output_block(output_t *o, size_t seq, void *data, size_t len) {
+    pthread_mutex_lock(&o->mutex);
+    while (o->blocks >= OUTPUT_MAX)
+        pthread_cond_wait(&o->cond, &o->mutex);
+    ++o->blocks;
+    pthread_mutex_unlock(&o->mutex);
+
+    output_buf_t *buf = xmalloc(sizeof(output_buf_t));
+    *buf = (output_buf_t){ .data = data, .len = len, .seq = seq,
+        .pooled = true, .trace = trace_begin() };
+    output_push(o, buf);
+}
+
+void output_close(output_t *o) {
+    queue_push(o->q, OUTPUT_STOP, NULL);
+    pthread_join(o->thread, NULL);
+#ifdef OUTPUT_URING
+    if (o->uring) {
+        ring_close(&o->ring);
+        // Leave the file position after what we wrote, as write would
+        lseek(o->fd, o->offset, SEEK_SET);
+    }
+#endif
+    queue_free(o->q);
+    pthread_mutex_destroy(&o->mutex);
+    pthread_cond_destroy(&o->cond);
+    if (fclose(o->file) != 0)
+        die("Error closing output file");
+    free(o);
+}
+
+
+#pragma mark BUFFERS
+
+static void output_push(output_t *o, output_buf_t *buf) {
+    // Offsets are handed out in order, so writes can complete in any order
+    buf->offset = o->offset;
+    o->offset += buf->len;
+    queue_push(o->q, OUTPUT_BUF, buf);
+}
+
+static void output_done(output_t *o, output_buf_t *buf) {
+    if (buf->seq != OUTPUT_META) {
+        trace_end("write", buf->trace, buf->seq, buf->len, buf->len);
+        PROBE(write_block_done, buf->seq, buf->len);
+    }
+    if (buf->pooled) {
+        pool_free(buf->data);
+        pthread_mutex_lock(&o->mutex);
+        --o->blocks;
+        pthread_cond_signal(&o->cond);
+        pthread_mutex_unlock(&o->mutex);
+    } else {
+        free(buf->data);
+    }
+    free(buf);
+}
+
+static void output_qfree(void *ctx, int type, void *p) {
+    if (type == OUTPUT_BUF)
+        output_done((output_t*)ctx, (output_buf_t*)p);
+}
+
+
+#pragma mark WRITEV
+
+static void *output_thread_writev(void *arg) {
+    output_t *o = (output_t*)arg;
+    trace_thread("output");
+    int types[OUTPUT_IOV];
+    void *bufs[OUTPUT_IOV];
+    struct iovec iov[OUTPUT_IOV];
+    bool stopped = false;
+    while (!stopped) {
+        size_t n = queue_pop_n(o->q, types, bufs, OUTPUT_IOV);
+        size_t nbuf = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (types[i] == OUTPUT_STOP) {
+                stopped = true; // nothing comes after it
+                break;
+            }
+            output_buf_t *buf = (output_buf_t*)bufs[i];
+            iov[nbuf++] = (struct iovec){ .iov_base = buf->data,
+                .iov_len = buf->len };
+        }
+
+        // Write everything, coping with short writes
+        struct iovec *v = iov;
+        size_t nv = nbuf;
+        while (nv) {
+            ssize_t wr = writev(o->fd, v, nv);
+            if (wr < 0 && errno == EINTR)
+                continue;
+            if (wr <= 0)
+                die("Error writing output: %s", strerror(errno));
+            while (nv && (size_t)wr >= v->iov_len) {
+                wr -= v->iov_len;
+                ++v;
+                --nv;
+            }
+            if (nv) {
+                v->iov_base = (uint8_t*)v->iov_base + wr;
+                v->iov_len -= wr;
+            }
+        }
+        for (size_t i = 0; i < nbuf; ++i)
+            output_done(o, (output_buf_t*)bufs[i]);
+    }
+    return NULL;
+}
+
+
+#pragma mark URING
+
+#ifdef OUTPUT_URING
+
+// The rings are shared with the kernel, which reads and writes their
+// indices concurrently
+#define RING_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define RING_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static bool ring_open(output_ring_t *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    *r = (output_ring_t){ .sq_map = MAP_FAILED, .cq_map = MAP_FAILED,
+        .sqes = MAP_FAILED };
+    r->fd = syscall(SYS_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        debug("output: no io_uring: %s", strerror(errno));
+        return false;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_map = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED
+            || r->sqes == MAP_FAILED) {
+        ring_close(r);
+        return false;
+    }
+
+    uint8_t *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return true;
+}
+
+static void ring_close(output_ring_t *r) {
+    if (r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_map != MAP_FAILED)
+        munmap(r->cq_map, r->cq_len);
+    if (r->sq_map != MAP_FAILED)
+        munmap(r->sq_map, r->sq_len);
+    close(r->fd);
+}
+
+// Queue a write of whatever's left of buf. Uses writev, which every
+// io_uring kernel supports.
+static void ring_submit(output_t *o, output_buf_t *buf) {
+    output_ring_t *r = &o->ring;
+    unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;
+    buf->iov = (struct iovec){ .iov_base = buf->data + buf->done,
+        .iov_len = buf->len - buf->done };
+
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = o->fd;
+    sqe->addr = (uintptr_t)&buf->iov;
+    sqe->len = 1;
+    sqe->off = buf->offset + buf->done;
+    sqe->user_data = (uintptr_t)buf;
+    r->sq_array[idx] = idx;
+    RING_STORE(r->sq_tail, tail + 1);
+    ++r->pending;
+}
+
+// Hand queued writes to the kernel, and optionally wait for completions
+static void ring_enter(output_t *o, unsigned wait) {
+    output_ring_t *r = &o->ring;
+    while (true) {
+        int ret = syscall(SYS_io_uring_enter, r->fd, r->pending, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0) {
+            r->pending -= ret;
+            if (!r->pending || wait)
+                return;
+        } else if (errno != EINTR && errno != EAGAIN) {
+            die("Error submitting output: %s", strerror(errno));
+        }
+    }
+}
+
+// Finish completed writes, resubmitting any that were short. Returns how
+// many are done.
+static size_t ring_reap(output_t *o) {
+    output_ring_t *r = &o->ring;
+    size_t done = 0;
+    unsigned head = *r->cq_head;
+    while (head != RING_LOAD(r->cq_tail)) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        output_buf_t *buf = (output_buf_t*)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        RING_STORE(r->cq_head, ++head);
+
+        if (res == -EINTR || res == -EAGAIN) {
+            ring_submit(o, buf);
+        } else if (res <= 0) {
+            die("Error writing output: %s",
+                res ? strerror(-res) : "no progress");
+        } else if ((buf->done += res) < buf->len) {
+            ring_submit(o, buf);
+        } else {
+            output_done(o, buf);
+            ++done;
+        }
+    }
+    return done;
+}
+
+static void *output_thread_uring(void *arg) {
+    output_t *o = (output_t*)arg;
+    trace_thread("output");
+    size_t depth = *o->ring.sq_mask + 1, inflight = 0;
+    int types[OUTPUT_IOV];
+    void *bufs[OUTPUT_IOV];
+    bool stopped = false;
+    while (!stopped || inflight) {
+        // Take more work if there's room, waiting only if idle
+        if (!stopped && inflight < depth
+                && (!inflight || queue_depth(o->q))) {
+            size_t max = depth - inflight;
+            if (max > OUTPUT_IOV)
+                max = OUTPUT_IOV;
+            size_t n = queue_pop_n(o->q, types, bufs, max);
+            for (size_t i = 0; i < n && !stopped; ++i) {
+                if (types[i] == OUTPUT_STOP) {
+                    stopped = true;
+                } else {
+                    ring_submit(o, (output_buf_t*)bufs[i]);
+                    ++inflight;
+                }
+            }
+            ring_enter(o, 0);
+        } else {
+            ring_enter(o, 1);
+        }
+        inflight -= ring_reap(o);
+        if (o->ring.pending)
+            ring_enter(o, 0); // resubmit short writes
+    }
+    return NULL;
+}
+
+#endif // OUTPUT_URING
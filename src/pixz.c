@@ -8,12 +8,57 @@ typedef enum {
     OP_WRITE,
     OP_READ,
     OP_EXTRACT,
-    OP_LIST
+    OP_LIST,
+    OP_APPEND
 } pixz_op_t;
 
+enum {
+    OPT_STATS = 256,
+    OPT_TRACE,
+    OPT_ADAPTIVE,
+    OPT_NUMA,
+    OPT_HUGEPAGES,
+    OPT_ALIGN,
+    OPT_RSYNCABLE,
+    OPT_REFERENCE,
+    OPT_DEDUP,
+    OPT_CHECK
+};
+
+static const struct option gLongOpts[] = {
+    { "stats", optional_argument, NULL, OPT_STATS },
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { "adaptive", no_argument, NULL, OPT_ADAPTIVE },
+    { "numa", no_argument, NULL, OPT_NUMA },
+    { "hugepages", optional_argument, NULL, OPT_HUGEPAGES },
+    { "align", no_argument, NULL, OPT_ALIGN },
+    { "rsyncable", no_argument, NULL, OPT_RSYNCABLE },
+    { "reference", required_argument, NULL, OPT_REFERENCE },
+    { "dedup", optional_argument, NULL, OPT_DEDUP },
+    { "check", required_argument, NULL, OPT_CHECK },
+    { NULL, 0, NULL, 0 }
+};
+
+static const struct {
+    const char *name;
+    unsigned flag;
+} gDisableNames[] = {
+    { "arena", DISABLE_ARENA },
+    { "mmap", DISABLE_MMAP },
+    { "uring", DISABLE_URING },
+    { "tar-scan", DISABLE_TAR_SCAN },
+    { "sample", DISABLE_SAMPLE },
+    { "runs", DISABLE_RUNS },
+    { "filters", DISABLE_FILTERS },
+};
+
+static FILE *gInFile = NULL, *gOutFile = NULL;
+
 static bool strsuf(char *big, char *small);
 static char *subsuf(char *in, char *suf1, char *suf2);
 static char *auto_output(pixz_op_t op, char *in);
+static uint64_t parse_size(const char *str);
+static void parse_disable(const char *str);
 
 static void usage(const char *msg) {
 	if (msg)
@@ -32,6 +77,7 @@ static void usage(const char *msg) {
 "  pixz -l input.tpxz              # List tarball contents very fast\n"
 "  pixz -x path/to/file < input.tpxz | tar x  # Extract one file very fast\n"
 "  tar -Ipixz -cf output.tpxz dir  # Make tar use pixz automatically\n"
+"  pixz -a output.tpxz more.tar   # Append without recompressing\n"
 "\n"
 "Input and output:\n"
 "  pixz < input > output.pxz       # Same as `pixz input output.pxz`\n"
@@ -41,11 +87,31 @@ static void usage(const char *msg) {
 "Other flags:\n"
 "  -0, -1 ... -9      Set compression level, from fastest to strongest\n"
 "  -p NUM             Use a maximum of NUM CPU-intensive threads\n"
+"  -m SIZE            Limit memory use to about SIZE, with suffix K, M or G,\n"
+"                     using fewer threads and blocks as needed\n"
+"  --adaptive         Vary active threads and queued blocks with the input rate,\n"
+"                     up to the -p and -q limits\n"
+"  --numa             Spread threads across NUMA nodes, keeping blocks local\n"
+"  --hugepages[=explicit]  Back block buffers with transparent huge pages,\n"
+"                     or with explicit (reserved) ones\n"
 "  -t                 Don't assume input is in tar format\n"
+"  --check TYPE       Integrity check of each block: none, crc32 (default),\n"
+"                     crc64 or sha256\n"
+"  --align            End blocks between tar entries where possible, so small\n"
+"                     files extract quickly\n"
+"  --rsyncable        End blocks where the content says, so similar inputs\n"
+"                     share most of their compressed blocks\n"
+"  --reference FILE   Copy blocks with unchanged contents from an earlier\n"
+"                     archive FILE, instead of compressing them again\n"
+"  --dedup[=SIZE]     Compress blocks that repeat within the input only once,\n"
+"                     keeping up to SIZE of output for reuse (default 64M)\n"
 "  -k                 Keep original input (do not remove it)\n"
 "  -c                 ignored\n"
 "  -V                 Print version and exit\n"
 "  -h                 Print this help\n"
+"  --stats[=json]     Report pipeline timing and queue statistics on exit,\n"
+"                     and on SIGUSR1\n"
+"  --trace FILE       Write a Chrome trace-event timeline of each block to FILE\n"
 "\n"
 "pixz %s\n"
 "(C) 2009-2020 Dave Vasilevsky <dave@vasilevsky.ca>\n"
@@ -67,19 +133,24 @@ int main(int argc, char **argv) {
     bool tar = true;
     bool keep_input = false;
     bool extreme = false;
+    bool check_set = false;
     pixz_op_t op = OP_WRITE;
-    char *ipath = NULL, *opath = NULL;
+    char *ipath = NULL, *opath = NULL, *tpath = NULL, *rpath = NULL;
+    char *apath = NULL;
+    FILE *archive = NULL;
     
     int ch;
 	char *optend;
 	long optint;
     double optdbl;
-    while ((ch = getopt(argc, argv, "dcxli:o:tkvVhp:0123456789f:q:e")) != -1) {
+    while ((ch = getopt_long(argc, argv, "dcxlai:o:tkvVhp:0123456789f:q:em:",
+            gLongOpts, NULL)) != -1) {
         switch (ch) {
             case 'c': break;
             case 'd': op = OP_READ; break;
             case 'x': op = OP_EXTRACT; break;
             case 'l': op = OP_LIST; break;
+            case 'a': op = OP_APPEND; break;
             case 'i': ipath = optarg; break;
             case 'o': opath = optarg; break;
             case 't': tar = false; break;
@@ -105,6 +176,52 @@ int main(int argc, char **argv) {
     				usage("Need a positive integer argument to -q");
     			gPipelineQSize = optint;
     			break;
+            case 'm':
+                if (!(gPipelineMemory = parse_size(optarg)))
+                    usage("Need a positive size argument to -m");
+                break;
+            case OPT_STATS:
+                if (!optarg)
+                    gStatsFormat = STATS_HUMAN;
+                else if (strcmp(optarg, "json") == 0)
+                    gStatsFormat = STATS_JSON;
+                else
+                    usage("Unknown argument to --stats");
+                break;
+            case OPT_TRACE: tpath = optarg; break;
+            case OPT_ADAPTIVE: gPipelineAdaptive = true; break;
+            case OPT_NUMA: gNuma = true; break;
+            case OPT_ALIGN: gBlockAlign = true; break;
+            case OPT_RSYNCABLE: gBlockRsyncable = true; break;
+            case OPT_REFERENCE: rpath = optarg; break;
+            case OPT_DEDUP:
+                gDedupSize = DEDUP_DEFAULT;
+                if (optarg && !(gDedupSize = parse_size(optarg)))
+                    usage("Need a positive size argument to --dedup");
+                break;
+            case OPT_CHECK:
+                if (strcmp(optarg, "none") == 0)
+                    gCheck = LZMA_CHECK_NONE;
+                else if (strcmp(optarg, "crc32") == 0)
+                    gCheck = LZMA_CHECK_CRC32;
+                else if (strcmp(optarg, "crc64") == 0)
+                    gCheck = LZMA_CHECK_CRC64;
+                else if (strcmp(optarg, "sha256") == 0)
+                    gCheck = LZMA_CHECK_SHA256;
+                else
+                    usage("Unknown argument to --check");
+                if (!lzma_check_is_supported(gCheck))
+                    usage("That check isn't supported by liblzma");
+                check_set = true;
+                break;
+            case OPT_HUGEPAGES:
+                if (!optarg || strcmp(optarg, "thp") == 0)
+                    gPoolPages = POOL_PAGES_THP;
+                else if (strcmp(optarg, "explicit") == 0)
+                    gPoolPages = POOL_PAGES_HUGETLB;
+                else
+                    usage("Unknown argument to --hugepages");
+                break;
             default:
                 if (ch >= '0' && ch <= '9') {
                     level = ch - '0';
@@ -115,10 +232,41 @@ int main(int argc, char **argv) {
     }
     argc -= optind;
     argv += optind;
+    
+    const char *disable = getenv("PIXZ_DISABLE");
+    if (disable)
+        parse_disable(disable);
+    if (gStatsFormat != STATS_NONE)
+        stats_init();
+    if (tpath)
+        trace_open(tpath);
+    if (gNuma)
+        numa_init();
         
     gInFile = stdin;
     gOutFile = stdout;
     bool iremove = false;    
+    if (op == OP_APPEND) {
+        if (argc < 1)
+            usage("Need an archive to append to");
+        if (argc > 2)
+            usage("Too many arguments");
+        if (opath)
+            usage("Can't append to an output file, name the archive instead");
+        if (!tar)
+            usage("Can only append to tarballs");
+        if (check_set)
+            usage("Appending keeps the archive's check, it can't be set");
+        if (argc == 2) {
+            if (ipath)
+                usage("Multiple input files specified");
+            ipath = argv[1];
+        }
+        apath = argv[0];
+        if (!(archive = fopen(apath, "r+")))
+            die("can not open archive: %s: %s", apath, strerror(errno));
+        argc = 0;
+    }
     if (op != OP_EXTRACT && argc >= 1) {
         if (argc > 2 || (op == OP_LIST && argc == 2))
             usage("Too many arguments");
@@ -176,12 +324,24 @@ int main(int argc, char **argv) {
 				usage("Refusing to output to a TTY");
 			if (extreme)
 				level |= LZMA_PRESET_EXTREME;
-			pixz_write(tar, level);
+			if (rpath)
+				reference_open(rpath);
+			pixz_write(gInFile, gOutFile, tar, level);
+			reference_close();
+			break;
+        case OP_APPEND:
+			if (extreme)
+				level |= LZMA_PRESET_EXTREME;
+			if (rpath)
+				reference_open(rpath);
+			pixz_append(archive, apath, gInFile, level);
+			reference_close();
 			break;
-        case OP_READ: pixz_read(tar, 0, NULL); break;
-        case OP_EXTRACT: pixz_read(tar, argc, argv); break;
-        case OP_LIST: pixz_list(tar);
+        case OP_READ: pixz_read(gInFile, gOutFile, tar, 0, NULL); break;
+        case OP_EXTRACT: pixz_read(gInFile, gOutFile, tar, argc, argv); break;
+        case OP_LIST: pixz_list(gInFile, tar);
     }
+    trace_close();
     
     if (iremove && !keep_input)
         unlink(ipath);
@@ -206,6 +366,48 @@ static char *auto_output(pixz_op_t op, char *in) {
     return NULL;
 }
 
+// A size like "512M", or zero if invalid
+static uint64_t parse_size(const char *str) {
+    char *end;
+    errno = 0;
+    unsigned long long size = strtoull(str, &end, 10);
+    if (errno || end == str || *str == '-')
+        return 0;
+    
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; ++end; break;
+        case 'm': case 'M': shift = 20; ++end; break;
+        case 'g': case 'G': shift = 30; ++end; break;
+        case 't': case 'T': shift = 40; ++end; break;
+    }
+    if (shift && strcmp(end, "iB") == 0)
+        end += 2;
+    if (*end || size > (UINT64_MAX >> shift))
+        return 0;
+    return (uint64_t)size << shift;
+}
+
+// A comma-separated list of optimizations to turn off, for benchmarks and
+// tests. Not for users, so not documented.
+static void parse_disable(const char *str) {
+    while (*str) {
+        size_t len = strcspn(str, ",");
+        size_t i, count = sizeof(gDisableNames) / sizeof(gDisableNames[0]);
+        for (i = 0; i < count; ++i) {
+            if (strlen(gDisableNames[i].name) == len
+                    && strncmp(gDisableNames[i].name, str, len) == 0)
+                break;
+        }
+        if (i == count)
+            die("Unknown optimization in PIXZ_DISABLE: %.*s", (int)len, str);
+        gDisable |= gDisableNames[i].flag;
+        str += len;
+        if (*str)
+            ++str;
+    }
+}
+
 static bool strsuf(char *big, char *small) {
     size_t bl = strlen(big), sl = strlen(small);
     return strcmp(big + bl - sl, small) == 0;
@@ -6,6 +6,7 @@
 
 #define __USE_LARGEFILE 1
 
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,24 +14,36 @@
 #include <sys/types.h>
 
 #include <pthread.h>
+#include <stdatomic.h>
 
 
 #pragma mark DEFINES
 
+// Static probes, compiled away unless configured with --enable-probes
+#if ENABLE_PROBES
+	#include <sys/sdt.h>
+	#define PROBE(name, ...) STAP_PROBEV(pixz, name, ##__VA_ARGS__)
+#else
+	#define PROBE(...)
+#endif
+
 #define PIXZ_INDEX_MAGIC 0xDBAE14D62E324CA6LL
 
-#define CHECK LZMA_CHECK_CRC32
 #define MEMLIMIT (64ULL * 1024 * 1024 * 1024) // crazy high
 
 #define CHUNKSIZE 4096
 
+// Blocks of a single repeated byte are written as copies of one LZMA2 chunk
+// that resets the dictionary, encoded with this small dictionary
+#define RUN_DICT LZMA_DICT_SIZE_MIN
+
 #ifndef DEBUG
 	#define DEBUG 0
 #endif
 #if DEBUG
     #define debug(str, ...) fprintf(stderr, str "\n", ##__VA_ARGS__)
 #else
-    #define debug(...)
+    #define debug(...) do {} while (0)
 #endif
 
 
@@ -47,29 +60,42 @@
 
 #pragma mark OPERATIONS
 
-void pixz_list(bool tar);
-void pixz_write(bool tar, uint32_t level);
-void pixz_read(bool verify, size_t nspecs, char **specs);
+void pixz_list(FILE *in, bool tar);
+void pixz_write(FILE *in, FILE *out, bool tar, uint32_t level);
+void pixz_append(FILE *archive, const char *path, FILE *in,
+    uint32_t level);
+void pixz_read(FILE *in, FILE *out, bool verify, size_t nspecs, char **specs);
 
 
 #pragma mark UTILS
 
-extern FILE *gInFile, *gOutFile;
-extern lzma_stream gStream;
-
-extern lzma_index *gIndex;
-
-
 void die(const char *fmt, ...);
 char *xstrdup(const char *s);
 
 uint64_t xle64dec(const uint8_t *d);
 void xle64enc(uint8_t *d, uint64_t n);
 size_t num_threads(void);
+uint64_t memory_limit(void);
 
 extern double gBlockFraction;
+extern bool gBlockAlign;
+extern bool gBlockRsyncable;
+
+// Optimizations that can be turned off for comparison, by listing them in
+// the PIXZ_DISABLE environment variable, eg: PIXZ_DISABLE=arena
+enum {
+    DISABLE_ARENA = 1 << 0,     // let liblzma malloc for itself
+    DISABLE_MMAP = 1 << 1,      // read regular files like pipes
+    DISABLE_URING = 1 << 2,     // write with writev, not io_uring
+    DISABLE_TAR_SCAN = 1 << 3,  // find tar entries with libarchive
+    DISABLE_SAMPLE = 1 << 4,    // always try to compress blocks
+    DISABLE_RUNS = 1 << 5,      // code repeated-byte blocks like any other
+    DISABLE_FILTERS = 1 << 6,   // plain LZMA2 for every block
+};
+extern unsigned gDisable;
 
 void *xmalloc(size_t size);
+uint64_t monotonic_ns(void);
 
 #pragma mark INDEX
 
@@ -80,49 +106,75 @@ struct file_index_t {
     file_index_t *next;
 };
 
-extern file_index_t *gFileIndex, *gLastFile;
-
 bool is_multi_header(const char *name);
-bool decode_index(void); // true on success
+lzma_index *decode_index(FILE *in); // NULL on failure
 
-lzma_vli read_file_index(void);
-void dump_file_index(FILE *out, bool verbose);
-void free_file_index(void);
+// Returns the offset of the file index block, or zero if there is none
+lzma_vli read_file_index(FILE *in, lzma_index *index, file_index_t **files);
+void dump_file_index(FILE *out, file_index_t *files, bool verbose);
+void free_file_index(file_index_t *files);
 
 
 #pragma mark QUEUE
 
-typedef struct queue_item_t queue_item_t;
-struct queue_item_t {
+#define CACHELINE 64
+
+typedef struct {
+    _Alignas(CACHELINE) atomic_size_t seq;
     int type;
     void *data;
-    queue_item_t *next;
-};
+} queue_cell_t;
 
-typedef void (*queue_free_t)(int type, void *p);
+typedef void (*queue_free_t)(void *ctx, int type, void *p);
 
+// Bounded multi-producer multi-consumer ring. Pushers and poppers claim
+// positions with a CAS on tail/head, then hand off through each cell's
+// sequence number. Waiters spin briefly, then sleep on the condvars.
 typedef struct {
-    queue_item_t *first;
-    queue_item_t *last;
+    _Alignas(CACHELINE) atomic_size_t head; // next position to pop
+    _Alignas(CACHELINE) atomic_size_t tail; // next position to push
+    
+    _Alignas(CACHELINE) queue_cell_t *cells;
+    size_t mask;
     
+    atomic_size_t pop_waiters, push_waiters;
     pthread_mutex_t mutex;
-    pthread_cond_t pop_cond;
+    pthread_cond_t pop_cond, push_cond;
     
     queue_free_t freer;
+    void *ctx;
+    
+    // Statistics
+    atomic_uint_fast64_t wait_ns; // time spent waiting in pop
+    atomic_size_t high_water;
 } queue_t;
 
 
-queue_t *queue_new(queue_free_t freer);
+queue_t *queue_new(size_t size, queue_free_t freer, void *ctx);
 void queue_free(queue_t *q);
 void queue_push(queue_t *q, int type, void *data);
 int queue_pop(queue_t *q, void **datap);
+size_t queue_depth(queue_t *q);
+
+// Push all n items, claiming cells for as many at once as fit. Pop between
+// one and max items, waiting only if there are none.
+void queue_push_n(queue_t *q, int type, void **data, size_t n);
+size_t queue_pop_n(queue_t *q, int *types, void **datap, size_t max);
 
 
 #pragma mark PIPELINE
 
 extern size_t gPipelineQSize;
 extern size_t gPipelineProcessMax;
-extern queue_t *gPipelineStartQ, *gPipelineSplitQ, *gPipelineMergeQ;
+extern bool gPipelineAdaptive;
+extern uint64_t gPipelineMemory;
+extern size_t gPipelineBatch; // zero to pick one from the queue size
+
+// Fewest items that keep every worker busy
+#define PIPELINE_MIN_QSIZE(workers) ((workers) + 2)
+
+// Most items handed between threads at once
+#define PIPELINE_BATCH_MAX 16
 
 typedef enum {
     PIPELINE_ITEM,
@@ -132,24 +184,326 @@ typedef enum {
 typedef struct pipeline_item_t pipeline_item_t;
 struct pipeline_item_t {
     size_t seq;
-    pipeline_item_t *next;
-    
+    size_t node; // index of the NUMA node whose workers process this
     void *data;
 };
 
-typedef void* (*pipeline_data_create_t)(void);
+typedef struct pipeline_t pipeline_t;
+
+typedef enum {
+    PIPELINE_STAGE_SPLIT,
+    PIPELINE_STAGE_PROCESS,
+    PIPELINE_STAGE_MERGE,
+    PIPELINE_STAGES
+} pipeline_stage_t;
+
+typedef struct {
+    atomic_uint_fast64_t items, bytes_in, bytes_out;
+} pipeline_counts_t;
+
+typedef void* (*pipeline_data_create_t)(size_t node);
 typedef void (*pipeline_data_free_t)(void*);
-typedef void (*pipeline_split_t)(void);
-typedef void (*pipeline_process_t)(size_t);
+typedef void (*pipeline_split_t)(pipeline_t *pl);
+typedef void (*pipeline_process_t)(pipeline_t *pl, size_t thnum);
+
+typedef struct {
+    pipeline_t *pl;
+    size_t thnum, node;
+    pthread_t thread;
+    atomic_uint_fast64_t start_ns, end_ns;
+    
+    // Items taken in one batch, and finished ones not yet handed back
+    pipeline_item_t *todo[PIPELINE_BATCH_MAX];
+    size_t todo_next, todo_count;
+    pipeline_item_t *done[PIPELINE_BATCH_MAX];
+    size_t done_count;
+    bool stopped;
+} pipeline_worker_t;
+
+// Counters as of the adaptive controller's last decision
+typedef struct {
+    uint64_t time, start_wait, split_wait, park;
+    uint64_t split_bytes, process_bytes, process_items;
+    size_t stalls;
+    size_t extra; // in-flight items added due to merge stalls
+} pipeline_adapt_t;
+
+struct pipeline_t {
+    queue_t *start_q, *merge_q;
+    queue_t **split_q; // one per node
+    size_t nodes;
+    void *ctx; // caller's state, for the split and process stages
+    
+    pipeline_data_free_t freer;
+    pipeline_split_t split;
+    pipeline_process_t process;
+    
+    size_t process_count, qsize;
+    pipeline_worker_t *workers;
+    pthread_t split_thread;
+    
+    // Workers numbered active_workers or higher park until needed. The
+    // merger holds back recycled items beyond inflight_limit.
+    atomic_size_t active_workers;
+    bool stopping; // protected by park_mutex
+    pthread_mutex_t park_mutex;
+    pthread_cond_t park_cond;
+    atomic_uint_fast64_t park_ns;
+    size_t inflight_limit, held_count;
+    pipeline_item_t **held;
+    pipeline_adapt_t adapt;
+    
+    uint64_t start_ns;
+    atomic_uint_fast64_t split_start_ns, split_end_ns, merge_end_ns;
+    pipeline_counts_t counts[PIPELINE_STAGES];
+    
+    size_t split_seq, merge_seq;
+    bool merge_stopped;
+    
+    // With deep queues, items move between threads in batches of up to
+    // this many. The splitter holds items for each node until a batch is
+    // ready, or the node's workers might run dry.
+    size_t batch;
+    pipeline_item_t **split_held; // batch per node
+    size_t *split_held_count;
+    
+    // Items that arrived out of order, indexed by seq modulo the window
+    // size. Every item from merge_seq up to the newest seq is still in
+    // flight, so a window as big as the number of items can't collide.
+    pipeline_item_t **merge_window;
+    size_t merge_window_size, merge_pending;
+    
+    // Time the merger spent waiting for the next item while later ones
+    // were ready
+    atomic_uint_fast64_t merge_stall_ns;
+    atomic_size_t merge_stalls;
+    
+    // Blocks stored uncompressed, and how many of those were never given
+    // to the encoder
+    atomic_size_t stored_blocks, stored_skipped;
+    // Blocks of a single repeated byte, that skipped the codec
+    atomic_size_t run_blocks;
+    // Blocks copied from a reference archive
+    atomic_size_t reused_blocks;
+    // Blocks looked up for duplicates, and duplicates found
+    atomic_size_t dedup_blocks, dedup_hits;
+    
+    pipeline_t *stats_next;
+};
 
-void pipeline_create(
+// reserved_mem is used alongside the pipeline, and comes out of its budget
+pipeline_t *pipeline_create(
     pipeline_data_create_t create,
     pipeline_data_free_t destroy,
     pipeline_split_t split,
-    pipeline_process_t process);
-void pipeline_stop(void);
-void pipeline_destroy(void);
+    pipeline_process_t process,
+    void *ctx,
+    size_t item_mem,
+    size_t worker_mem,
+    uint64_t reserved_mem);
+uint64_t pipeline_memory_budget(void);
+void pipeline_stop(pipeline_t *pl);
+void pipeline_destroy(pipeline_t *pl);
+
+void pipeline_dispatch(pipeline_t *pl, pipeline_item_t *item, queue_t *q);
+void pipeline_split(pipeline_t *pl, pipeline_item_t *item);
+pipeline_item_t *pipeline_merged(pipeline_t *pl);
+
+// Get the next item for a worker, or NULL if we're done
+pipeline_item_t *pipeline_next(pipeline_t *pl, size_t thnum);
 
-void pipeline_dispatch(pipeline_item_t *item, queue_t *q);
-void pipeline_split(pipeline_item_t *item);
-pipeline_item_t *pipeline_merged();
+// Hand a processed item to the merger
+void pipeline_done(pipeline_t *pl, size_t thnum, pipeline_item_t *item);
+
+// Get an empty item for the splitter to fill
+pipeline_item_t *pipeline_fetch(pipeline_t *pl);
+
+// Return a merged item for re-use. Call only from the merge thread.
+void pipeline_recycle(pipeline_t *pl, pipeline_item_t *item);
+
+// Total time workers spent waiting for items
+uint64_t pipeline_split_wait(pipeline_t *pl);
+
+// Record that a stage handled an item
+void pipeline_account(pipeline_t *pl, pipeline_stage_t stage, size_t in,
+    size_t out);
+
+
+#pragma mark NUMA
+
+extern bool gNuma;
+
+void numa_init(void);
+size_t numa_node_count(void);
+void numa_bind_thread(size_t node);
+
+// Make fresh memory prefer a node, if NUMA mode is on
+void numa_bind_memory(void *ptr, size_t len, size_t node);
+
+
+#pragma mark POOL
+
+typedef enum {
+    POOL_PAGES_NORMAL,
+    POOL_PAGES_THP,     // transparent huge pages, if the kernel agrees
+    POOL_PAGES_HUGETLB, // explicit huge pages, must be reserved
+} pool_pages_t;
+
+typedef struct {
+    uint64_t hits, misses;
+    uint64_t mapped, cached; // bytes
+} pool_stats_t;
+
+extern pool_pages_t gPoolPages;
+
+// Recycled buffers for block data, rounded up to a size class. If capacity
+// is non-NULL, it gets the usable size.
+void *pool_alloc(size_t size, size_t node, size_t *capacity);
+void *pool_realloc(void *ptr, size_t size, size_t node, size_t *capacity);
+void pool_free(void *ptr);
+size_t pool_capacity(size_t size);
+void pool_stats(pool_stats_t *stats);
+
+// An allocator for liblzma streams used by the calling thread, serving
+// large allocations from the pool. May be NULL, for the default.
+lzma_allocator *pool_lzma_allocator(size_t node);
+
+
+#pragma mark OUTPUT
+
+// Blocks that can be waiting to be written at once
+#define OUTPUT_MAX 4
+
+typedef struct output_t output_t;
+
+output_t *output_open(FILE *file);
+// Write a copy of data
+void output_write(output_t *o, const void *data, size_t len);
+// Write a block from a pool buffer, which is freed once written
+void output_block(output_t *o, size_t seq, void *buf, size_t len);
+// Wait for all writes to finish, and close the file
+void output_close(output_t *o);
+
+
+#pragma mark TAR
+
+typedef enum {
+    TAR_MORE,       // needs more input
+    TAR_END,        // end of the archive, the rest needn't be scanned
+    TAR_NOT_TAR,    // not a tar archive, or one with no entries
+} tar_status_t;
+
+typedef struct tar_scan_t tar_scan_t;
+typedef void (*tar_entry_t)(void *ctx, off_t offset, const char *name);
+
+tar_scan_t *tar_scan_new(tar_entry_t entry, void *ctx);
+void tar_scan_free(tar_scan_t *ts);
+// Scan the next piece of input, calling entry for each entry found
+tar_status_t tar_scan(tar_scan_t *ts, const uint8_t *buf, size_t len);
+// Call at the end of input, if tar_scan still wants more
+tar_status_t tar_scan_finish(tar_scan_t *ts);
+// Skip the entry contents the scan has reached, without reading them
+void tar_scan_skip(tar_scan_t *ts);
+// How far the scan has got. Once the end is found, that's where it starts.
+uint64_t tar_scan_pos(tar_scan_t *ts);
+// Offset of an entry's contents from the start of its headers, or zero.
+// If found, datasize (when non-NULL) gets the size of the contents.
+size_t tar_data_offset(const uint8_t *buf, size_t len, uint64_t *datasize);
+
+
+#pragma mark STATS
+
+typedef enum {
+    STATS_NONE,
+    STATS_HUMAN,
+    STATS_JSON
+} stats_format_t;
+
+extern stats_format_t gStatsFormat;
+
+void stats_init(void);
+void stats_register(pipeline_t *pl);
+void stats_unregister(pipeline_t *pl);
+void stats_print(FILE *out, pipeline_t *pl);
+
+
+#pragma mark REFERENCE
+
+typedef struct reference_t reference_t;
+extern reference_t *gReference;
+
+// Index the blocks of an earlier archive, so compression can reuse them
+void reference_open(const char *path);
+void reference_close(void);
+// Copy a block of the reference that holds exactly this input to out, and
+// return its size, or zero if there is none. Uses stream for decoding.
+size_t reference_find(lzma_stream *stream, const uint8_t *in, size_t insize,
+    uint8_t *out, size_t outcap, lzma_vli *unpadded);
+
+
+#pragma mark CHECK
+
+// The integrity check of blocks we write
+extern lzma_check gCheck;
+
+// A check being computed, a piece at a time
+typedef struct {
+    lzma_check type;
+    uint32_t crc32;
+    uint64_t crc64;
+    uint32_t sha256[8];
+    uint64_t size;
+    uint8_t buf[64];
+} check_t;
+
+bool check_supported(lzma_check type);
+void check_init(check_t *c, lzma_check type);
+void check_update(check_t *c, const uint8_t *buf, size_t size);
+// Write the check as it's stored after a block, and return its size
+size_t check_finish(check_t *c, uint8_t *out);
+
+
+#pragma mark DEDUP
+
+typedef struct dedup_t dedup_t;
+typedef struct dedup_entry_t dedup_entry_t;
+
+#define DEDUP_DEFAULT (64 * 1024 * 1024)
+
+// Bytes of compressed output to keep for duplicates, or zero for no dedup
+extern size_t gDedupSize;
+
+dedup_t *dedup_new(size_t budget);
+void dedup_free(dedup_t *d);
+// Find a block's entry by its input. If an earlier block has the same input,
+// dup is set and the writer should copy that block's output.
+dedup_entry_t *dedup_find(dedup_t *d, const uint8_t *in, size_t size,
+    size_t seq, bool *dup);
+// The writer has a block that isn't a duplicate, maybe keep its output
+void dedup_written(dedup_t *d, dedup_entry_t *e, size_t seq,
+    const uint8_t *out, size_t outsize, lzma_vli unpadded);
+// The writer has a duplicate, copy the earlier output and return its size
+size_t dedup_copy(dedup_t *d, dedup_entry_t *e, uint8_t *out,
+    lzma_vli *unpadded);
+
+
+#pragma mark TRACE
+
+extern FILE *gTraceFile;
+
+void trace_open(const char *path);
+void trace_close(void);
+void trace_thread(const char *fmt, ...);
+void trace_span(const char *name, uint64_t start, size_t seq, size_t in,
+    size_t out);
+
+// Start a span, returns zero if tracing is off
+static inline uint64_t trace_begin(void) {
+    return gTraceFile ? monotonic_ns() : 0;
+}
+
+static inline void trace_end(const char *name, uint64_t start, size_t seq,
+        size_t in, size_t out) {
+    if (start)
+        trace_span(name, start, seq, in, out);
+}
@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+
+#include "pixz.h"
+
+#include <sys/mman.h>
+
+// Block buffers are big, and needed over and over in the same few sizes.
+// Rather than returning them to the kernel and faulting in fresh zeroed
+// pages for every block, keep freed buffers on per-node free lists, one
+// list for each size class. Classes are 1, 1.25, 1.5 and 1.75 times a
+// power of two, so rounding up wastes at most a fifth.
+
+#define POOL_MIN_SHIFT 16 // 64 KiB
+#define POOL_MAX_SHIFT 48
+#define POOL_STEPS 4
+#define POOL_CLASSES ((POOL_MAX_SHIFT - POOL_MIN_SHIFT) * POOL_STEPS)
+
+#define POOL_HUGE_PAGE (2 * 1024 * 1024)
+
+// liblzma allocations smaller than this go to malloc
+#define POOL_LZMA_MIN (1024 * 1024)
+#define POOL_LZMA_MAX 16
+
+// Each buffer starts with a header, padded so the data stays aligned
+typedef struct pool_buf_t pool_buf_t;
+struct pool_buf_t {
+    pool_buf_t *next;
+    size_t len; // of the whole mapping
+    size_t cls;
+    size_t node;
+};
+#define POOL_HEADER CACHELINE
+
+pool_pages_t gPoolPages = POOL_PAGES_NORMAL;
+
+static pthread_mutex_t gPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pool_buf_t **gPoolFree = NULL; // [node * POOL_CLASSES + class]
+static size_t gPoolNodes = 0;
+static pool_stats_t gPoolStats;
+
+// Per-thread allocator for liblzma, remembering which of its allocations
+// came from the pool
+typedef struct {
+    lzma_allocator allocator;
+    size_t node;
+    size_t count;
+    void *big[POOL_LZMA_MAX];
+} pool_arena_t;
+static _Thread_local pool_arena_t tPoolArena;
+
+
+#pragma mark DECLARE
+
+static size_t pool_class(size_t size);
+static size_t pool_class_size(size_t cls);
+static pool_buf_t *pool_map(size_t cls, size_t node);
+static void pool_unmap(pool_buf_t *buf);
+static void pool_evict(size_t cls, size_t node);
+static void *pool_lzma_alloc(void *opaque, size_t nmemb, size_t size);
+static void pool_lzma_free(void *opaque, void *ptr);
+
+
+#pragma mark CLASSES
+
+static size_t pool_class(size_t size) {
+    size_t shift = POOL_MIN_SHIFT;
+    while (shift < POOL_MAX_SHIFT && ((size_t)1 << (shift + 1)) <= size)
+        ++shift;
+    if (shift >= POOL_MAX_SHIFT)
+        die("Buffer too large");
+
+    size_t base = (size_t)1 << shift, step = base / POOL_STEPS;
+    size_t sub = size <= base ? 0 : (size - base + step - 1) / step;
+    // A sub of POOL_STEPS is just the next power of two
+    return (shift - POOL_MIN_SHIFT) * POOL_STEPS + sub;
+}
+
+static size_t pool_class_size(size_t cls) {
+    size_t base = (size_t)1 << (POOL_MIN_SHIFT + cls / POOL_STEPS);
+    return base + (cls % POOL_STEPS) * (base / POOL_STEPS);
+}
+
+size_t pool_capacity(size_t size) {
+    return pool_class_size(pool_class(size + POOL_HEADER)) - POOL_HEADER;
+}
+
+
+#pragma mark MAPPING
+
+// Mapping is cheap until the pages are touched, so these run under
+// gPoolMutex.
+
+static pool_buf_t *pool_map(size_t cls, size_t node) {
+    size_t len = pool_class_size(cls);
+    void *p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (gPoolPages == POOL_PAGES_HUGETLB) {
+        size_t hlen = (len + POOL_HUGE_PAGE - 1)
+            & ~(size_t)(POOL_HUGE_PAGE - 1);
+        p = mmap(NULL, hlen, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Warning: can't allocate huge pages, "
+                "using normal pages\n");
+            gPoolPages = POOL_PAGES_NORMAL;
+        } else {
+            len = hlen;
+        }
+    }
+#endif
+
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            die("Out of memory");
+#ifdef MADV_HUGEPAGE
+        if (gPoolPages == POOL_PAGES_THP)
+            madvise(p, len, MADV_HUGEPAGE); // just a hint
+#endif
+    }
+
+    // Must happen before the pages are touched
+    numa_bind_memory(p, len, node);
+
+    pool_buf_t *buf = p;
+    *buf = (pool_buf_t){ .len = len, .cls = cls, .node = node };
+    gPoolStats.mapped += len;
+    return buf;
+}
+
+static void pool_unmap(pool_buf_t *buf) {
+    gPoolStats.mapped -= buf->len;
+    gPoolStats.cached -= buf->len;
+    munmap(buf, buf->len);
+}
+
+// Drop cached buffers less than half the size of one we're about to map.
+// Readers grow their buffers, and would otherwise leave a trail of unused
+// smaller ones behind.
+static void pool_evict(size_t cls, size_t node) {
+    pool_buf_t **lists = &gPoolFree[node * POOL_CLASSES];
+    for (size_t c = 0; c + POOL_STEPS < cls; ++c) {
+        while (lists[c]) {
+            pool_buf_t *buf = lists[c];
+            lists[c] = buf->next;
+            pool_unmap(buf);
+        }
+    }
+}
+
+
+#pragma mark API
+
+void *pool_alloc(size_t size, size_t node, size_t *capacity) {
+    size_t cls = pool_class(size + POOL_HEADER);
+
+    pthread_mutex_lock(&gPoolMutex);
+    if (!gPoolFree) {
+        gPoolNodes = numa_node_count();
+        gPoolFree = xmalloc(gPoolNodes * POOL_CLASSES * sizeof(pool_buf_t*));
+        memset(gPoolFree, 0, gPoolNodes * POOL_CLASSES * sizeof(pool_buf_t*));
+    }
+    node %= gPoolNodes;
+
+    pool_buf_t **list = &gPoolFree[node * POOL_CLASSES + cls];
+    pool_buf_t *buf = *list;
+    if (buf) {
+        *list = buf->next;
+        gPoolStats.cached -= buf->len;
+        ++gPoolStats.hits;
+    } else {
+        pool_evict(cls, node);
+        buf = pool_map(cls, node);
+        ++gPoolStats.misses;
+    }
+    pthread_mutex_unlock(&gPoolMutex);
+
+    if (capacity)
+        *capacity = pool_class_size(cls) - POOL_HEADER;
+    return (uint8_t*)buf + POOL_HEADER;
+}
+
+void pool_free(void *ptr) {
+    if (!ptr)
+        return;
+    pool_buf_t *buf = (pool_buf_t*)((uint8_t*)ptr - POOL_HEADER);
+
+    pthread_mutex_lock(&gPoolMutex);
+    pool_buf_t **list = &gPoolFree[buf->node * POOL_CLASSES + buf->cls];
+    buf->next = *list;
+    *list = buf;
+    gPoolStats.cached += buf->len;
+    pthread_mutex_unlock(&gPoolMutex);
+}
+
+void *pool_realloc(void *ptr, size_t size, size_t node, size_t *capacity) {
+    void *r = pool_alloc(size, node, capacity);
+    if (ptr) {
+        pool_buf_t *buf = (pool_buf_t*)((uint8_t*)ptr - POOL_HEADER);
+        size_t old = pool_class_size(buf->cls) - POOL_HEADER;
+        memcpy(r, ptr, old < size ? old : size);
+        pool_free(ptr);
+    }
+    return r;
+}
+
+void pool_stats(pool_stats_t *stats) {
+    pthread_mutex_lock(&gPoolMutex);
+    *stats = gPoolStats;
+    pthread_mutex_unlock(&gPoolMutex);
+}
+
+
+#pragma mark LZMA
+
+// The match finder's hash chains and the dictionary are hundreds of MB at
+// high presets, and accessed randomly. Serving them from the pool gets
+// them huge pages and NUMA placement, and coders that are created for
+// each block reuse warm memory instead of faulting in fresh pages.
+
+static void *pool_lzma_alloc(void *opaque, size_t nmemb, size_t size) {
+    pool_arena_t *a = (pool_arena_t*)opaque;
+    if (size && nmemb > SIZE_MAX / size)
+        return NULL;
+    size_t len = nmemb * size;
+    if (len < POOL_LZMA_MIN || a->count == POOL_LZMA_MAX)
+        return malloc(len);
+    return a->big[a->count++] = pool_alloc(len, a->node, NULL);
+}
+
+static void pool_lzma_free(void *opaque, void *ptr) {
+    pool_arena_t *a = (pool_arena_t*)opaque;
+    for (size_t i = 0; i < a->count; ++i) {
+        if (a->big[i] == ptr) {
+            pool_free(ptr);
+            a->big[i] = a->big[--a->count];
+            return;
+        }
+    }
+    free(ptr);
+}
+
+lzma_allocator *pool_lzma_allocator(size_t node) {
+    if (gDisable & DISABLE_ARENA)
+        return NULL;
+
+    pool_arena_t *a = &tPoolArena;
+    a->allocator = (lzma_allocator){ .alloc = pool_lzma_alloc,
+        .free = pool_lzma_free, .opaque = a };
+    a->node = node;
+    return &a->allocator;
+}
@@ -14,10 +14,7 @@ struct wanted_t {
     off_t size;
 };
 
-static wanted_t *gWantedFiles = NULL;
-
 static bool spec_match(char *spec, char *name);
-static void wanted_files(size_t count, char **specs);
 static void wanted_free(wanted_t *w);
 
 
@@ -33,28 +30,54 @@ typedef struct {
 	lzma_check check;
 	
 	block_type btype;
+	size_t node;
 } io_block_t;
 
-static void *block_create(void);
+static void *block_create(size_t node);
 static void block_free(void *data);
-static void read_thread(void);
-static void read_thread_noindex(void);
-static void decode_thread(size_t thnum);
+static void read_thread(pipeline_t *pl);
+static void read_thread_noindex(pipeline_t *pl);
+static void decode_thread(pipeline_t *pl, size_t thnum);
+static bool decode_run(lzma_stream *stream, io_block_t *ib,
+    lzma_block *block);
+static void index_memory(lzma_index *index, size_t *item_mem,
+    size_t *decoder_mem);
 
 
-#pragma mark DECLARE ARCHIVE
+#pragma mark DECLARE STATE
+
+typedef struct {
+    FILE *in, *out;
+    lzma_index *index;
+    file_index_t *files;
+    lzma_vli file_index_offset;
+    
+    wanted_t *wanted;
+    bool explicit_files;
+    bool runs; // fill repeated-byte blocks without decoding them
+    
+    // archive
+    pipeline_item_t *ar_item, *ar_last_item;
+    off_t ar_last_offset;
+    size_t ar_last_size;
+    wanted_t *ar_wanted;
+    bool ar_next_item;
+    
+    // read buffer
+    pipeline_item_t *rbuf_pi;
+    io_block_t *rbuf;
+    uint64_t rbuf_trace;
+} read_state_t;
+
+static void wanted_files(read_state_t *rs, size_t count, char **specs);
 
-static pipeline_item_t *gArItem = NULL, *gArLastItem = NULL;
-static off_t gArLastOffset;
-static size_t gArLastSize;
-static wanted_t *gArWanted = NULL;
-static bool gArNextItem = false;
-static bool gExplicitFiles = false;
+
+#pragma mark DECLARE ARCHIVE
 
 static int tar_ok(struct archive *ar, void *ref);
 static ssize_t tar_read(struct archive *ar, void *ref, const void **bufp);
-static bool tar_next_block(void);
-static void tar_write_last(void);
+static bool tar_next_block(pipeline_t *pl);
+static void tar_write_last(read_state_t *rs);
 
 
 #pragma mark DECLARE READ BUFFER
@@ -62,62 +85,69 @@ static void tar_write_last(void);
 #define STREAMSIZE (1024 * 1024)
 #define MAXSPLITSIZE ((64 * 1024 * 1024) * 2) // xz -9 blocksize * 2
 
-static pipeline_item_t *gRbufPI = NULL;
-static io_block_t *gRbuf = NULL;
-
 static void block_capacity(io_block_t *ib, size_t incap, size_t outcap);
 
 typedef enum {
 	RBUF_ERR, RBUF_EOF, RBUF_PART, RBUF_FULL
 } rbuf_read_status;
 
-static rbuf_read_status rbuf_read(size_t bytes);
-static bool rbuf_cycle(lzma_stream *stream, bool start, size_t skip);
-static void rbuf_consume(size_t bytes);
-static void rbuf_dispatch(size_t bytes);
+static rbuf_read_status rbuf_read(pipeline_t *pl, size_t bytes);
+static bool rbuf_cycle(pipeline_t *pl, lzma_stream *stream, bool start,
+    size_t skip);
+static void rbuf_consume(read_state_t *rs, size_t bytes);
+static void rbuf_dispatch(pipeline_t *pl, size_t bytes);
 
-static bool read_header(lzma_check *check);
-static bool read_block(bool force_stream, lzma_check check, off_t uoffset);
-static void read_streaming(lzma_block *block, block_type sized, off_t uoffset);
-static void read_index(void);
-static void read_footer(void);
+static bool read_header(pipeline_t *pl, lzma_check *check);
+static bool read_block(pipeline_t *pl, bool force_stream, lzma_check check,
+    off_t uoffset);
+static void read_streaming(pipeline_t *pl, lzma_block *block,
+    block_type sized, off_t uoffset);
+static void read_index(pipeline_t *pl);
+static void read_footer(pipeline_t *pl);
 
 
 #pragma mark DECLARE UTILS
 
-static lzma_vli gFileIndexOffset = 0;
-
 static bool taste_tar(io_block_t *ib);
 static bool taste_file_index(io_block_t *ib);
 
 
 #pragma mark MAIN
 
-void pixz_read(bool verify, size_t nspecs, char **specs) {
-    if (decode_index()) {
+void pixz_read(FILE *in, FILE *out, bool verify, size_t nspecs,
+        char **specs) {
+    read_state_t *rs = xmalloc(sizeof(read_state_t));
+    *rs = (read_state_t){ .in = in, .out = out };
+    rs->runs = !(gDisable & DISABLE_RUNS);
+    
+    if ((rs->index = decode_index(rs->in))) {
 	    if (verify)
-	        gFileIndexOffset = read_file_index();
-	    wanted_files(nspecs, specs);
-		gExplicitFiles = nspecs;
+	        rs->file_index_offset = read_file_index(rs->in, rs->index,
+                &rs->files);
+	    wanted_files(rs, nspecs, specs);
+		rs->explicit_files = nspecs;
     }
 
 #if DEBUG
-    for (wanted_t *w = gWantedFiles; w; w = w->next)
+    for (wanted_t *w = rs->wanted; w; w = w->next)
         debug("want: %s", w->name);
 #endif
     
-    pipeline_create(block_create, block_free,
-		gIndex ? read_thread : read_thread_noindex, decode_thread);
-    if (verify && gFileIndexOffset) {
-        gArWanted = gWantedFiles;
-        wanted_t *w = gWantedFiles, *wlast = NULL;
+    size_t item_mem, decoder_mem;
+    index_memory(rs->index, &item_mem, &decoder_mem);
+    pipeline_t *pl = pipeline_create(block_create, block_free,
+		rs->index ? read_thread : read_thread_noindex, decode_thread, rs,
+		item_mem, decoder_mem, 0);
+    if (verify && rs->file_index_offset) {
+        rs->ar_wanted = rs->wanted;
+        wanted_t *w = rs->wanted, *wlast = NULL;
         bool lastmulti = false;
         off_t lastoff = 0;
         
         struct archive *ar = archive_read_new();
         prevent_compression(ar);
         archive_read_support_format_tar(ar);
-        archive_read_open(ar, NULL, tar_ok, tar_read, tar_ok);
+        archive_read_open(ar, pl, tar_ok, tar_read, tar_ok);
         struct archive_entry *entry;
         while (true) {
             int aerr = archive_read_next_header(ar, &entry);
@@ -153,18 +183,19 @@ void pixz_read(bool verify, size_t nspecs, char **specs) {
 		finish_reading(ar);
         if (w && w->name)
             die("File %s missing in archive", w->name);
-        tar_write_last(); // write whatever's left
+        tar_write_last(rs); // write whatever's left
     }
-	if (!gExplicitFiles) {
+	if (!rs->explicit_files) {
 		/* Heuristics for detecting pixz file index:
 		 *    - Input must be streaming (otherwise read_thread does this) 
 		 *    - Data must look tar-like
 		 *    - Must have all sized blocks, followed by unsized file index */
-		bool start = !gIndex && verify,
+		bool start = !rs->index && verify,
 			 tar = false, all_sized = true, skipping = false;
 		
 		pipeline_item_t *pi;
-        while ((pi = pipeline_merged())) {
+        while ((pi = pipeline_merged(pl))) {
+            uint64_t trace = trace_begin();
             io_block_t *ib = (io_block_t*)(pi->data);
 			if (skipping && ib->btype != BLOCK_CONTINUATION) {
 				fprintf(stderr,
@@ -182,31 +213,40 @@ void pixz_read(bool verify, size_t nspecs, char **specs) {
 				all_sized = false;
 			
 			if (!skipping) {
-				if (fwrite(ib->output, ib->outsize, 1, gOutFile) != 1)
+				if (fwrite(ib->output, ib->outsize, 1, rs->out) != 1)
 					die("Can't write block");
 			}
-            queue_push(gPipelineStartQ, PIPELINE_ITEM, pi);
+            trace_end("write", trace, pi->seq, ib->outsize,
+                skipping ? 0 : ib->outsize);
+            pipeline_account(pl, PIPELINE_STAGE_MERGE, ib->outsize,
+                skipping ? 0 : ib->outsize);
+            pipeline_recycle(pl, pi);
         }
     }
     
-    pipeline_destroy();
-    wanted_free(gWantedFiles);
+    pipeline_destroy(pl);
+    wanted_free(rs->wanted);
+    free_file_index(rs->files);
+    if (rs->index)
+        lzma_index_end(rs->index, NULL);
+    free(rs);
 }
 
 
 #pragma mark BLOCKS
 
-static void *block_create(void) {
+static void *block_create(size_t node) {
     io_block_t *ib = xmalloc(sizeof(io_block_t));
 	ib->incap = ib->outcap = 0;
 	ib->input = ib->output = NULL;
+	ib->node = node;
     return ib;
 }
 
 static void block_free(void* data) {
     io_block_t *ib = (io_block_t*)data;
-    free(ib->input);
-    free(ib->output);
+    pool_free(ib->input);
+    pool_free(ib->output);
     free(ib);
 }
 
@@ -214,7 +254,7 @@ static void block_free(void* data) {
 #pragma mark SETUP
 
 static void wanted_free(wanted_t *w) {
-    for (wanted_t *w = gWantedFiles; w; ) {
+    while (w) {
         wanted_t *tmp = w->next;
         free(w);
         w = tmp;
@@ -234,11 +274,11 @@ static bool spec_match(char *spec, char *name) {
     return match && (!*name || *name == '/');
 }
 
-static void wanted_files(size_t count, char **specs) {
-    if (!gFileIndexOffset) {
+static void wanted_files(read_state_t *rs, size_t count, char **specs) {
+    if (!rs->file_index_offset) {
         if (count)
             die("Can't filter non-tarball");
-        gWantedFiles = NULL;
+        rs->wanted = NULL;
         return;
     }
     
@@ -255,7 +295,7 @@ static void wanted_files(size_t count, char **specs) {
     wanted_t *last = NULL;
     
     // Check each file in order, to see if we want it
-    for (file_index_t *f = gFileIndex; f->name; f = f->next) {
+    for (file_index_t *f = rs->files; f->name; f = f->next) {
         bool match = !count;
         for (char **spec = specs; spec < specs + count; ++spec) {
             if (spec_match(*spec, f->name)) {
@@ -273,7 +313,7 @@ static void wanted_files(size_t count, char **specs) {
             if (last) {
                 last->next = w;
             } else {
-                gWantedFiles = w;
+                rs->wanted = w;
             }
             last = w;
         }
@@ -290,141 +330,156 @@ static void wanted_files(size_t count, char **specs) {
 #pragma mark READ
 
 static void block_capacity(io_block_t *ib, size_t incap, size_t outcap) {
-	if (incap > ib->incap) {
-		ib->incap = incap;
-		ib->input = realloc(ib->input, incap);
-	}
+	if (incap > ib->incap)
+		ib->input = pool_realloc(ib->input, incap, ib->node, &ib->incap);
 	if (outcap > ib->outcap) {
-		ib->outcap = outcap;
-		ib->output = xmalloc(outcap);
+		// Old contents aren't needed
+		pool_free(ib->output);
+		ib->output = pool_alloc(outcap, ib->node, &ib->outcap);
 	}
 }
 
-// Get the next rbuf from the pipeline, and put it in gRbuf
-static void rbuf_from_pipeline(void) {
-    queue_pop(gPipelineStartQ, (void**)&gRbufPI);
-    gRbuf = (io_block_t*)(gRbufPI->data);
-    gRbuf->insize = gRbuf->outsize = 0;
+// Get the next rbuf from the pipeline, and put it in rs->rbuf
+static void rbuf_from_pipeline(pipeline_t *pl) {
+    read_state_t *rs = (read_state_t*)pl->ctx;
+    rs->rbuf_pi = pipeline_fetch(pl);
+    rs->rbuf_trace = trace_begin();
+    rs->rbuf = (io_block_t*)(rs->rbuf_pi->data);
+    rs->rbuf->insize = rs->rbuf->outsize = 0;
 }
 
 // Ensure at least this many bytes available
 // Return 1 on success, zero on EOF, -1 on error
-static rbuf_read_status rbuf_read(size_t bytes) {
-	if (!gRbufPI) {
-        rbuf_from_pipeline();
+static rbuf_read_status rbuf_read(pipeline_t *pl, size_t bytes) {
+    read_state_t *rs = (read_state_t*)pl->ctx;
+	if (!rs->rbuf_pi) {
+        rbuf_from_pipeline(pl);
 	}
 	
-	if (gRbuf->insize >= bytes)
+	if (rs->rbuf->insize >= bytes)
 		return RBUF_FULL;
 	
-	block_capacity(gRbuf, bytes, 0);
-	size_t r = fread(gRbuf->input + gRbuf->insize, 1, bytes - gRbuf->insize,
-		gInFile);
-	gRbuf->insize += r;
+	block_capacity(rs->rbuf, bytes, 0);
+	size_t r = fread(rs->rbuf->input + rs->rbuf->insize, 1, bytes - rs->rbuf->insize,
+		rs->in);
+	rs->rbuf->insize += r;
 	
 	if (r)
-		return (gRbuf->insize == bytes) ? RBUF_FULL : RBUF_PART;
-	return feof(gInFile) ? RBUF_EOF : RBUF_ERR;
+		return (rs->rbuf->insize == bytes) ? RBUF_FULL : RBUF_PART;
+	return feof(rs->in) ? RBUF_EOF : RBUF_ERR;
 }
 
-static bool rbuf_cycle(lzma_stream *stream, bool start, size_t skip) {
+static bool rbuf_cycle(pipeline_t *pl, lzma_stream *stream, bool start,
+        size_t skip) {
+    read_state_t *rs = (read_state_t*)pl->ctx;
 	if (!start) {
-		rbuf_consume(gRbuf->insize);
-		if (rbuf_read(CHUNKSIZE) < RBUF_PART)
+		rbuf_consume(rs, rs->rbuf->insize);
+		if (rbuf_read(pl, CHUNKSIZE) < RBUF_PART)
 			return false;
 	}
-	stream->next_in = gRbuf->input + skip;
-	stream->avail_in = gRbuf->insize - skip;
+	stream->next_in = rs->rbuf->input + skip;
+	stream->avail_in = rs->rbuf->insize - skip;
 	return true;
 }
 
-static void rbuf_consume(size_t bytes) {
-	if (bytes < gRbuf->insize)
-		memmove(gRbuf->input, gRbuf->input + bytes, gRbuf->insize - bytes);
-	gRbuf->insize -= bytes;
+static void rbuf_consume(read_state_t *rs, size_t bytes) {
+	if (bytes < rs->rbuf->insize)
+		memmove(rs->rbuf->input, rs->rbuf->input + bytes, rs->rbuf->insize - bytes);
+	rs->rbuf->insize -= bytes;
 }
 
-static void rbuf_dispatch(size_t total_size) {
-    pipeline_item_t *prev_pi = gRbufPI;
-    if (gRbuf->insize > total_size) {
+static void rbuf_dispatch(pipeline_t *pl, size_t total_size) {
+    read_state_t *rs = (read_state_t*)pl->ctx;
+    pipeline_item_t *prev_pi = rs->rbuf_pi;
+    trace_end("read", rs->rbuf_trace, pl->split_seq, total_size, total_size);
+    if (rs->rbuf->insize > total_size) {
         // We have extra data, get a place for it to live
-        io_block_t *prev_rbuf = gRbuf;
-        rbuf_from_pipeline();
+        io_block_t *prev_rbuf = rs->rbuf;
+        rbuf_from_pipeline(pl);
         size_t extra = prev_rbuf->insize - total_size;
-        block_capacity(gRbuf, extra, 0);
-        memcpy(gRbuf->input, prev_rbuf->input + total_size, extra);
-        gRbuf->insize = extra;
+        block_capacity(rs->rbuf, extra, 0);
+        memcpy(rs->rbuf->input, prev_rbuf->input + total_size, extra);
+        rs->rbuf->insize = extra;
     } else {
-        gRbufPI = NULL;
-        gRbuf = NULL;
+        rs->rbuf_pi = NULL;
+        rs->rbuf = NULL;
     }
 
-	pipeline_split(prev_pi);
+	pipeline_account(pl, PIPELINE_STAGE_SPLIT, total_size, total_size);
+	pipeline_split(pl, prev_pi);
 }
 
 
-static bool read_header(lzma_check *check) {
+static bool read_header(pipeline_t *pl, lzma_check *check) {
+    read_state_t *rs = (read_state_t*)pl->ctx;
 	lzma_stream_flags stream_flags;
-	rbuf_read_status st = rbuf_read(LZMA_STREAM_HEADER_SIZE);
+	rbuf_read_status st = rbuf_read(pl, LZMA_STREAM_HEADER_SIZE);
 	if (st == RBUF_EOF)
 		return false;
 	else if (st != RBUF_FULL)
 		die("Error reading stream header");
-	lzma_ret err = lzma_stream_header_decode(&stream_flags, gRbuf->input);
+	lzma_ret err = lzma_stream_header_decode(&stream_flags, rs->rbuf->input);
 	if (err == LZMA_FORMAT_ERROR)
 		die("Not an XZ file");
 	else if (err != LZMA_OK)
 		die("Error decoding XZ header");
 	*check = stream_flags.check;
-	rbuf_consume(LZMA_STREAM_HEADER_SIZE);
+	rbuf_consume(rs, LZMA_STREAM_HEADER_SIZE);
 	return true;
 }
 
-static bool read_block(bool force_stream, lzma_check check, off_t uoffset) {
+static bool read_block(pipeline_t *pl, bool force_stream, lzma_check check,
+        off_t uoffset) {
+    read_state_t *rs = (read_state_t*)pl->ctx;
     lzma_filter filters[LZMA_FILTERS_MAX + 1];
     lzma_block block = { .filters = filters, .check = check, .version = 0 };
 	
-	if (rbuf_read(1) != RBUF_FULL)
+	if (rbuf_read(pl, 1) != RBUF_FULL)
 		die("Error reading block header size");
-	if (gRbuf->input[0] == 0)
+	if (rs->rbuf->input[0] == 0)
 		return false;
 	
-	block.header_size = lzma_block_header_size_decode(gRbuf->input[0]);
+	block.header_size = lzma_block_header_size_decode(rs->rbuf->input[0]);
 	if (block.header_size > LZMA_BLOCK_HEADER_SIZE_MAX)
 		die("Block header size too large");
-	if (rbuf_read(block.header_size) != RBUF_FULL)
+	if (rbuf_read(pl, block.header_size) != RBUF_FULL)
 		die("Error reading block header");
-	if (lzma_block_header_decode(&block, NULL, gRbuf->input) != LZMA_OK)
+	if (lzma_block_header_decode(&block, NULL, rs->rbuf->input) != LZMA_OK)
 		die("Error decoding block header");
 		
 	size_t comp = block.compressed_size, outsize = block.uncompressed_size;
 	bool sized = (comp != LZMA_VLI_UNKNOWN && outsize != LZMA_VLI_UNKNOWN);
     if (force_stream || !sized || outsize > MAXSPLITSIZE) {
-		read_streaming(&block, sized ? BLOCK_SIZED : BLOCK_UNSIZED, uoffset);
+		read_streaming(pl, &block, sized ? BLOCK_SIZED : BLOCK_UNSIZED,
+            uoffset);
 	} else {
-		block_capacity(gRbuf, 0, outsize);
-		gRbuf->outsize = outsize;
-		gRbuf->check = check;
-		gRbuf->btype = BLOCK_SIZED;
+		block_capacity(rs->rbuf, 0, outsize);
+		rs->rbuf->outsize = outsize;
+		rs->rbuf->check = check;
+		rs->rbuf->btype = BLOCK_SIZED;
 		
         size_t total_size = lzma_block_total_size(&block);
-		if (rbuf_read(total_size) != RBUF_FULL)
+		if (rbuf_read(pl, total_size) != RBUF_FULL)
 			die("Error reading block contents");
-		rbuf_dispatch(total_size);
+		rbuf_dispatch(pl, total_size);
 	}
 	return true;
 }
 
-static void read_streaming(lzma_block *block, block_type sized, off_t uoffset) {
+static void read_streaming(pipeline_t *pl, lzma_block *block,
+        block_type sized, off_t uoffset) {
+    read_state_t *rs = (read_state_t*)pl->ctx;
     lzma_stream stream = LZMA_STREAM_INIT;
+    stream.allocator = pool_lzma_allocator(0);
     if (lzma_block_decoder(&stream, block) != LZMA_OK)
 		die("Error initializing streaming block decode");
-	rbuf_cycle(&stream, true, block->header_size);
+	rbuf_cycle(pl, &stream, true, block->header_size);
 	stream.avail_out = 0;
 	
 	bool first = true;
     pipeline_item_t *pi = NULL;
     io_block_t *ib = NULL;
+    uint64_t trace = 0;
     
 	lzma_ret err = LZMA_OK;
 	while (err != LZMA_STREAM_END) {
@@ -436,17 +491,22 @@ static void read_streaming(lzma_block *block, block_type sized, off_t uoffset) {
 				ib->outsize = ib->outcap;
                 ib->uoffset = uoffset;
                 uoffset += ib->outsize;
-				pipeline_dispatch(pi, gPipelineMergeQ);
+                trace_end("stream", trace, pl->split_seq, ib->outsize,
+                    ib->outsize);
+                pipeline_account(pl, PIPELINE_STAGE_SPLIT, ib->outsize,
+                    ib->outsize);
+				pipeline_dispatch(pl, pi, pl->merge_q);
 				first = false;
 			}
-			queue_pop(gPipelineStartQ, (void**)&pi);
+			pi = pipeline_fetch(pl);
+			trace = trace_begin();
 			ib = (io_block_t*)pi->data;
 			ib->btype = (first ? sized : BLOCK_CONTINUATION);
 			block_capacity(ib, 0, STREAMSIZE);
 			stream.next_out = ib->output;
 			stream.avail_out = ib->outcap;
 		}
-		if (stream.avail_in == 0 && !rbuf_cycle(&stream, false, 0))
+		if (stream.avail_in == 0 && !rbuf_cycle(pl, &stream, false, 0))
 			die("Error reading streaming block");
 		
 		err = lzma_code(&stream, LZMA_RUN);
@@ -454,82 +514,120 @@ static void read_streaming(lzma_block *block, block_type sized, off_t uoffset) {
 	
 	if (ib && stream.avail_out != ib->outcap) {
 		ib->outsize = ib->outcap - stream.avail_out;
-		pipeline_dispatch(pi, gPipelineMergeQ);
+        trace_end("stream", trace, pl->split_seq, ib->outsize, ib->outsize);
+        pipeline_account(pl, PIPELINE_STAGE_SPLIT, ib->outsize, ib->outsize);
+		pipeline_dispatch(pl, pi, pl->merge_q);
 	}
-	rbuf_consume(gRbuf->insize - stream.avail_in);
+	rbuf_consume(rs, rs->rbuf->insize - stream.avail_in);
 	lzma_end(&stream);
 }
 
-static void read_index(void) {
+static void read_index(pipeline_t *pl) {
+    read_state_t *rs = (read_state_t*)pl->ctx;
     lzma_stream stream = LZMA_STREAM_INIT;
 	lzma_index *index;
 	if (lzma_index_decoder(&stream, &index, MEMLIMIT) != LZMA_OK)
 		die("Error initializing index decoder");
-	rbuf_cycle(&stream, true, 0);
+	rbuf_cycle(pl, &stream, true, 0);
 	
 	lzma_ret err = LZMA_OK;
 	while (err != LZMA_STREAM_END) {
 		if (err != LZMA_OK)
 			die("Error decoding index");
-		if (stream.avail_in == 0 && !rbuf_cycle(&stream, false, 0))
+		if (stream.avail_in == 0 && !rbuf_cycle(pl, &stream, false, 0))
 			die("Error reading index");
 		err = lzma_code(&stream, LZMA_RUN);
 	}
-	rbuf_consume(gRbuf->insize - stream.avail_in);
+	rbuf_consume(rs, rs->rbuf->insize - stream.avail_in);
 	lzma_end(&stream);
 }
 
-static void read_footer(void) {
+static void read_footer(pipeline_t *pl) {
+    read_state_t *rs = (read_state_t*)pl->ctx;
 	lzma_stream_flags stream_flags;
-	if (rbuf_read(LZMA_STREAM_HEADER_SIZE) != RBUF_FULL)
+	if (rbuf_read(pl, LZMA_STREAM_HEADER_SIZE) != RBUF_FULL)
 		die("Error reading stream footer");
-	if (lzma_stream_footer_decode(&stream_flags, gRbuf->input) != LZMA_OK)
+	if (lzma_stream_footer_decode(&stream_flags, rs->rbuf->input) != LZMA_OK)
 		die("Error decoding XZ footer");
-	rbuf_consume(LZMA_STREAM_HEADER_SIZE);
+	rbuf_consume(rs, LZMA_STREAM_HEADER_SIZE);
 	
 	char zeros[4] = "\0\0\0\0";
 	while (true) {
-		rbuf_read_status st = rbuf_read(4);
+		rbuf_read_status st = rbuf_read(pl, 4);
 		if (st == RBUF_EOF)
 			return;
 		if (st != RBUF_FULL)
 			die("Footer must be multiple of four bytes");
-		if (memcmp(zeros, gRbuf->input, 4) != 0)
+		if (memcmp(zeros, rs->rbuf->input, 4) != 0)
 			return;
-		rbuf_consume(4);
+		rbuf_consume(rs, 4);
 	}
 }
 
-static void read_thread_noindex(void) {
+static void read_thread_noindex(pipeline_t *pl) {
 	bool empty = true;
 	lzma_check check = LZMA_CHECK_NONE;
-	while (read_header(&check)) {
+	while (read_header(pl, &check)) {
 		empty = false;
-		while (read_block(false, check, 0))
+		while (read_block(pl, false, check, 0))
 			; // pass
-		read_index();
-		read_footer();
+		read_index(pl);
+		read_footer(pl);
 	}
 	if (empty)
 		die("Empty input");
-	pipeline_stop();
+	pipeline_stop(pl);
 }
 
-static void read_thread(void) {
-    off_t offset = ftello(gInFile);
-    wanted_t *w = gWantedFiles;
+// Estimate the memory a block and a decoder need, or zero if we can't tell.
+// The dictionary is never much bigger than a block, for files we wrote.
+static void index_memory(lzma_index *index, size_t *item_mem,
+        size_t *decoder_mem) {
+    *item_mem = *decoder_mem = 0;
+    if (!index)
+        return;
     
+    size_t usize = 0;
     lzma_index_iter iter;
-    lzma_index_iter_init(&iter, gIndex);
+    lzma_index_iter_init(&iter, index);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+        size_t mem = pool_capacity(iter.block.total_size)
+            + pool_capacity(iter.block.uncompressed_size);
+        if (mem > *item_mem)
+            *item_mem = mem;
+        if (iter.block.uncompressed_size > usize)
+            usize = iter.block.uncompressed_size;
+    }
+    
+    lzma_options_lzma opts;
+    if (lzma_lzma_preset(&opts, 0))
+        die("Error setting lzma options");
+    opts.dict_size = usize < LZMA_DICT_SIZE_MIN ? LZMA_DICT_SIZE_MIN
+        : usize > (1U << 30) ? (1U << 30) : usize;
+    lzma_filter filters[] = {
+        { .id = LZMA_FILTER_LZMA2, .options = &opts },
+        { .id = LZMA_VLI_UNKNOWN, .options = NULL } };
+    uint64_t mem = lzma_raw_decoder_memusage(filters);
+    if (mem != UINT64_MAX)
+        *decoder_mem = mem;
+}
+
+static void read_thread(pipeline_t *pl) {
+    read_state_t *rs = (read_state_t*)pl->ctx;
+    off_t offset = ftello(rs->in);
+    wanted_t *w = rs->wanted;
+    
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, rs->index);
     while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
         // Don't decode the file-index
         off_t boffset = iter.block.compressed_file_offset;
         size_t bsize = iter.block.total_size;
-        if (gFileIndexOffset && boffset == gFileIndexOffset)
+        if (rs->file_index_offset && boffset == rs->file_index_offset)
             continue;
         
         // Do we need this block?
-        if (gWantedFiles && gExplicitFiles) {
+        if (rs->wanted && rs->explicit_files) {
             off_t uend = iter.block.uncompressed_file_offset +
                 iter.block.uncompressed_size;
             if (!w || w->start >= uend) {
@@ -542,24 +640,24 @@ static void read_thread(void) {
         
         // Seek if needed, and get the data
         if (offset != boffset) {
-            fseeko(gInFile, boffset, SEEK_SET);
+            fseeko(rs->in, boffset, SEEK_SET);
             offset = boffset;
         }
 		
 		if (iter.block.uncompressed_size > MAXSPLITSIZE) { // must stream
-			if (gRbuf)
-				rbuf_consume(gRbuf->insize); // clear
-			read_block(true, iter.stream.flags->check,
+			if (rs->rbuf)
+				rbuf_consume(rs, rs->rbuf->insize); // clear
+			read_block(pl, true, iter.stream.flags->check,
                 iter.block.uncompressed_file_offset);
 		} else {
             // Get a block to work with
-            pipeline_item_t *pi;
-            queue_pop(gPipelineStartQ, (void**)&pi);
+            pipeline_item_t *pi = pipeline_fetch(pl);
+            uint64_t trace = trace_begin();
             io_block_t *ib = (io_block_t*)(pi->data);
             block_capacity(ib, bsize,
                 iter.block.uncompressed_size);
             
-	        ib->insize = fread(ib->input, 1, bsize, gInFile);
+	        ib->insize = fread(ib->input, 1, bsize, rs->in);
 	        if (ib->insize < bsize)
 	            die("Error reading block contents");
 	        offset += bsize;
@@ -567,17 +665,82 @@ static void read_thread(void) {
 			ib->check = iter.stream.flags->check;
 			ib->btype = BLOCK_SIZED; // Indexed blocks always sized
 			
-	        pipeline_split(pi);
+	        trace_end("read", trace, pl->split_seq, bsize, bsize);
+	        pipeline_account(pl, PIPELINE_STAGE_SPLIT, bsize, bsize);
+	        pipeline_split(pl, pi);
 		}
     }
     
-    pipeline_stop();
+    pipeline_stop(pl);
 }
 
 #pragma mark DECODE
 
-static void decode_thread(size_t thnum) {
+// Blocks of a single repeated byte from pixz are copies of one LZMA2 chunk,
+// each resetting the dictionary, then a tail. If the first chunk decodes
+// to a run, its copies must too, so just fill them in. Only the first
+// chunk and the tail are decoded, but the check still covers everything.
+static bool decode_run(lzma_stream *stream, io_block_t *ib,
+        lzma_block *block) {
+    const uint8_t *body = ib->input + block->header_size;
+    size_t len = block->compressed_size, outsize = block->uncompressed_size;
+    if (len == LZMA_VLI_UNKNOWN || outsize == LZMA_VLI_UNKNOWN
+            || outsize > ib->outcap || len < 6 || body[0] < 0xE0
+            || block->filters[0].id != LZMA_FILTER_LZMA2
+            || block->filters[1].id != LZMA_VLI_UNKNOWN
+            || !check_supported(block->check))
+        return false;
+    size_t usize = (((body[0] & 0x1F) << 16) | (body[1] << 8) | body[2]) + 1;
+    size_t chunk = ((body[3] << 8) | body[4]) + 1 + 6, copies = 1;
+    while ((copies + 1) * chunk <= len
+            && memcmp(body + copies * chunk, body, chunk) == 0)
+        ++copies;
+    if (copies < 2 || copies * usize > outsize)
+        return false;
+    
+    lzma_options_lzma opts = *(lzma_options_lzma*)block->filters[0].options;
+    opts.dict_size = RUN_DICT;
+    lzma_filter filters[] = {
+        { .id = LZMA_FILTER_LZMA2, .options = &opts },
+        { .id = LZMA_VLI_UNKNOWN, .options = NULL },
+    };
+    if (lzma_raw_decoder(stream, filters) != LZMA_OK)
+        die("Error initializing raw decode");
+    stream->next_in = body;
+    stream->avail_in = chunk;
+    stream->next_out = ib->output;
+    stream->avail_out = usize;
+    lzma_ret err = lzma_code(stream, LZMA_RUN);
+    if ((err != LZMA_OK && err != LZMA_STREAM_END) || stream->avail_out
+            || memcmp(ib->output, ib->output + 1, usize - 1))
+        return false;
+    memset(ib->output + usize, ib->output[0], (copies - 1) * usize);
+    
+    stream->next_in = body + copies * chunk;
+    stream->avail_in = len - copies * chunk;
+    stream->next_out = ib->output + copies * usize;
+    stream->avail_out = outsize - copies * usize;
+    while ((err = lzma_code(stream, LZMA_FINISH)) == LZMA_OK)
+        ;
+    if (err != LZMA_STREAM_END || stream->avail_out || stream->avail_in)
+        return false;
+    
+    // Check what we produced, like the block decoder would
+    check_t c;
+    uint8_t want[LZMA_CHECK_SIZE_MAX];
+    check_init(&c, block->check);
+    check_update(&c, ib->output, outsize);
+    size_t n = check_finish(&c, want);
+    if (memcmp(body + len + (-len & 3), want, n) != 0)
+        die("Error decoding block");
+    ib->outsize = outsize;
+    return true;
+}
+
+static void decode_thread(pipeline_t *pl, size_t thnum) {
+    read_state_t *rs = (read_state_t*)pl->ctx;
     lzma_stream stream = LZMA_STREAM_INIT;
+    stream.allocator = pool_lzma_allocator(pl->workers[thnum].node);
     lzma_filter filters[LZMA_FILTERS_MAX + 1];
     lzma_block block = { .filters = filters, .check = LZMA_CHECK_NONE,
 		.version = 0 };
@@ -585,30 +748,40 @@ static void decode_thread(size_t thnum) {
     pipeline_item_t *pi;
     io_block_t *ib;
     
-    while (PIPELINE_STOP != queue_pop(gPipelineSplitQ, (void**)&pi)) {
+    while ((pi = pipeline_next(pl, thnum))) {
+        uint64_t trace = trace_begin();
         ib = (io_block_t*)(pi->data);
+        PROBE(decode_start, thnum, pi->seq, ib->insize);
         
         block.header_size = lzma_block_header_size_decode(*(ib->input));
         block.check = ib->check;
 		if (lzma_block_header_decode(&block, NULL, ib->input) != LZMA_OK)
             die("Error decoding block header");
-        if (lzma_block_decoder(&stream, &block) != LZMA_OK)
-            die("Error initializing block decode");
-        
-        stream.avail_in = ib->insize - block.header_size;
-        stream.next_in = ib->input + block.header_size;
-        stream.avail_out = ib->outcap;
-        stream.next_out = ib->output;
-        
-        lzma_ret err = LZMA_OK;
-        while (err != LZMA_STREAM_END) {
-            if (err != LZMA_OK)
-                die("Error decoding block");
-            err = lzma_code(&stream, LZMA_FINISH);
+        if (rs->runs && decode_run(&stream, ib, &block)) {
+            debug("decoder %zu: run %zu", thnum, pi->seq);
+            atomic_fetch_add(&pl->run_blocks, 1);
+        } else {
+            if (lzma_block_decoder(&stream, &block) != LZMA_OK)
+                die("Error initializing block decode");
+            
+            stream.avail_in = ib->insize - block.header_size;
+            stream.next_in = ib->input + block.header_size;
+            stream.avail_out = ib->outcap;
+            stream.next_out = ib->output;
+            
+            lzma_ret err = LZMA_OK;
+            while (err != LZMA_STREAM_END) {
+                if (err != LZMA_OK)
+                    die("Error decoding block");
+                err = lzma_code(&stream, LZMA_FINISH);
+            }
+            
+            ib->outsize = stream.next_out - ib->output;
         }
-        
-        ib->outsize = stream.next_out - ib->output;
-        queue_push(gPipelineMergeQ, PIPELINE_ITEM, pi);
+        trace_end("decode", trace, pi->seq, ib->insize, ib->outsize);
+        PROBE(decode_done, thnum, pi->seq, ib->insize, ib->outsize);
+        pipeline_account(pl, PIPELINE_STAGE_PROCESS, ib->insize, ib->outsize);
+        pipeline_done(pl, thnum, pi);
     }
     lzma_end(&stream);
 }
@@ -620,54 +793,66 @@ static int tar_ok(struct archive *ar, void *ref) {
     return ARCHIVE_OK;
 }
 
-static bool tar_next_block(void) {
-    if (gArItem && !gArNextItem && gArWanted && gExplicitFiles) {
-        io_block_t *ib = (io_block_t*)(gArItem->data);
-        if (gArWanted->start < ib->uoffset + ib->outsize)
+static bool tar_next_block(pipeline_t *pl) {
+    read_state_t *rs = (read_state_t*)pl->ctx;
+    if (rs->ar_item && !rs->ar_next_item && rs->ar_wanted && rs->explicit_files) {
+        io_block_t *ib = (io_block_t*)(rs->ar_item->data);
+        if (rs->ar_wanted->start < ib->uoffset + ib->outsize)
             return true; // No need
     }
     
-    if (gArLastItem)
-        queue_push(gPipelineStartQ, PIPELINE_ITEM, gArLastItem);
-    gArLastItem = gArItem;
-    gArItem = pipeline_merged();
-    gArNextItem = false;
-    return gArItem;
+    if (rs->ar_last_item)
+        pipeline_recycle(pl, rs->ar_last_item);
+    rs->ar_last_item = rs->ar_item;
+    rs->ar_item = pipeline_merged(pl);
+    rs->ar_next_item = false;
+    if (rs->ar_item) {
+        io_block_t *ib = (io_block_t*)(rs->ar_item->data);
+        pipeline_account(pl, PIPELINE_STAGE_MERGE, ib->outsize, ib->outsize);
+    }
+    return rs->ar_item;
 }
 
-static void tar_write_last(void) {
-    if (gArItem) {
-        io_block_t *ib = (io_block_t*)(gArItem->data);
-        if (fwrite(ib->output + gArLastOffset, gArLastSize, 1, gOutFile) != 1)
+static void tar_write_last(read_state_t *rs) {
+    if (rs->ar_item) {
+        uint64_t trace = trace_begin();
+        io_block_t *ib = (io_block_t*)(rs->ar_item->data);
+        if (fwrite(ib->output + rs->ar_last_offset, rs->ar_last_size, 1,
+                rs->out) != 1)
 			die("Can't write previous block");
-        gArLastSize = 0;
+        trace_end("write", trace, rs->ar_item->seq, rs->ar_last_size,
+            rs->ar_last_size);
+        rs->ar_last_size = 0;
     }
 }
 
 static ssize_t tar_read(struct archive *ar, void *ref, const void **bufp) {
+    pipeline_t *pl = (pipeline_t*)ref;
+    read_state_t *rs = (read_state_t*)pl->ctx;
+    
     // If we got here, the last bit of archive is ok to write
-    tar_write_last();
+    tar_write_last(rs);
         
     // Write the first wanted file
-    if (!tar_next_block())
+    if (!tar_next_block(pl))
         return 0;
     
     off_t off;
     off_t size;
-    io_block_t *ib = (io_block_t*)(gArItem->data);
-    if (gWantedFiles && gExplicitFiles) {
-        debug("tar want: %s", gArWanted->name);
-        off = gArWanted->start - ib->uoffset;
-        size = gArWanted->size;
+    io_block_t *ib = (io_block_t*)(rs->ar_item->data);
+    if (rs->wanted && rs->explicit_files) {
+        debug("tar want: %s", rs->ar_wanted->name);
+        off = rs->ar_wanted->start - ib->uoffset;
+        size = rs->ar_wanted->size;
         if (off < 0) {
             size += off;
             off = 0;
         }
         if (off + size > ib->outsize) {
             size = ib->outsize - off;
-            gArNextItem = true; // force the end of this block
+            rs->ar_next_item = true; // force the end of this block
         } else {
-            gArWanted = gArWanted->next;
+            rs->ar_wanted = rs->ar_wanted->next;
         }
     } else {
         off = 0;
@@ -675,8 +860,8 @@ static ssize_t tar_read(struct archive *ar, void *ref, const void **bufp) {
     }
     debug("tar off = %llu, size = %zu", (unsigned long long)off, size);
     
-    gArLastOffset = off;
-    gArLastSize = size;
+    rs->ar_last_offset = off;
+    rs->ar_last_size = size;
     if (bufp)
         *bufp = ib->output + off;
     return size;
@@ -0,0 +1,163 @@
+#include "pixz.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+// Blocks of an earlier archive, found by their contents, so a block whose
+// input is unchanged can be copied instead of compressed again. Blocks are
+// looked up by the check value stored at the end of each one, and by size.
+// A check is too weak to trust on its own, so the candidate is decoded and
+// compared with the new input. That's still far cheaper than encoding.
+// Blocks without a check can't be found.
+
+reference_t *gReference = NULL;
+
+typedef struct {
+    lzma_check type;
+    uint8_t check[LZMA_CHECK_SIZE_MAX];
+    lzma_vli usize, unpadded, total;
+    off_t offset; // of the block in the file
+    bool used;
+} reference_block_t;
+
+struct reference_t {
+    FILE *file;
+    reference_block_t *blocks; // open-addressed by reference_hash
+    size_t mask;
+};
+
+
+#pragma mark DECLARE
+
+static size_t reference_hash(const uint8_t *check, size_t size,
+    lzma_vli usize);
+static bool reference_same(lzma_stream *stream, const uint8_t *in,
+    size_t insize, const uint8_t *block, size_t size, lzma_check check);
+
+
+#pragma mark DEFINE
+
+void reference_open(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        die("can not open reference archive: %s: %s", path, strerror(errno));
+    lzma_index *index = decode_index(f);
+    if (!index)
+        die("Can't read index of reference archive");
+
+    reference_t *ref = xmalloc(sizeof(reference_t));
+    *ref = (reference_t){ .file = f };
+    size_t size = 1;
+    while (size < lzma_index_block_count(index) * 2)
+        size *= 2;
+    ref->mask = size - 1;
+    ref->blocks = xmalloc(size * sizeof(reference_block_t));
+    memset(ref->blocks, 0, size * sizeof(reference_block_t));
+
+    size_t count = 0;
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, index);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+        reference_block_t b = { .type = iter.stream.flags->check,
+            .usize = iter.block.uncompressed_size,
+            .unpadded = iter.block.unpadded_size,
+            .total = iter.block.total_size,
+            .offset = iter.block.compressed_file_offset, .used = true };
+        size_t check_size = lzma_check_size(b.type);
+        if (!check_size || !check_supported(b.type) || check_size > b.total)
+            continue;
+        if (pread(fileno(f), b.check, check_size,
+                b.offset + b.total - check_size) != (ssize_t)check_size)
+            die("Error reading reference archive");
+
+        size_t i = reference_hash(b.check, check_size, b.usize);
+        while (ref->blocks[i & ref->mask].used)
+            ++i;
+        ref->blocks[i & ref->mask] = b;
+        ++count;
+    }
+    lzma_index_end(index, NULL);
+    debug("reference: %zu blocks from %s", count, path);
+    gReference = ref;
+}
+
+void reference_close(void) {
+    if (!gReference)
+        return;
+    fclose(gReference->file);
+    free(gReference->blocks);
+    free(gReference);
+    gReference = NULL;
+}
+
+size_t reference_find(lzma_stream *stream, const uint8_t *in, size_t insize,
+        uint8_t *out, size_t outcap, lzma_vli *unpadded) {
+    reference_t *ref = gReference;
+    if (gCheck == LZMA_CHECK_NONE)
+        return 0;
+    // Only blocks with the same kind of check as ours can be copied
+    check_t c;
+    uint8_t check[LZMA_CHECK_SIZE_MAX];
+    check_init(&c, gCheck);
+    check_update(&c, in, insize);
+    size_t check_size = check_finish(&c, check);
+    
+    size_t i = reference_hash(check, check_size, insize);
+    for (; ref->blocks[i & ref->mask].used; ++i) {
+        reference_block_t *b = &ref->blocks[i & ref->mask];
+        if (b->type != gCheck || b->usize != insize || b->total > outcap
+                || memcmp(b->check, check, check_size) != 0)
+            continue;
+        if (pread(fileno(ref->file), out, b->total, b->offset)
+                != (ssize_t)b->total)
+            die("Error reading reference archive");
+        if (!reference_same(stream, in, insize, out, b->total, gCheck))
+            continue;
+        *unpadded = b->unpadded;
+        return b->total;
+    }
+    return 0;
+}
+
+static size_t reference_hash(const uint8_t *check, size_t size,
+        lzma_vli usize) {
+    uint64_t h = usize * 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < size; ++i)
+        h = (h ^ check[i]) * 0x100000001b3ull;
+    return h ^ (h >> 32);
+}
+
+// Does this block decode to exactly our input?
+static bool reference_same(lzma_stream *stream, const uint8_t *in,
+        size_t insize, const uint8_t *block, size_t size, lzma_check check) {
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block b = { .version = 0, .check = check,
+        .filters = filters };
+    b.header_size = lzma_block_header_size_decode(block[0]);
+    if (b.header_size > size
+            || lzma_block_header_decode(&b, NULL, block) != LZMA_OK)
+        return false;
+    lzma_ret err = lzma_block_decoder(stream, &b);
+    for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
+        free(filters[i].options);
+    if (err != LZMA_OK)
+        return false;
+
+    uint8_t buf[CHUNKSIZE];
+    stream->next_in = block + b.header_size;
+    stream->avail_in = size - b.header_size;
+    size_t pos = 0;
+    while (true) {
+        stream->next_out = buf;
+        stream->avail_out = sizeof(buf);
+        err = lzma_code(stream, LZMA_FINISH);
+        size_t n = sizeof(buf) - stream->avail_out;
+        if (n > insize - pos || memcmp(buf, in + pos, n) != 0)
+            return false;
+        pos += n;
+        if (err == LZMA_STREAM_END)
+            return pos == insize;
+        if (err != LZMA_OK)
+            return false;
+    }
+}
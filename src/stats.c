@@ -0,0 +1,224 @@
+#include "pixz.h"
+
+#include <signal.h>
+
+stats_format_t gStatsFormat = STATS_NONE;
+
+static pthread_mutex_t gStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pipeline_t *gStatsPipelines = NULL;
+
+
+#pragma mark DECLARE
+
+typedef struct {
+    const char *name;
+    size_t threads;
+    uint64_t wall_ns, idle_ns;
+    pipeline_counts_t *counts;
+} stage_report_t;
+
+static uint64_t stats_elapsed(uint64_t start, uint64_t end, uint64_t now);
+static queue_t *stats_queue(pipeline_t *pl, size_t i, char *name,
+    size_t size);
+static void stats_stages(pipeline_t *pl, stage_report_t *stages);
+static void *stats_signal_thread(void *arg);
+
+
+#pragma mark UTIL
+
+static uint64_t stats_elapsed(uint64_t start, uint64_t end, uint64_t now) {
+    if (!start)
+        return 0; // not started yet
+    return (end ? end : now) - start;
+}
+
+static void stats_stages(pipeline_t *pl, stage_report_t *stages) {
+    uint64_t now = monotonic_ns();
+
+    stages[PIPELINE_STAGE_SPLIT] = (stage_report_t){ .name = "reader",
+        .threads = 1,
+        .wall_ns = stats_elapsed(atomic_load(&pl->split_start_ns),
+            atomic_load(&pl->split_end_ns), now),
+        .idle_ns = atomic_load(&pl->start_q->wait_ns) };
+
+    uint64_t wall = 0;
+    for (size_t i = 0; i < pl->process_count; ++i) {
+        pipeline_worker_t *w = &pl->workers[i];
+        wall += stats_elapsed(atomic_load(&w->start_ns),
+            atomic_load(&w->end_ns), now);
+    }
+    stages[PIPELINE_STAGE_PROCESS] = (stage_report_t){ .name = "workers",
+        .threads = pl->process_count, .wall_ns = wall,
+        .idle_ns = pipeline_split_wait(pl) + atomic_load(&pl->park_ns) };
+
+    stages[PIPELINE_STAGE_MERGE] = (stage_report_t){ .name = "writer",
+        .threads = 1,
+        .wall_ns = stats_elapsed(pl->start_ns,
+            atomic_load(&pl->merge_end_ns), now),
+        .idle_ns = atomic_load(&pl->merge_q->wait_ns) };
+
+    for (size_t i = 0; i < PIPELINE_STAGES; ++i) {
+        stages[i].counts = &pl->counts[i];
+        // Waits are timed coarsely, don't let them exceed the wall time
+        if (stages[i].idle_ns > stages[i].wall_ns)
+            stages[i].idle_ns = stages[i].wall_ns;
+    }
+}
+
+
+// Queues in pipeline order: start, split (one per node), merge
+static queue_t *stats_queue(pipeline_t *pl, size_t i, char *name,
+        size_t size) {
+    if (i == 0) {
+        snprintf(name, size, "start");
+        return pl->start_q;
+    } else if (i <= pl->nodes) {
+        if (pl->nodes == 1)
+            snprintf(name, size, "split");
+        else
+            snprintf(name, size, "split%zu", i - 1);
+        return pl->split_q[i - 1];
+    }
+    snprintf(name, size, "merge");
+    return pl->merge_q;
+}
+
+
+#pragma mark REPORT
+
+void stats_print(FILE *out, pipeline_t *pl) {
+    stage_report_t stages[PIPELINE_STAGES];
+    stats_stages(pl, stages);
+
+    size_t nq = pl->nodes + 2;
+    char qname[32];
+    pool_stats_t pool;
+    pool_stats(&pool);
+
+    uint64_t elapsed = monotonic_ns() - pl->start_ns;
+    if (atomic_load(&pl->merge_end_ns))
+        elapsed = atomic_load(&pl->merge_end_ns) - pl->start_ns;
+
+    if (gStatsFormat == STATS_JSON) {
+        fprintf(out, "{\"elapsed\":%.6f,\"stages\":{", elapsed / 1e9);
+        for (size_t i = 0; i < PIPELINE_STAGES; ++i) {
+            stage_report_t *s = &stages[i];
+            fprintf(out, "%s\"%s\":{\"threads\":%zu,\"busy\":%.6f,"
+                "\"idle\":%.6f,\"items\":%" PRIuFAST64 ","
+                "\"bytes_in\":%" PRIuFAST64 ",\"bytes_out\":%" PRIuFAST64 "}",
+                i ? "," : "", s->name, s->threads,
+                (s->wall_ns - s->idle_ns) / 1e9, s->idle_ns / 1e9,
+                atomic_load(&s->counts->items),
+                atomic_load(&s->counts->bytes_in),
+                atomic_load(&s->counts->bytes_out));
+        }
+        fprintf(out, "},\"queues\":{");
+        for (size_t i = 0; i < nq; ++i) {
+            queue_t *q = stats_queue(pl, i, qname, sizeof(qname));
+            fprintf(out, "%s\"%s\":{\"high_water\":%zu,\"capacity\":%zu}",
+                i ? "," : "", qname, atomic_load(&q->high_water),
+                q->mask + 1);
+        }
+        fprintf(out, "},\"merge_stalls\":{\"count\":%zu,\"time\":%.6f},"
+            "\"stored\":{\"blocks\":%zu,\"skipped\":%zu},\"runs\":%zu,"
+            "\"reused\":%zu,\"dedup\":{\"blocks\":%zu,\"hits\":%zu},"
+            "\"buffers\":{\"hits\":%" PRIu64 ",\"misses\":%" PRIu64 ","
+            "\"mapped\":%" PRIu64 ",\"cached\":%" PRIu64 "}}\n",
+            atomic_load(&pl->merge_stalls),
+            atomic_load(&pl->merge_stall_ns) / 1e9,
+            atomic_load(&pl->stored_blocks),
+            atomic_load(&pl->stored_skipped),
+            atomic_load(&pl->run_blocks),
+            atomic_load(&pl->reused_blocks),
+            atomic_load(&pl->dedup_blocks),
+            atomic_load(&pl->dedup_hits),
+            pool.hits, pool.misses, pool.mapped, pool.cached);
+    } else {
+        fprintf(out, "pixz: %.3fs elapsed, %zu workers\n", elapsed / 1e9,
+            pl->process_count);
+        fprintf(out, "%-10s %10s %10s %10s %14s %14s\n", "stage", "busy",
+            "idle", "items", "bytes in", "bytes out");
+        for (size_t i = 0; i < PIPELINE_STAGES; ++i) {
+            stage_report_t *s = &stages[i];
+            fprintf(out, "%-10s %9.3fs %9.3fs %10" PRIuFAST64
+                " %14" PRIuFAST64 " %14" PRIuFAST64 "\n",
+                s->name, (s->wall_ns - s->idle_ns) / 1e9, s->idle_ns / 1e9,
+                atomic_load(&s->counts->items),
+                atomic_load(&s->counts->bytes_in),
+                atomic_load(&s->counts->bytes_out));
+        }
+        fprintf(out, "%-10s %10s %10s\n", "queue", "high-water", "capacity");
+        for (size_t i = 0; i < nq; ++i) {
+            queue_t *q = stats_queue(pl, i, qname, sizeof(qname));
+            fprintf(out, "%-10s %10zu %10zu\n", qname,
+                atomic_load(&q->high_water), q->mask + 1);
+        }
+        fprintf(out, "merge stalls: %zu, %.3fs\n",
+            atomic_load(&pl->merge_stalls),
+            atomic_load(&pl->merge_stall_ns) / 1e9);
+        fprintf(out, "stored blocks: %zu, %zu not encoded\n",
+            atomic_load(&pl->stored_blocks),
+            atomic_load(&pl->stored_skipped));
+        fprintf(out, "run blocks: %zu\n", atomic_load(&pl->run_blocks));
+        fprintf(out, "reused blocks: %zu\n",
+            atomic_load(&pl->reused_blocks));
+        size_t dedup_blocks = atomic_load(&pl->dedup_blocks),
+            dedup_hits = atomic_load(&pl->dedup_hits);
+        fprintf(out, "dedup hits: %zu of %zu blocks (%.1f%%)\n", dedup_hits,
+            dedup_blocks, dedup_blocks ? 100.0 * dedup_hits / dedup_blocks : 0);
+        fprintf(out, "buffers: %" PRIu64 " hits, %" PRIu64 " misses, "
+            "%.1f MiB mapped, %.1f MiB cached\n", pool.hits, pool.misses,
+            pool.mapped / 1048576.0, pool.cached / 1048576.0);
+    }
+    fflush(out);
+}
+
+
+#pragma mark SIGNAL
+
+void stats_init(void) {
+    // Block SIGUSR1 everywhere, so only our thread receives it. Must be
+    // called before any other threads exist.
+    sigset_t *set = xmalloc(sizeof(sigset_t));
+    sigemptyset(set);
+    sigaddset(set, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, set, NULL))
+        die("Can't block signals");
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &stats_signal_thread, set))
+        die("Error creating stats thread");
+    pthread_detach(thread);
+}
+
+static void *stats_signal_thread(void *arg) {
+    sigset_t *set = (sigset_t*)arg;
+    while (true) {
+        int sig;
+        if (sigwait(set, &sig))
+            continue;
+        pthread_mutex_lock(&gStatsMutex);
+        for (pipeline_t *pl = gStatsPipelines; pl; pl = pl->stats_next)
+            stats_print(stderr, pl);
+        pthread_mutex_unlock(&gStatsMutex);
+    }
+    return NULL;
+}
+
+void stats_register(pipeline_t *pl) {
+    pthread_mutex_lock(&gStatsMutex);
+    pl->stats_next = gStatsPipelines;
+    gStatsPipelines = pl;
+    pthread_mutex_unlock(&gStatsMutex);
+}
+
+void stats_unregister(pipeline_t *pl) {
+    pthread_mutex_lock(&gStatsMutex);
+    for (pipeline_t **p = &gStatsPipelines; *p; p = &(*p)->stats_next) {
+        if (*p == pl) {
+            *p = pl->stats_next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gStatsMutex);
+}
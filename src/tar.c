@@ -0,0 +1,499 @@
+#include "pixz.h"
+
+#include <ctype.h>
+
+// Find the entries of a tar archive as it streams past, for the file
+// index. Headers are found by following their size fields, so file
+// contents are never looked at.
+//
+// Names and offsets match what libarchive reports, including its quirks:
+// an entry's offset is that of the first special header before it, sizes
+// of links, devices and directories are ignored, and hard links only have
+// contents in pax archives. Where libarchive ignores a pax "size" record
+// and fails on the archive, we follow POSIX instead.
+
+#define TAR_BLOCK 512
+#define TAR_PAD(n) (((n) + TAR_BLOCK - 1) & ~(uint64_t)(TAR_BLOCK - 1))
+
+// Longer names from special headers are ignored, as libarchive does
+#define TAR_NAME_MAX (1024 * 1024)
+// Larger pax headers are skipped, rather than buffered
+#define TAR_PAX_MAX (64 * 1024 * 1024)
+
+// Header fields
+#define TAR_NAME 0
+#define TAR_MODE 100
+#define TAR_UID 108
+#define TAR_GID 116
+#define TAR_SIZE 124
+#define TAR_MTIME 136
+#define TAR_CHECKSUM 148
+#define TAR_TYPE 156
+#define TAR_MAGIC 257
+#define TAR_VERSION 263
+#define TAR_DEVMAJOR 329
+#define TAR_DEVMINOR 337
+#define TAR_PREFIX 345
+#define TAR_GNU_SPARSE 386 // first sparse entry
+#define TAR_GNU_EXTENDED 482 // more sparse blocks follow
+#define TAR_SPARSE_EXTENDED 504 // in a sparse extension block
+
+typedef enum {
+    SCAN_HEADER,    // collecting a header
+    SCAN_SPARSE,    // collecting a GNU sparse extension block
+    SCAN_BODY,      // collecting the body of a special header
+    SCAN_SKIP,      // skipping contents
+    SCAN_END,
+} scan_state_t;
+
+// Kinds of special header, each allowed once before an entry
+enum {
+    SPECIAL_PAX = 1,
+    SPECIAL_GLOBAL = 2,
+    SPECIAL_LONGNAME = 4,
+    SPECIAL_LONGLINK = 8,
+    SPECIAL_ACL = 16,
+    SPECIAL_VOLUME = 32,
+};
+
+struct tar_scan_t {
+    tar_entry_t entry;
+    void *ctx;
+
+    scan_state_t state;
+    uint64_t pos; // of the input
+    uint8_t block[TAR_BLOCK];
+    size_t fill;
+    uint64_t remain; // to skip, or of the body
+    size_t entries;
+
+    // Special headers seen since the last entry
+    uint64_t group_start;
+    unsigned seen;
+    char *name; // overrides the header's
+    bool has_size;
+    uint64_t size;
+
+    // Body of a special header we want
+    char kind;
+    uint8_t *body;
+    size_t body_len, body_fill;
+
+    // Sticky once we see pax headers, until a GNU or v7 header
+    bool pax;
+};
+
+
+#pragma mark DECLARE
+
+static void tar_fail(const char *msg);
+static bool tar_zero(const uint8_t *b);
+static int64_t tar_number(const uint8_t *p, size_t n);
+static bool tar_number_valid(const uint8_t *p, size_t n);
+static bool tar_checksum(const uint8_t *h);
+static bool tar_bid(const uint8_t *h);
+static void tar_set_name(tar_scan_t *ts, const char *name, size_t len);
+static tar_status_t tar_header(tar_scan_t *ts);
+static void tar_special(tar_scan_t *ts, const uint8_t *h, char type,
+    int64_t size);
+static void tar_body_done(tar_scan_t *ts);
+static void tar_pax(tar_scan_t *ts, char *attr, size_t len);
+static void tar_entry_found(tar_scan_t *ts, const uint8_t *h, char type,
+    int64_t size);
+static void tar_skip(tar_scan_t *ts, uint64_t size);
+
+
+#pragma mark FIELDS
+
+static void tar_fail(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    die("Error reading archive entry");
+}
+
+static bool tar_zero(const uint8_t *b) {
+    for (size_t i = 0; i < TAR_BLOCK; ++i)
+        if (b[i])
+            return false;
+    return true;
+}
+
+// Octal, or GNU base-256 if the high bit is set. Negative on error.
+static int64_t tar_number(const uint8_t *p, size_t n) {
+    if (*p & 0x80) {
+        if (*p & 0x40)
+            return -1; // negative
+        uint64_t v = *p & 0x3f;
+        for (size_t i = 1; i < n; ++i) {
+            if (v >> 55)
+                return INT64_MAX;
+            v = (v << 8) | p[i];
+        }
+        return v > INT64_MAX ? INT64_MAX : (int64_t)v;
+    }
+
+    while (n && (*p == ' ' || *p == '\t')) {
+        ++p;
+        --n;
+    }
+    if (n && *p == '-')
+        return -1;
+    int64_t v = 0;
+    for (; n && *p >= '0' && *p <= '7'; ++p, --n) {
+        if (v > INT64_MAX >> 3)
+            return INT64_MAX;
+        v = (v << 3) | (*p - '0');
+    }
+    return v;
+}
+
+static bool tar_number_valid(const uint8_t *p, size_t n) {
+    if (*p == 0x80 || *p == 0xff || *p == 0)
+        return true;
+    size_t i = 0;
+    while (i < n && p[i] == ' ')
+        ++i;
+    while (i < n && p[i] >= '0' && p[i] <= '7')
+        ++i;
+    for (; i < n; ++i)
+        if (p[i] != ' ' && p[i] != 0)
+            return false;
+    return true;
+}
+
+// Old tars summed signed bytes, accept either
+static bool tar_checksum(const uint8_t *h) {
+    int64_t sum = tar_number(h + TAR_CHECKSUM, 8);
+    int64_t u = 0, s = 0;
+    for (size_t i = 0; i < TAR_BLOCK; ++i) {
+        bool field = i >= TAR_CHECKSUM && i < TAR_CHECKSUM + 8;
+        u += field ? ' ' : h[i];
+        s += field ? ' ' : (signed char)h[i];
+    }
+    return sum == u || sum == s;
+}
+
+// Does the first header look like tar? Otherwise it's some other data.
+static bool tar_bid(const uint8_t *h) {
+    char type = h[TAR_TYPE];
+    if (type && !isalnum((unsigned char)type))
+        return false;
+    static const size_t fields[][2] = { { TAR_MODE, 8 }, { TAR_UID, 8 },
+        { TAR_GID, 8 }, { TAR_MTIME, 12 }, { TAR_SIZE, 12 },
+        { TAR_DEVMAJOR, 8 }, { TAR_DEVMINOR, 8 } };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+        if (!tar_number_valid(h + fields[i][0], fields[i][1]))
+            return false;
+    return tar_checksum(h);
+}
+
+static void tar_set_name(tar_scan_t *ts, const char *name, size_t len) {
+    free(ts->name);
+    ts->name = xmalloc(len + 1);
+    memcpy(ts->name, name, len);
+    ts->name[len] = '\0';
+}
+
+
+#pragma mark HEADERS
+
+static tar_status_t tar_header(tar_scan_t *ts) {
+    const uint8_t *h = ts->block;
+    bool first = ts->pos == TAR_BLOCK;
+    if (tar_zero(h)) {
+        ts->state = SCAN_END;
+        return ts->entries ? TAR_END : TAR_NOT_TAR;
+    }
+    if (first && !tar_bid(h))
+        return TAR_NOT_TAR;
+    if (!tar_checksum(h))
+        tar_fail("Damaged tar archive");
+
+    int64_t size = tar_number(h + TAR_SIZE, 12);
+    if (size < 0)
+        tar_fail("Tar entry has negative size");
+    if (!ts->seen)
+        ts->group_start = ts->pos - TAR_BLOCK;
+
+    char type = h[TAR_TYPE];
+    switch (type) {
+        case 'x': case 'X': case 'g': case 'L': case 'K': case 'A': case 'V':
+            tar_special(ts, h, type, size);
+            break;
+        default:
+            tar_entry_found(ts, h, type, size);
+    }
+    return TAR_MORE;
+}
+
+static void tar_special(tar_scan_t *ts, const uint8_t *h, char type,
+        int64_t size) {
+    unsigned kind;
+    switch (type) {
+        case 'x': case 'X': kind = SPECIAL_PAX; break;
+        case 'g': kind = SPECIAL_GLOBAL; break;
+        case 'L': kind = SPECIAL_LONGNAME; break;
+        case 'K': kind = SPECIAL_LONGLINK; break;
+        case 'A': kind = SPECIAL_ACL; break;
+        default: kind = SPECIAL_VOLUME;
+    }
+    if (ts->seen & kind)
+        tar_fail("Redundant special header in tar archive");
+    ts->seen |= kind;
+    if (kind == SPECIAL_PAX || kind == SPECIAL_GLOBAL)
+        ts->pax = true;
+
+    // Collect the bodies we need, skip the rest
+    bool want = (kind == SPECIAL_PAX && size <= TAR_PAX_MAX)
+        || (kind == SPECIAL_LONGNAME && size <= TAR_NAME_MAX);
+    if (!want || !size) {
+        tar_skip(ts, size);
+        return;
+    }
+    ts->kind = type;
+    ts->body_len = size;
+    ts->body_fill = 0;
+    ts->body = xmalloc(size + 1);
+    ts->remain = TAR_PAD(size);
+    ts->state = SCAN_BODY;
+}
+
+static void tar_body_done(tar_scan_t *ts) {
+    char *body = (char*)ts->body;
+    body[ts->body_len] = '\0';
+    if (ts->kind == 'L')
+        tar_set_name(ts, body, strlen(body));
+    else
+        tar_pax(ts, body, ts->body_len);
+    free(ts->body);
+    ts->body = NULL;
+}
+
+// Records look like "LEN key=value\n". If any is malformed, libarchive
+// ignores them all.
+static void tar_pax(tar_scan_t *ts, char *attr, size_t len) {
+    const char *path = NULL, *sparse = NULL;
+    bool has_size = false;
+    uint64_t size = 0;
+    while (len) {
+        size_t rec = 0, i = 0;
+        while (i < len && attr[i] >= '0' && attr[i] <= '9') {
+            rec = rec * 10 + (attr[i++] - '0');
+            if (rec > len)
+                return;
+        }
+        if (i == len || attr[i] != ' ' || rec <= i + 1
+                || attr[rec - 1] != '\n')
+            return;
+        attr[rec - 1] = '\0';
+        char *key = attr + i + 1, *eq = strchr(key, '=');
+        if (!eq || eq == key)
+            return;
+        *eq = '\0';
+        char *value = eq + 1;
+
+        if (strcmp(key, "path") == 0) {
+            path = value;
+        } else if (strcmp(key, "GNU.sparse.name") == 0) {
+            sparse = value;
+        } else if (strcmp(key, "size") == 0) {
+            has_size = true;
+            size = strtoull(value, NULL, 10);
+        }
+        attr += rec;
+        len -= rec;
+    }
+
+    // A sparse file's real name beats its path, whichever comes first
+    const char *name = sparse && *sparse ? sparse : path;
+    if (name && *name && strlen(name) <= TAR_NAME_MAX)
+        tar_set_name(ts, name, strlen(name));
+    if (has_size) {
+        ts->has_size = true;
+        ts->size = size;
+    }
+}
+
+static void tar_entry_found(tar_scan_t *ts, const uint8_t *h, char type,
+        int64_t size) {
+    const char *magic = (const char*)h + TAR_MAGIC;
+    bool ustar = memcmp(magic, "ustar\0", 6) == 0;
+    bool gnu = memcmp(magic, "ustar ", 6) == 0
+        && memcmp(h + TAR_VERSION, " \0", 2) == 0;
+    if (!ustar)
+        ts->pax = false;
+
+    if (!ts->name) {
+        char name[256 + 1];
+        size_t len = 0;
+        size_t plen = strnlen((const char*)h + TAR_PREFIX, 155);
+        if (ustar && plen) {
+            memcpy(name, h + TAR_PREFIX, plen);
+            len = plen;
+            if (name[len - 1] != '/')
+                name[len++] = '/';
+        }
+        size_t nlen = strnlen((const char*)h + TAR_NAME, 100);
+        memcpy(name + len, h + TAR_NAME, nlen);
+        tar_set_name(ts, name, len + nlen);
+    }
+    ts->entry(ts->ctx, ts->group_start, ts->name);
+    ++ts->entries;
+
+    uint64_t contents = ts->has_size ? ts->size : (uint64_t)size;
+    switch (type) {
+        case '1':
+            if (!ts->pax)
+                contents = 0;
+            break;
+        case '2': case '3': case '4': case '5': case '6':
+            contents = 0;
+            break;
+    }
+
+    free(ts->name);
+    ts->name = NULL;
+    ts->seen = 0;
+    ts->has_size = false;
+
+    // Like libarchive, only look for extension blocks if the sparse map in
+    // the header isn't empty
+    if (type == 'S' && gnu && h[TAR_GNU_SPARSE] && h[TAR_GNU_EXTENDED]) {
+        ts->remain = contents;
+        ts->state = SCAN_SPARSE;
+    } else {
+        tar_skip(ts, contents);
+    }
+}
+
+static void tar_skip(tar_scan_t *ts, uint64_t size) {
+    ts->remain = TAR_PAD(size);
+    ts->state = ts->remain ? SCAN_SKIP : SCAN_HEADER;
+}
+
+
+#pragma mark API
+
+tar_scan_t *tar_scan_new(tar_entry_t entry, void *ctx) {
+    tar_scan_t *ts = xmalloc(sizeof(tar_scan_t));
+    *ts = (tar_scan_t){ .entry = entry, .ctx = ctx };
+    return ts;
+}
+
+void tar_scan_free(tar_scan_t *ts) {
+    free(ts->name);
+    free(ts->body);
+    free(ts);
+}
+
+tar_status_t tar_scan(tar_scan_t *ts, const uint8_t *buf, size_t len) {
+    while (len) {
+        size_t n = 0;
+        switch (ts->state) {
+            case SCAN_END:
+                return TAR_END;
+
+            case SCAN_SKIP:
+                n = len < ts->remain ? len : ts->remain;
+                ts->remain -= n;
+                if (!ts->remain)
+                    ts->state = SCAN_HEADER;
+                break;
+
+            case SCAN_BODY:
+                n = len < ts->remain ? len : ts->remain;
+                if (ts->body_fill < ts->body_len) {
+                    size_t c = ts->body_len - ts->body_fill;
+                    if (c > n)
+                        c = n;
+                    memcpy(ts->body + ts->body_fill, buf, c);
+                    ts->body_fill += c;
+                }
+                ts->remain -= n;
+                if (!ts->remain) {
+                    tar_body_done(ts);
+                    ts->state = SCAN_HEADER;
+                }
+                break;
+
+            case SCAN_HEADER: case SCAN_SPARSE:
+                n = TAR_BLOCK - ts->fill;
+                if (n > len)
+                    n = len;
+                memcpy(ts->block + ts->fill, buf, n);
+                ts->fill += n;
+                break;
+        }
+        buf += n;
+        len -= n;
+        ts->pos += n;
+
+        if (ts->fill == TAR_BLOCK) {
+            ts->fill = 0;
+            if (ts->state == SCAN_SPARSE) {
+                if (!ts->block[TAR_SPARSE_EXTENDED])
+                    tar_skip(ts, ts->remain);
+            } else {
+                tar_status_t st = tar_header(ts);
+                if (st != TAR_MORE)
+                    return st;
+            }
+        }
+    }
+    return ts->state == SCAN_END ? TAR_END : TAR_MORE;
+}
+
+tar_status_t tar_scan_finish(tar_scan_t *ts) {
+    if (ts->state == SCAN_END)
+        return ts->entries ? TAR_END : TAR_NOT_TAR;
+    if (ts->pos == 0)
+        tar_fail("Unrecognized archive format");
+    if (ts->pos < TAR_BLOCK)
+        return TAR_NOT_TAR; // too short to be tar
+    if (ts->state != SCAN_HEADER)
+        tar_fail("Truncated input file");
+    if (ts->fill)
+        tar_fail("Truncated tar archive");
+    return ts->entries ? TAR_END : TAR_NOT_TAR;
+}
+
+void tar_scan_skip(tar_scan_t *ts) {
+    if (ts->state != SCAN_SKIP)
+        return;
+    ts->pos += ts->remain;
+    ts->remain = 0;
+    ts->state = SCAN_HEADER;
+}
+
+uint64_t tar_scan_pos(tar_scan_t *ts) {
+    return ts->state == SCAN_END ? ts->pos - TAR_BLOCK : ts->pos;
+}
+
+// Where an entry's contents start, given the start of its headers. Zero if
+// that's not within len, or the headers don't make sense.
+size_t tar_data_offset(const uint8_t *buf, size_t len, uint64_t *datasize) {
+    size_t off = 0;
+    while (off + TAR_BLOCK <= len) {
+        const uint8_t *h = buf + off;
+        if (tar_zero(h) || !tar_checksum(h))
+            return 0;
+        int64_t size = tar_number(h + TAR_SIZE, 12);
+        if (size < 0)
+            return 0;
+        off += TAR_BLOCK;
+        switch (h[TAR_TYPE]) {
+            case 'x': case 'X': case 'g': case 'L': case 'K': case 'A':
+            case 'V':
+                if ((uint64_t)size > len - off)
+                    return 0;
+                off += TAR_PAD(size);
+                break;
+            case 'S':
+                return 0; // sparse maps may follow
+            default:
+                if (datasize)
+                    *datasize = size;
+                return off < len ? off : 0;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include "pixz.h"
+
+#include <stdarg.h>
+#include <unistd.h>
+
+// Events are buffered per-thread, and written out in batches. The output
+// is the Chrome trace-event "JSON array" format, which tolerates a missing
+// closing bracket, so a trace is still readable if we die mid-run.
+
+#define TRACE_BUFSIZE 1024
+
+FILE *gTraceFile = NULL;
+
+typedef struct {
+    const char *name;
+    uint64_t start, end;
+    size_t seq, in, out;
+} trace_event_t;
+
+typedef struct trace_buf_t trace_buf_t;
+struct trace_buf_t {
+    trace_buf_t *next;
+    size_t tid;
+    size_t count;
+    trace_event_t events[TRACE_BUFSIZE];
+};
+
+static pthread_mutex_t gTraceMutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_buf_t *gTraceBufs = NULL;
+static size_t gTraceThreads = 0;
+static uint64_t gTraceStart;
+static bool gTraceFirst = true;
+static _Thread_local trace_buf_t *tTraceBuf = NULL;
+
+
+#pragma mark DECLARE
+
+static trace_buf_t *trace_buf(void);
+static void trace_record(const char *fmt, ...);
+static void trace_flush(trace_buf_t *tb);
+
+
+#pragma mark OUTPUT
+
+// Must hold gTraceMutex
+static void trace_record(const char *fmt, ...) {
+    fputs(gTraceFirst ? "[\n" : ",\n", gTraceFile);
+    gTraceFirst = false;
+
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(gTraceFile, fmt, args);
+    va_end(args);
+}
+
+static void trace_flush(trace_buf_t *tb) {
+    pthread_mutex_lock(&gTraceMutex);
+    for (size_t i = 0; i < tb->count; ++i) {
+        trace_event_t *e = &tb->events[i];
+        trace_record("{\"name\":\"%s\",\"cat\":\"block\",\"ph\":\"X\","
+            "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%zu,"
+            "\"args\":{\"seq\":%zu,\"in\":%zu,\"out\":%zu}}",
+            e->name, (e->start - gTraceStart) / 1e3,
+            (e->end - e->start) / 1e3, (int)getpid(), tb->tid,
+            e->seq, e->in, e->out);
+    }
+    tb->count = 0;
+    pthread_mutex_unlock(&gTraceMutex);
+}
+
+
+#pragma mark API
+
+void trace_open(const char *path) {
+    if (!(gTraceFile = fopen(path, "w")))
+        die("Can't open trace file");
+    gTraceStart = monotonic_ns();
+}
+
+void trace_close(void) {
+    if (!gTraceFile)
+        return;
+
+    for (trace_buf_t *tb = gTraceBufs; tb; ) {
+        trace_buf_t *next = tb->next;
+        trace_flush(tb);
+        free(tb);
+        tb = next;
+    }
+    gTraceBufs = NULL;
+    tTraceBuf = NULL;
+
+    fputs(gTraceFirst ? "[]\n" : "\n]\n", gTraceFile);
+    if (fclose(gTraceFile) != 0)
+        die("Error writing trace file");
+    gTraceFile = NULL;
+}
+
+static trace_buf_t *trace_buf(void) {
+    if (!tTraceBuf) {
+        tTraceBuf = xmalloc(sizeof(trace_buf_t));
+        tTraceBuf->count = 0;
+        pthread_mutex_lock(&gTraceMutex);
+        tTraceBuf->tid = ++gTraceThreads;
+        tTraceBuf->next = gTraceBufs;
+        gTraceBufs = tTraceBuf;
+        pthread_mutex_unlock(&gTraceMutex);
+    }
+    return tTraceBuf;
+}
+
+void trace_thread(const char *fmt, ...) {
+    if (!gTraceFile)
+        return;
+
+    char name[64];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(name, sizeof(name), fmt, args);
+    va_end(args);
+
+    trace_buf_t *tb = trace_buf();
+    pthread_mutex_lock(&gTraceMutex);
+    trace_record("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+        "\"tid\":%zu,\"args\":{\"name\":\"%s\"}}",
+        (int)getpid(), tb->tid, name);
+    pthread_mutex_unlock(&gTraceMutex);
+}
+
+void trace_span(const char *name, uint64_t start, size_t seq, size_t in,
+        size_t out) {
+    trace_buf_t *tb = trace_buf();
+    tb->events[tb->count++] = (trace_event_t){ .name = name, .start = start,
+        .end = monotonic_ns(), .seq = seq, .in = in, .out = out };
+    if (tb->count == TRACE_BUFSIZE)
+        trace_flush(tb);
+}
@@ -1,16 +1,48 @@
+#define _GNU_SOURCE
 #include "pixz.h"
 
 #include <archive.h>
 #include <archive_entry.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 #pragma mark TYPES
 
+// Filters to put before LZMA2, chosen per block from what's in it
+typedef enum {
+    FILTER_LZMA,
+    FILTER_X86,
+    FILTER_ARM64,
+    FILTER_DELTA,
+    FILTER_STORE, // not worth compressing
+    FILTER_KINDS
+} filter_kind;
+
+typedef struct {
+    filter_kind kind;
+    uint32_t dist; // for delta
+} filter_choice_t;
+
 typedef struct io_block_t io_block_t;
 struct io_block_t {
     lzma_block block;
     uint8_t *input, *output;
     size_t insize, outsize;
+    size_t node;
+    bool mapped; // input points into the input mapping
+    
+    dedup_entry_t *dedup; // blocks with the same input
+    bool dup; // an earlier block has the same input, copy its output
+    
+    filter_choice_t filter;
+    lzma_filter filters[3];
+    lzma_options_delta delta;
 };
 
 
@@ -18,35 +50,174 @@ struct io_block_t {
 
 #define LZMA_CHUNK_MAX (1 << 16)
 
+// How much to read at once, when input can't be mapped
+#define READ_CHUNK (1024 * 1024)
+
+// Sample this much of each block, in this many pieces, to guess whether
+// it's worth compressing. Blocks smaller than the sample are just compressed.
+#define SAMPLE_SIZE (64 * 1024)
+#define SAMPLE_PIECES 16
+#define SAMPLE_ANCHORS 4096
+
+// LZMA2 chunks hold at most this much uncompressed data
+#define RUN_UNIT (2 * 1024 * 1024)
+
+// Don't shrink the dictionary below that of -0 to meet a memory budget
+#define WRITE_MIN_DICT (256 * 1024)
+
 double gBlockFraction = 2.0;
+bool gBlockAlign = false;
+bool gBlockRsyncable = false;
+
+// With gBlockAlign, a full block may end this much early at an entry boundary
+#define ALIGN_SLACK(size) ((size) / 4)
+// Blocks aren't cut shorter than this to start a huge entry afresh
+#define ALIGN_MIN(size) ((size) / 16)
+// With gBlockRsyncable, blocks end by content once they're at least this big,
+// at a spot expected about every RSYNC_SPACING(size) bytes
+#define RSYNC_MIN(size) ((size) / 2)
+#define RSYNC_SPACING(size) ((size) / 8)
+
+// Input mappings, for the SIGBUS handler. Reading past the end of a file
+// that shrank raises SIGBUS in whatever thread gets there, often deep in
+// liblzma, so the handler maps zeros there instead and we fail afterwards.
+typedef struct input_mapping_t input_mapping_t;
+struct input_mapping_t {
+    uintptr_t start, end;
+    volatile sig_atomic_t truncated;
+    input_mapping_t *next;
+};
 
-static bool gTar = true;
+// Every live mapping, from every write running at once. The handler is
+// installed the first time anything is mapped, and stays.
+static pthread_mutex_t gInputMappingsMutex = PTHREAD_MUTEX_INITIALIZER;
+static input_mapping_t *gInputMappings = NULL;
+static pthread_once_t gInputSigbusOnce = PTHREAD_ONCE_INIT;
+static struct sigaction gInputSigbusOld;
 
-static size_t gBlockInSize = 0, gBlockOutSize = 0;
+// A new archive being built to replace the one we append to
+typedef struct append_temp_t append_temp_t;
+struct append_temp_t {
+    char *path, *target;
+    int fd;
+    append_temp_t *next;
+};
+
+// Every one not renamed into place yet, to remove if we exit first
+static pthread_mutex_t gAppendTempsMutex = PTHREAD_MUTEX_INITIALIZER;
+static append_temp_t *gAppendTemps = NULL;
+static pthread_once_t gAppendTempsOnce = PTHREAD_ONCE_INIT;
 
-static off_t gMultiHeaderStart = 0;
-static bool gMultiHeader = false;
-static off_t gTotalRead = 0;
+// Copy the kept start of an archive this much at a time
+#define APPEND_COPY_SIZE (1024 * 1024)
 
-static pipeline_item_t *gReadItem = NULL;
-static io_block_t *gReadBlock = NULL;
-static size_t gReadItemCount = 0;
 
-static lzma_filter gFilters[LZMA_FILTERS_MAX + 1];
+#pragma mark STATE
 
-static uint8_t gFileIndexBuf[CHUNKSIZE];
-static size_t gFileIndexBufPos = 0;
+typedef struct {
+    FILE *in, *out;
+    bool tar;
+    
+    lzma_options_lzma lzma_opts;
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    size_t block_in_size, block_out_size;
+    uint64_t encoder_mem;
+    uint64_t reserved_mem; // used outside the pipeline
+    bool sample; // store blocks that look incompressible, without encoding
+    bool runs; // build blocks of a single repeated byte, without encoding
+    bool choose_filters; // pick filters for each block by its contents
+    
+    // reader
+    off_t multi_header_start;
+    bool multi_header;
+    off_t total_read;
+    
+    // input file mapping, if it's a regular file
+    uint8_t *map_base, *map;
+    size_t map_len, map_size, map_pos;
+    input_mapping_t mapping;
+    
+    pipeline_item_t *read_item;
+    io_block_t *read_block;
+    size_t read_item_count;
+    uint64_t read_trace;
+    
+    // the end of a block cut early, to start the next one
+    uint8_t *carry;
+    size_t carry_size;
+    file_index_t *align_file;
+    
+    // the entry the last block ended in, and what filters its contents want
+    file_index_t *filter_file;
+    filter_choice_t filter_choice;
+    
+    file_index_t *files, *last_file;
+    
+    // appending: the old tar data left in the first block we replace
+    bool append;
+    uint8_t *prefix;
+    size_t prefix_size;
+    
+    // writer
+    dedup_t *dedup;
+    output_t *output;
+    lzma_index *index;
+    lzma_stream stream;
+    
+    uint8_t file_index_buf[CHUNKSIZE];
+    size_t file_index_buf_pos;
+    
+    // appending: the archive, where its new end goes, the new archive
+    // that replaces it, and the old archive's entries, which our input
+    // follows at file_base
+    FILE *archive;
+    off_t append_offset;
+    append_temp_t temp;
+    file_index_t *old_files;
+    uint64_t file_base;
+} write_state_t;
 
 
 #pragma mark FUNCTION DECLARATIONS
 
-static void read_thread();
+static write_state_t *write_new(FILE *in, FILE *out, bool tar,
+    uint32_t level);
+static void write_run(write_state_t *ws);
 
-static void encode_thread(size_t thnum);
+static void read_thread(pipeline_t *pl);
+static void read_libarchive(pipeline_t *pl);
+static void read_scan(pipeline_t *pl);
+static void read_scan_entry(void *ctx, off_t offset, const char *name);
+static void read_dispatch(pipeline_t *pl);
+static void read_prefix(pipeline_t *pl);
+static size_t read_align(write_state_t *ws);
+static size_t read_rsyncable(write_state_t *ws);
+static void input_map(write_state_t *ws);
+static void input_unmap(write_state_t *ws);
+static void input_sigbus_install(void);
+static void input_sigbus(int sig, siginfo_t *info, void *ctx);
+static void input_check(write_state_t *ws);
+static bool input_eof(write_state_t *ws);
+static void input_release(uint8_t *buf, size_t size);
+
+static void encode_thread(pipeline_t *pl, size_t thnum);
+static void encode_block(pipeline_t *pl, lzma_stream *stream,
+    io_block_t *ib, size_t seq);
+static void block_reused(io_block_t *ib, lzma_vli unpadded);
 static void encode_uncompressible(io_block_t *ib);
 static size_t size_uncompressible(size_t insize);
+static bool sample_incompressible(const uint8_t *buf, size_t size);
+static bool sample_flat(const uint8_t *buf, size_t size);
+static bool sample_unrepeated(const uint8_t *buf, size_t size);
+static void gear_table(uint64_t gear[256]);
+static bool encode_run(lzma_stream *stream, io_block_t *ib,
+    const lzma_options_lzma *lzma_opts);
+static uint8_t *encode_raw(lzma_stream *stream, const lzma_filter *filters,
+    const uint8_t *in, size_t size, uint8_t *out, size_t avail);
+static void encode_trailer(io_block_t *ib, uint8_t *output_start,
+    uint8_t *output, check_t *check);
 
-static void *block_create();
+static void *block_create(size_t node);
 static void block_free(void *data);
 
 typedef enum {
@@ -54,75 +225,164 @@ typedef enum {
 	BLOCK_OUT = 2,
 	BLOCK_ALL = BLOCK_IN | BLOCK_OUT,
 } block_parts;
-static void block_alloc(io_block_t *ib, block_parts parts);
+static void block_alloc(write_state_t *ws, io_block_t *ib, block_parts parts);
 static void block_dealloc(io_block_t *ib, block_parts parts);
 
-static void add_file(off_t offset, const char *name);
+static void add_file(write_state_t *ws, off_t offset, const char *name);
+
+static filter_choice_t filter_sniff(const uint8_t *buf, size_t size);
+static void filter_classify(write_state_t *ws, io_block_t *ib);
+static void filter_chain(write_state_t *ws, io_block_t *ib, filter_kind kind);
 
 static archive_read_callback tar_read;
 static archive_open_callback tar_ok;
 static archive_close_callback tar_ok;
 
-static void block_init(lzma_block *block, size_t insize);
-static void stream_edge(lzma_vli backward_size);
-static void write_block(pipeline_item_t *pi);
-static void encode_index(void);
+static void block_init(write_state_t *ws, lzma_block *block, size_t insize,
+    lzma_filter *filters);
+static void stream_edge(write_state_t *ws, lzma_vli backward_size);
+static void write_block(write_state_t *ws, pipeline_item_t *pi);
+static void write_dedup(write_state_t *ws, pipeline_item_t *pi);
+static void encode_index(write_state_t *ws);
+static uint64_t write_fit_memory(write_state_t *ws);
+static size_t write_block_mem(write_state_t *ws);
 
-static void write_file_index(void);
-static void write_file_index_bytes(size_t size, uint8_t *buf);
-static void write_file_index_buf(lzma_action action);
+static void write_file_index(write_state_t *ws);
+static void write_file_index_bytes(write_state_t *ws, size_t size,
+    uint8_t *buf);
+static void write_file_index_buf(write_state_t *ws, lzma_action action);
+
+typedef struct append_reader_t append_reader_t;
+static void append_open(write_state_t *ws);
+static void append_decode(append_reader_t *ar, lzma_vli offset);
+static uint64_t append_tar_end(append_reader_t *ar, uint64_t last,
+    uint64_t data_end);
+static void append_entry(void *ctx, off_t offset, const char *name);
+static void append_temp(write_state_t *ws, const char *path);
+static void append_temp_install(void);
+static void append_temp_cleanup(void);
+static void append_copy(int in, int out, off_t size);
+static void append_finish(write_state_t *ws);
+static void append_files(write_state_t *ws);
 
 
 #pragma mark FUNCTION DEFINITIONS
 
-void pixz_write(bool tar, uint32_t level) {
-    gTar = tar;
+static size_t write_block_mem(write_state_t *ws) {
+    return pool_capacity(ws->block_in_size)
+        + pool_capacity(ws->block_out_size);
+}
+
+// Set the block size, and return the memory each encoder needs. If even a
+// single thread wouldn't fit in the memory budget, use a smaller dictionary.
+static uint64_t write_fit_memory(write_state_t *ws) {
+    uint64_t budget = pipeline_memory_budget();
+    while (true) {
+        ws->block_in_size = ws->lzma_opts.dict_size * gBlockFraction;
+        if (ws->block_in_size <= 0)
+            die("Block size must be positive");
+        ws->block_out_size = lzma_block_buffer_bound(ws->block_in_size);
+        
+        uint64_t encoder_mem = lzma_raw_encoder_memusage(ws->filters);
+        if (encoder_mem == UINT64_MAX)
+            die("Error checking encoder memory");
+        uint64_t need = encoder_mem + PIPELINE_MIN_QSIZE(1)
+            * (uint64_t)write_block_mem(ws)
+            + OUTPUT_MAX * (uint64_t)pool_capacity(ws->block_out_size);
+        if (!budget || need <= budget
+                || ws->lzma_opts.dict_size / 2 < WRITE_MIN_DICT)
+            return encoder_mem;
+        
+        ws->lzma_opts.dict_size /= 2;
+        debug("memory budget %" PRIu64 " MiB: dictionary %" PRIu32 " KiB",
+            budget >> 20, ws->lzma_opts.dict_size >> 10);
+    }
+}
+
+static write_state_t *write_new(FILE *in, FILE *out, bool tar,
+        uint32_t level) {
+    write_state_t *ws = xmalloc(sizeof(write_state_t));
+    *ws = (write_state_t){ .in = in, .out = out, .tar = tar,
+        .stream = LZMA_STREAM_INIT };
     
     // xz options
-    lzma_options_lzma lzma_opts;
-    if (lzma_lzma_preset(&lzma_opts, level))
+    if (lzma_lzma_preset(&ws->lzma_opts, level))
         die("Error setting lzma options");
-    gFilters[0] = (lzma_filter){ .id = LZMA_FILTER_LZMA2,
-            .options = &lzma_opts };
-    gFilters[1] = (lzma_filter){ .id = LZMA_VLI_UNKNOWN, .options = NULL };
+    ws->filters[0] = (lzma_filter){ .id = LZMA_FILTER_LZMA2,
+            .options = &ws->lzma_opts };
+    ws->filters[1] = (lzma_filter){ .id = LZMA_VLI_UNKNOWN, .options = NULL };
     
-    gBlockInSize = lzma_opts.dict_size * gBlockFraction;
-    if (gBlockInSize <= 0)
-        die("Block size must be positive");
-    gBlockOutSize = lzma_block_buffer_bound(gBlockInSize);
+    ws->encoder_mem = write_fit_memory(ws);
+    ws->sample = !(gDisable & DISABLE_SAMPLE);
+    ws->runs = !(gDisable & DISABLE_RUNS);
+    ws->choose_filters = !(gDisable & DISABLE_FILTERS);
+    input_map(ws);
+    // Blocks being written no longer belong to a pipeline item
+    ws->reserved_mem = OUTPUT_MAX
+        * (uint64_t)pool_capacity(ws->block_out_size);
+    if (gDedupSize) {
+        ws->dedup = dedup_new(gDedupSize);
+        ws->reserved_mem += gDedupSize;
+    }
+    if (!(ws->index = lzma_index_init(NULL)))
+        die("Error creating index");
+    return ws;
+}
+
+void pixz_write(FILE *in, FILE *out, bool tar, uint32_t level) {
+    write_state_t *ws = write_new(in, out, tar, level);
     
-    pipeline_create(block_create, block_free, read_thread, encode_thread);
+    // pre-block setup: header
+    ws->output = output_open(ws->out);
+    stream_edge(ws, LZMA_VLI_UNKNOWN);
+    write_run(ws);
+}
+
+// Compress the input, and finish the stream
+static void write_run(write_state_t *ws) {
+    pipeline_t *pl = pipeline_create(block_create, block_free, read_thread,
+        encode_thread, ws, write_block_mem(ws),
+        ws->encoder_mem, ws->reserved_mem);
     debug("writer: start");
     
-    // pre-block setup: header, index
-    if (!(gIndex = lzma_index_init(NULL)))
-        die("Error creating index");
-    stream_edge(LZMA_VLI_UNKNOWN);
-    
     // write blocks
     while (true) {
-        pipeline_item_t *pi = pipeline_merged();
+        pipeline_item_t *pi = pipeline_merged(pl);
+        input_check(ws);
         if (!pi)
             break;
         
         debug("writer: received %zu", pi->seq);
-        write_block(pi);
-        queue_push(gPipelineStartQ, PIPELINE_ITEM, pi);
+        io_block_t *ib = (io_block_t*)(pi->data);
+        if (ib->dedup)
+            write_dedup(ws, pi);
+        pipeline_account(pl, PIPELINE_STAGE_MERGE, ib->outsize, ib->outsize);
+        write_block(ws, pi);
+        pipeline_recycle(pl, pi);
     }
     
     // file index
-    if (gTar)
-        write_file_index();
-    free_file_index();
+    if (ws->old_files)
+        append_files(ws);
+    if (ws->tar)
+        write_file_index(ws);
+    free_file_index(ws->files);
     
     // post-block cleanup: index, footer
-    encode_index();
-    stream_edge(lzma_index_size(gIndex));
-    lzma_index_end(gIndex, NULL);
-    fclose(gOutFile);
+    encode_index(ws);
+    stream_edge(ws, lzma_index_size(ws->index));
+    lzma_index_end(ws->index, NULL);
+    output_close(ws->output);
+    if (ws->archive)
+        append_finish(ws);
     
     debug("writer: cleaning up reader");
-    pipeline_destroy();
+    pipeline_destroy(pl);
+    input_unmap(ws);
+    if (ws->dedup)
+        dedup_free(ws->dedup);
+    free(ws->carry);
+    free(ws);
     
     debug("exit");
 }
@@ -130,154 +390,585 @@ void pixz_write(bool tar, uint32_t level) {
 
 #pragma mark READING
 
-static void read_thread() {
+static void read_thread(pipeline_t *pl) {
+    write_state_t *ws = (write_state_t*)pl->ctx;
     debug("reader: start");
     
-    if (gTar) {
-		struct archive *ar = archive_read_new();
-	    prevent_compression(ar);
-	    archive_read_support_format_tar(ar);
-	    archive_read_support_format_raw(ar);
-	    archive_read_open(ar, NULL, tar_ok, tar_read, tar_ok);
-	    struct archive_entry *entry;
-	    while (true) {
-	        int aerr = archive_read_next_header(ar, &entry);
-	        if (aerr == ARCHIVE_EOF) {
-	            break;
-	        } else if (aerr != ARCHIVE_OK && aerr != ARCHIVE_WARN) {
-	            // Some charset translations warn spuriously
-	            fprintf(stderr, "%s\n", archive_error_string(ar));
-	            die("Error reading archive entry");
-	        }
-        
-	        if (archive_format(ar) == ARCHIVE_FORMAT_RAW) {
-	            gTar = false;
-				break;
-			}
-            add_file(archive_read_header_position(ar),
-                archive_entry_pathname(entry));
-	    }
-		if (archive_read_header_position(ar) == 0)
-			gTar = false; // probably spuriously identified as tar
-    	finish_reading(ar);
-	}
-	if (!feof(gInFile)) {
+    if (ws->tar) {
+        if (gDisable & DISABLE_TAR_SCAN)
+            read_libarchive(pl);
+        else
+            read_scan(pl);
+        if (ws->append && !ws->tar)
+            die("Can only append a tarball");
+    }
+	if (!input_eof(ws)) {
 		const void *dummy;
-		while (tar_read(NULL, NULL, &dummy) != 0)
+		while (tar_read(NULL, pl, &dummy) != 0)
 			; // just keep pumping
 	}
-    fclose(gInFile);
+    if (ws->map) // leave the file position where reading would have
+        fseeko(ws->in, ws->total_read, SEEK_CUR);
+    fclose(ws->in);
     
-	if (gTar)
-        add_file(gTotalRead, NULL);
+	if (ws->tar)
+        add_file(ws, ws->total_read, NULL);
     
     // write last block, if necessary
-    if (gReadItem) {
+    if (ws->read_item) {
         // if this block had only one read, and it was EOF, it's waste
-        debug("reader: handling last block %zu", gReadItemCount);
-        if (gReadBlock->insize)
-            pipeline_split(gReadItem);
-        else
-            queue_push(gPipelineStartQ, PIPELINE_ITEM, gReadItem);
-        gReadItem = NULL;
+        debug("reader: handling last block %zu", ws->read_item_count);
+        if (ws->read_block->insize) {
+            read_dispatch(pl);
+        } else {
+            queue_push(pl->start_q, PIPELINE_ITEM, ws->read_item);
+            ws->read_item = NULL;
+        }
     }
     
     // stop the other threads
     debug("reader: cleaning up encoders");
-    pipeline_stop();
+    pipeline_stop(pl);
     debug("reader: end");
 }
 
+static void read_libarchive(pipeline_t *pl) {
+    write_state_t *ws = (write_state_t*)pl->ctx;
+    struct archive *ar = archive_read_new();
+    prevent_compression(ar);
+    archive_read_support_format_tar(ar);
+    archive_read_support_format_raw(ar);
+    archive_read_open(ar, pl, tar_ok, tar_read, tar_ok);
+    struct archive_entry *entry;
+    while (true) {
+        int aerr = archive_read_next_header(ar, &entry);
+        if (aerr == ARCHIVE_EOF) {
+            break;
+        } else if (aerr != ARCHIVE_OK && aerr != ARCHIVE_WARN) {
+            // Some charset translations warn spuriously
+            fprintf(stderr, "%s\n", archive_error_string(ar));
+            die("Error reading archive entry");
+        }
+        
+        if (archive_format(ar) == ARCHIVE_FORMAT_RAW) {
+            ws->tar = false;
+            break;
+        }
+        add_file(ws, archive_read_header_position(ar),
+            archive_entry_pathname(entry));
+    }
+    if (archive_read_header_position(ar) == 0)
+        ws->tar = false; // probably spuriously identified as tar
+    finish_reading(ar);
+}
+
+static void read_scan(pipeline_t *pl) {
+    write_state_t *ws = (write_state_t*)pl->ctx;
+    tar_scan_t *ts = tar_scan_new(read_scan_entry, ws);
+    tar_status_t st = TAR_MORE;
+    const void *buf;
+    ssize_t rd;
+    while (st == TAR_MORE && (rd = tar_read(NULL, pl, &buf)) > 0)
+        st = tar_scan(ts, buf, rd);
+    if (st == TAR_MORE)
+        st = tar_scan_finish(ts);
+    if (st == TAR_NOT_TAR)
+        ws->tar = false;
+    tar_scan_free(ts);
+}
+
+static void read_scan_entry(void *ctx, off_t offset, const char *name) {
+    add_file((write_state_t*)ctx, offset, name);
+}
+
 static ssize_t tar_read(struct archive *ar, void *ref, const void **bufp) {
-    if (!gReadItem) {
-        queue_pop(gPipelineStartQ, (void**)&gReadItem);
-        gReadBlock = (io_block_t*)(gReadItem->data);
-        block_alloc(gReadBlock, BLOCK_IN);
-        gReadBlock->insize = 0;
-        debug("reader: reading %zu", gReadItemCount);
-    }
-    
-    size_t space = gBlockInSize - gReadBlock->insize;
-    if (space > CHUNKSIZE)
-        space = CHUNKSIZE;    
-    uint8_t *buf = gReadBlock->input + gReadBlock->insize;
-    size_t rd = fread(buf, 1, space, gInFile);
-    if (ferror(gInFile))
-        die("Error reading input file");
-    gReadBlock->insize += rd;
-    gTotalRead += rd;
-    *bufp = buf;
-    
-    if (gReadBlock->insize == gBlockInSize) {
-        debug("reader: sending %zu", gReadItemCount);
-        pipeline_split(gReadItem);
-        ++gReadItemCount;
-        gReadItem = NULL;
+    pipeline_t *pl = (pipeline_t*)ref;
+    write_state_t *ws = (write_state_t*)pl->ctx;
+    // Send a full block only now, so its entries have all been found
+    if (ws->read_item && ws->read_block->insize == ws->block_in_size) {
+        io_block_t *ib = ws->read_block;
+        size_t cut = ib->insize;
+        if (gBlockRsyncable)
+            cut = read_rsyncable(ws);
+        else if (ws->tar && gBlockAlign)
+            cut = read_align(ws);
+        ws->carry_size = ib->insize - cut;
+        if (ws->carry_size && !ws->map) {
+            // The encoder may free this block before the next one is ready
+            if (!ws->carry)
+                ws->carry = xmalloc(ws->block_in_size);
+            memcpy(ws->carry, ib->input + cut, ws->carry_size);
+        }
+        ib->insize = cut;
+        read_dispatch(pl);
+    }
+    if (!ws->read_item) {
+        ws->read_item = pipeline_fetch(pl);
+        ws->read_trace = trace_begin();
+        ws->read_block = (io_block_t*)(ws->read_item->data);
+        ws->read_block->insize = ws->carry_size;
+        if (ws->map) {
+            // The block is just a window onto the mapping
+            io_block_t *ib = ws->read_block;
+            ib->input = ws->map + ws->map_pos - ws->carry_size;
+            ib->mapped = true;
+#ifdef MADV_WILLNEED
+            size_t want = ws->map_size - ws->map_pos;
+            if (want > ws->block_in_size)
+                want = ws->block_in_size;
+            uintptr_t page = sysconf(_SC_PAGESIZE);
+            uintptr_t start = (uintptr_t)ib->input & ~(page - 1);
+            madvise((void*)start, (uintptr_t)ib->input + want - start,
+                MADV_WILLNEED);
+#endif
+        } else {
+            block_alloc(ws, ws->read_block, BLOCK_IN);
+            if (ws->carry_size)
+                memcpy(ws->read_block->input, ws->carry, ws->carry_size);
+        }
+        ws->carry_size = 0;
+        debug("reader: reading %zu", ws->read_item_count);
     }
     
+    io_block_t *ib = ws->read_block;
+    size_t space = ws->block_in_size - ib->insize;
+    uint8_t *buf = ib->input + ib->insize;
+    size_t rd;
+    if (ws->map) {
+        // Hand libarchive the rest of the block in one go, it's free
+        rd = ws->map_size - ws->map_pos;
+        if (rd > space)
+            rd = space;
+        ws->map_pos += rd;
+    } else {
+        if (space > READ_CHUNK)
+            space = READ_CHUNK;
+        rd = fread(buf, 1, space, ws->in);
+        if (ferror(ws->in))
+            die("Error reading input file");
+    }
+    ib->insize += rd;
+    ws->total_read += rd;
+    *bufp = buf;
     return rd;
 }
 
+static void read_dispatch(pipeline_t *pl) {
+    write_state_t *ws = (write_state_t*)pl->ctx;
+    if (ws->prefix)
+        read_prefix(pl);
+    io_block_t *ib = ws->read_block;
+    filter_classify(ws, ib);
+    debug("reader: sending %zu", ws->read_item_count);
+    trace_end("read", ws->read_trace, pl->split_seq, ib->insize, ib->insize);
+    pipeline_account(pl, PIPELINE_STAGE_SPLIT, ib->insize, ib->insize);
+    pipeline_split(pl, ws->read_item);
+    ++ws->read_item_count;
+    ws->read_item = NULL;
+}
+
+// Appending: the input is known to be a tarball by the time its first block
+// is sent, so send the old data it follows first
+static void read_prefix(pipeline_t *pl) {
+    write_state_t *ws = (write_state_t*)pl->ctx;
+    for (size_t pos = 0; pos < ws->prefix_size; ) {
+        pipeline_item_t *pi = pipeline_fetch(pl);
+        io_block_t *ib = (io_block_t*)(pi->data);
+        block_alloc(ws, ib, BLOCK_IN);
+        ib->insize = ws->prefix_size - pos;
+        if (ib->insize > ws->block_in_size)
+            ib->insize = ws->block_in_size;
+        memcpy(ib->input, ws->prefix + pos, ib->insize);
+        pos += ib->insize;
+        ib->filter = (filter_choice_t){ .kind = FILTER_LZMA };
+        debug("reader: sending %zu bytes of old data", ib->insize);
+        pipeline_account(pl, PIPELINE_STAGE_SPLIT, ib->insize, ib->insize);
+        pipeline_split(pl, pi);
+    }
+    free(ws->prefix);
+    ws->prefix = NULL;
+}
+
+// Where to end a full block, so small entries aren't split between blocks.
+// Cut at the last entry boundary near the end, or before an entry too big
+// to fit in one block anyway, so it starts a fresh block.
+static size_t read_align(write_state_t *ws) {
+    io_block_t *ib = ws->read_block;
+    off_t end = ws->total_read, start = end - ib->insize;
+    file_index_t *f = ws->align_file ? ws->align_file : ws->files, *last = NULL;
+    for (; f && f->offset <= end; f = f->next) {
+        if (f->offset > start)
+            last = f;
+        ws->align_file = f;
+    }
+    if (!last || last->offset == end)
+        return ib->insize;
+    
+    size_t cut = last->offset - start;
+    if (cut >= ib->insize - ALIGN_SLACK(ws->block_in_size))
+        return cut;
+    uint64_t datasize = 0;
+    if (cut >= ALIGN_MIN(ws->block_in_size)
+            && tar_data_offset(ib->input + cut, ib->insize - cut, &datasize)
+            && datasize >= ws->block_in_size)
+        return cut;
+    return ib->insize;
+}
+
+// Where to end a full block, chosen by its contents with a rolling hash, so
+// the same data gets the same block boundaries even after an insertion or
+// deletion earlier on. Otherwise each later block would change.
+static size_t read_rsyncable(write_state_t *ws) {
+    io_block_t *ib = ws->read_block;
+    uint64_t gear[256], h = 0;
+    gear_table(gear);
+    // The top bits of the hash depend on the last 64 bytes
+    int bits = 0;
+    while (((size_t)2 << bits) <= RSYNC_SPACING(ws->block_in_size))
+        ++bits;
+    uint64_t mask = bits ? ~0ull << (64 - bits) : 0;
+    
+    size_t min = RSYNC_MIN(ws->block_in_size);
+    for (size_t i = min > 64 ? min - 64 : 0; i < ib->insize; ++i) {
+        h = (h << 1) + gear[ib->input[i]];
+        if (i >= min && !(h & mask))
+            return i + 1;
+    }
+    return ib->insize;
+}
+
 static int tar_ok(struct archive *ar, void *ref) {
     return ARCHIVE_OK;
 }
 
-static void add_file(off_t offset, const char *name) {
+// Map a regular file, so blocks can be compressed straight from the page
+// cache without copying.
+static void input_map(write_state_t *ws) {
+    int fd = fileno(ws->in);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return;
+    
+    off_t pos = ftello(ws->in);
+    if (pos < 0 || st.st_size <= pos || (gDisable & DISABLE_MMAP)
+            || (uint64_t)(st.st_size - pos) > SIZE_MAX / 2) {
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        return;
+    }
+    
+    // Mappings must start on a page boundary
+    off_t base = pos - pos % sysconf(_SC_PAGESIZE);
+    size_t len = st.st_size - base;
+    void *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, base);
+    if (p == MAP_FAILED) {
+        debug("reader: can't map input, reading it instead");
+        return;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(p, len, MADV_SEQUENTIAL);
+#endif
+    ws->map_base = p;
+    ws->map_len = len;
+    ws->map = ws->map_base + (pos - base);
+    ws->map_size = st.st_size - pos;
+    debug("reader: mapped %zu bytes of input", ws->map_size);
+    
+    pthread_once(&gInputSigbusOnce, input_sigbus_install);
+    ws->mapping.start = (uintptr_t)p;
+    ws->mapping.end = ws->mapping.start + len;
+    pthread_mutex_lock(&gInputMappingsMutex);
+    ws->mapping.next = gInputMappings;
+    gInputMappings = &ws->mapping;
+    pthread_mutex_unlock(&gInputMappingsMutex);
+}
+
+static void input_unmap(write_state_t *ws) {
+    if (!ws->map_base)
+        return;
+    pthread_mutex_lock(&gInputMappingsMutex);
+    input_mapping_t **m = &gInputMappings;
+    while (*m != &ws->mapping)
+        m = &(*m)->next;
+    *m = ws->mapping.next;
+    pthread_mutex_unlock(&gInputMappingsMutex);
+    munmap(ws->map_base, ws->map_len);
+}
+
+static void input_sigbus_install(void) {
+    struct sigaction sa = { .sa_sigaction = input_sigbus,
+        .sa_flags = SA_SIGINFO };
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, &gInputSigbusOld) != 0)
+        die("Error handling SIGBUS");
+}
+
+// The input file was truncated under us, if a fault is in a mapping. The
+// fault is never in code holding the lock, which doesn't touch the mappings.
+static void input_sigbus(int sig, siginfo_t *info, void *ctx) {
+    uintptr_t addr = (uintptr_t)info->si_addr;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    bool ours = false;
+    pthread_mutex_lock(&gInputMappingsMutex);
+    for (input_mapping_t *m = gInputMappings; m && !ours; m = m->next) {
+        if (addr >= m->start && addr < m->end
+                && mmap((void*)(addr & ~(page - 1)), page, PROT_READ,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+                    != MAP_FAILED) {
+            m->truncated = 1;
+            ours = true;
+        }
+    }
+    pthread_mutex_unlock(&gInputMappingsMutex);
+    
+    // Not ours: fault again with the old handler
+    if (!ours)
+        sigaction(SIGBUS, &gInputSigbusOld, NULL);
+}
+
+// Don't finish a stream with zeros where input went missing
+static void input_check(write_state_t *ws) {
+    if (ws->mapping.truncated)
+        die("Truncated input file");
+}
+
+static bool input_eof(write_state_t *ws) {
+    if (ws->map)
+        return ws->map_pos == ws->map_size;
+    return feof(ws->in);
+}
+
+// Once a mapped block is encoded, drop its pages from our address space.
+// They stay in the page cache, but no longer count towards our RSS. Pages
+// shared with neighbouring blocks are left alone.
+static void input_release(uint8_t *buf, size_t size) {
+#ifdef MADV_DONTNEED
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)buf + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)buf + size) & ~(page - 1);
+    if (start < end)
+        madvise((void*)start, end - start, MADV_DONTNEED);
+#endif
+}
+
+static void add_file(write_state_t *ws, off_t offset, const char *name) {
     if (name && is_multi_header(name)) {
-        if (!gMultiHeader)
-            gMultiHeaderStart = offset;
-        gMultiHeader = true;
+        if (!ws->multi_header)
+            ws->multi_header_start = offset;
+        ws->multi_header = true;
         return;
     }
     
     file_index_t *f = xmalloc(sizeof(file_index_t));
-    f->offset = gMultiHeader ? gMultiHeaderStart : offset;
-    gMultiHeader = false;
+    f->offset = ws->multi_header ? ws->multi_header_start : offset;
+    ws->multi_header = false;
     f->name = name ? xstrdup(name) : NULL;
     f->next = NULL;
     
-    if (gLastFile) {
-        gLastFile->next = f;
+    if (ws->last_file) {
+        ws->last_file->next = f;
     } else { // new index
-        gFileIndex = f;
+        ws->files = f;
     }
-    gLastFile = f;
+    ws->last_file = f;
 }
 
 static void block_free(void *data) {
     io_block_t *ib = (io_block_t*)data;
-    free(ib->input);
-    free(ib->output);
+    if (!ib->mapped)
+        pool_free(ib->input);
+    pool_free(ib->output);
     free(ib);
 }
 
-static void *block_create() {
+static void *block_create(size_t node) {
     io_block_t *ib = xmalloc(sizeof(io_block_t));
     ib->input = ib->output = NULL;
+    ib->node = node;
+    ib->mapped = false;
     return ib;
 }
 
-static void block_alloc(io_block_t *ib, block_parts parts) {
+static void block_alloc(write_state_t *ws, io_block_t *ib,
+        block_parts parts) {
     if ((parts & BLOCK_IN) && !ib->input)
-        ib->input = xmalloc(gBlockInSize);
-    if ((parts & BLOCK_IN) && !ib->output)
-        ib->output = xmalloc(gBlockOutSize);
-    if (!ib->input || !ib->output)
-        die("Can't allocate blocks");
+        ib->input = pool_alloc(ws->block_in_size, ib->node, NULL);
+    if ((parts & BLOCK_OUT) && !ib->output)
+        ib->output = pool_alloc(ws->block_out_size, ib->node, NULL);
 }
 
 static void block_dealloc(io_block_t *ib, block_parts parts) {
     if (parts & BLOCK_IN) {
-		free(ib->input);
+		if (ib->mapped)
+			input_release(ib->input, ib->insize);
+		else
+			pool_free(ib->input);
 		ib->input = NULL;
+		ib->mapped = false;
 	}
     if (parts & BLOCK_OUT) {
-		free(ib->output);
+		pool_free(ib->output);
 		ib->output = NULL;
 	}
 }
 
 
+#pragma mark FILTERS
+
+// Formats that are already compressed
+static const struct {
+    size_t offset, size;
+    const char *magic;
+} gStoredMagic[] = {
+    { 0, 2, "\x1f\x8b" },                 // gzip
+    { 0, 6, "\xfd" "7zXZ\0" },            // xz
+    { 0, 4, "\x28\xb5\x2f\xfd" },         // zstd
+    { 0, 4, "\x04\x22\x4d\x18" },         // lz4
+    { 0, 6, "7z\xbc\xaf\x27\x1c" },       // 7-zip
+    { 0, 4, "PK\x03\x04" },               // zip
+    { 0, 8, "\x89PNG\r\n\x1a\n" },        // png
+    { 0, 3, "\xff\xd8\xff" },             // jpeg
+    { 4, 4, "ftyp" },                      // mp4, mov, heic
+    { 0, 4, "\x1a\x45\xdf\xa3" },         // matroska, webm
+    { 0, 4, "OggS" },
+    { 0, 4, "fLaC" },
+};
+
+static uint16_t le16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+// Guess what filters suit a file, from its first bytes
+static filter_choice_t filter_sniff(const uint8_t *buf, size_t size) {
+    filter_choice_t c = { .kind = FILTER_LZMA };
+    if (size >= 20 && memcmp(buf, "\x7f" "ELF", 4) == 0) {
+        uint16_t machine = buf[5] == 2 ? (buf[18] << 8) | buf[19]
+            : le16(buf + 18);
+        if (machine == 3 || machine == 62) // i386, x86-64
+            c.kind = FILTER_X86;
+#ifdef LZMA_FILTER_ARM64
+        else if (machine == 183) // aarch64
+            c.kind = FILTER_ARM64;
+#endif
+    } else if (size >= 64 && memcmp(buf, "MZ", 2) == 0) {
+        uint32_t pe = le16(buf + 60) | ((uint32_t)le16(buf + 62) << 16);
+        if (pe <= size - 6 && memcmp(buf + pe, "PE\0\0", 4) == 0) {
+            uint16_t machine = le16(buf + pe + 4);
+            if (machine == 0x14c || machine == 0x8664)
+                c.kind = FILTER_X86;
+#ifdef LZMA_FILTER_ARM64
+            else if (machine == 0xaa64)
+                c.kind = FILTER_ARM64;
+#endif
+        }
+    } else if (size >= 36 && memcmp(buf, "RIFF", 4) == 0
+            && memcmp(buf + 8, "WAVEfmt ", 8) == 0) {
+        // Integer PCM: delta between samples of the same channel
+        uint16_t format = le16(buf + 20), align = le16(buf + 32);
+        if ((format == 1 || format == 0xfffe) && align >= 1
+                && align <= LZMA_DELTA_DIST_MAX) {
+            c.kind = FILTER_DELTA;
+            c.dist = align;
+        }
+    } else {
+        for (size_t i = 0; i < sizeof(gStoredMagic) / sizeof(gStoredMagic[0]);
+                ++i) {
+            if (size >= gStoredMagic[i].offset + gStoredMagic[i].size
+                    && memcmp(buf + gStoredMagic[i].offset,
+                        gStoredMagic[i].magic, gStoredMagic[i].size) == 0) {
+                c.kind = FILTER_STORE;
+                break;
+            }
+        }
+    }
+    return c;
+}
+
+// Choose filters for a block that's about to be sent, from the kinds of
+// entries that fill it. A kind must cover most of the block to be used,
+// and nearly all of it to store the block uncompressed.
+static void filter_classify(write_state_t *ws, io_block_t *ib) {
+    ib->filter = (filter_choice_t){ .kind = FILTER_LZMA };
+    if (!ws->choose_filters)
+        return;
+    off_t end = ws->total_read - ws->carry_size, start = end - ib->insize;
+    if (!ws->tar) {
+        // One file, sniff its start
+        if (start == 0)
+            ws->filter_choice = filter_sniff(ib->input, ib->insize);
+        ib->filter = ws->filter_choice;
+        return;
+    }
+    
+    uint64_t bytes[FILTER_KINDS] = { 0 }, delta_bytes = 0;
+    uint32_t dist = 0;
+    file_index_t *f = ws->filter_file ? ws->filter_file : ws->files;
+    for (; f && f->offset < end; f = f->next) {
+        if (f != ws->filter_file) {
+            // A new entry, sniff its contents
+            ws->filter_file = f;
+            ws->filter_choice = (filter_choice_t){ .kind = FILTER_LZMA };
+            if (f->offset >= start) {
+                size_t off = f->offset - start;
+                size_t data = tar_data_offset(ib->input + off,
+                    ib->insize - off, NULL);
+                if (data)
+                    ws->filter_choice = filter_sniff(ib->input + off + data,
+                        ib->insize - off - data);
+            }
+        }
+        off_t from = f->offset > start ? f->offset : start;
+        off_t to = f->next && f->next->offset < end ? f->next->offset : end;
+        if (to <= from)
+            continue;
+        bytes[ws->filter_choice.kind] += to - from;
+        if (ws->filter_choice.kind == FILTER_DELTA
+                && (uint64_t)(to - from) > delta_bytes) {
+            delta_bytes = to - from;
+            dist = ws->filter_choice.dist;
+        }
+    }
+    
+    filter_kind best = FILTER_LZMA;
+    for (size_t k = 0; k < FILTER_KINDS; ++k)
+        if (bytes[k] > bytes[best])
+            best = k;
+    bool enough = best == FILTER_STORE ? bytes[best] * 20 >= ib->insize * 19
+        : bytes[best] * 2 > ib->insize;
+    if (enough)
+        ib->filter = (filter_choice_t){ .kind = best, .dist = dist };
+    debug("reader: block %zu filters %d", ws->read_item_count,
+        ib->filter.kind);
+}
+
+// Set up a block with the filter chain for kind
+static void filter_chain(write_state_t *ws, io_block_t *ib, filter_kind kind) {
+    lzma_filter *f = ib->filters;
+    switch (kind) {
+        case FILTER_X86:
+            *f++ = (lzma_filter){ .id = LZMA_FILTER_X86 };
+            break;
+#ifdef LZMA_FILTER_ARM64
+        case FILTER_ARM64:
+            *f++ = (lzma_filter){ .id = LZMA_FILTER_ARM64 };
+            break;
+#endif
+        case FILTER_DELTA:
+            ib->delta = (lzma_options_delta){ .type = LZMA_DELTA_TYPE_BYTE,
+                .dist = ib->filter.dist };
+            *f++ = (lzma_filter){ .id = LZMA_FILTER_DELTA,
+                .options = &ib->delta };
+            break;
+        default:
+            break;
+    }
+    *f++ = ws->filters[0]; // LZMA2
+    *f = ws->filters[1];
+    block_init(ws, &ib->block, ib->insize, ib->filters);
+}
+
+
 #pragma mark ENCODING
 
 static size_t size_uncompressible(size_t insize) {
@@ -291,6 +982,87 @@ static size_t size_uncompressible(size_t insize) {
     return data_size;
 }
 
+// Guess whether LZMA would fail to shrink a block. Otherwise the encoder
+// gets to decide.
+static bool sample_incompressible(const uint8_t *buf, size_t size) {
+    return size >= SAMPLE_SIZE && sample_flat(buf, size)
+        && sample_unrepeated(buf, size);
+}
+
+// Evenly spaced samples must have a nearly flat byte histogram, and almost
+// no short repeats
+static bool sample_flat(const uint8_t *buf, size_t size) {
+
+    // Several histograms, so consecutive bytes don't wait on each other
+    uint32_t hist[4][256] = { { 0 } };
+    uint32_t seen[4096] = { 0 };
+    size_t piece = SAMPLE_SIZE / SAMPLE_PIECES, repeats = 0;
+    size_t stride = (size - piece) / (SAMPLE_PIECES - 1);
+    for (size_t p = 0; p < SAMPLE_PIECES; ++p) {
+        const uint8_t *s = buf + p * stride;
+        for (size_t i = 0; i < piece; i += 4) {
+            ++hist[0][s[i]];
+            ++hist[1][s[i + 1]];
+            ++hist[2][s[i + 2]];
+            ++hist[3][s[i + 3]];
+        }
+        // Count 4-byte strings seen before, like a tiny match finder
+        for (size_t i = 0; i + 4 <= piece; ++i) {
+            uint32_t v;
+            memcpy(&v, s + i, sizeof(v));
+            uint32_t *slot = &seen[(v * 2654435761u) >> 20];
+            repeats += (*slot == v);
+            *slot = v;
+        }
+    }
+    if (repeats * 64 > SAMPLE_SIZE)
+        return false;
+    
+    // Collision entropy: for uniform bytes, sum(c^2) is about n^2/256 + n.
+    // Allow 1% more, roughly 7.99 bits per byte.
+    uint64_t sumsq = 0;
+    for (size_t b = 0; b < 256; ++b) {
+        uint64_t c = hist[0][b] + hist[1][b] + hist[2][b] + hist[3][b];
+        sumsq += c * c;
+    }
+    uint64_t n = SAMPLE_SIZE;
+    return sumsq * 256 * 100 <= n * n * 101 + n * 256 * 100;
+}
+
+// Samples can't see a file repeated far away, like a duplicate image.
+// Anchor where a gear hash of the last 64 bytes has its low bits clear,
+// about SAMPLE_ANCHORS times per block, and look for recurring hashes.
+static bool sample_unrepeated(const uint8_t *buf, size_t size) {
+    uint64_t gear[256];
+    gear_table(gear);
+    uint64_t mask = 255;
+    while (mask < size / SAMPLE_ANCHORS)
+        mask = mask * 2 + 1;
+    uint64_t anchors[SAMPLE_ANCHORS * 2] = { 0 }, h = 0;
+    size_t found = 0, repeats = 0;
+    for (size_t i = 0; i < size; ++i) {
+        h = (h << 1) + gear[buf[i]];
+        if (!(h & mask) && i >= 64) {
+            uint64_t *slot = &anchors[(h >> 32) % (SAMPLE_ANCHORS * 2)];
+            repeats += (*slot == h);
+            *slot = h;
+            ++found;
+        }
+    }
+    return repeats * 64 <= found;
+}
+
+// Random values for a gear hash, the same every run
+static void gear_table(uint64_t gear[256]) {
+    uint64_t x = 0;
+    for (size_t i = 0; i < 256; ++i) { // splitmix64
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
 static void encode_uncompressible(io_block_t *ib) {
     // See http://en.wikipedia.org/wiki/Lzma#LZMA2_format
     const uint8_t control_uncomp = 1;
@@ -300,6 +1072,8 @@ static void encode_uncompressible(io_block_t *ib) {
     uint8_t *output = output_start;
     uint8_t *input = ib->input;
     size_t remain = ib->insize;
+    check_t check;
+    check_init(&check, ib->block.check);
 
     while (remain) {
         size_t size = remain;
@@ -314,8 +1088,9 @@ static void encode_uncompressible(io_block_t *ib) {
         *output++ = (size_write >> 8);
         *output++ = (size_write & 0xFF);
 
-        // actual chunk data
+        // actual chunk data, checked while it's still in cache
         memcpy(output, input, size);
+        check_update(&check, output, size);
 
         remain -= size;
         output += size;
@@ -323,7 +1098,13 @@ static void encode_uncompressible(io_block_t *ib) {
     }
     // control byte for end of block
     *output++ = control_end;
+    encode_trailer(ib, output_start, output, &check);
+}
 
+// Finish a block whose LZMA2 data ends at output: padding, and the check of
+// its input
+static void encode_trailer(io_block_t *ib, uint8_t *output_start,
+        uint8_t *output, check_t *check) {
     ib->block.compressed_size = output - output_start;
     ib->block.uncompressed_size = ib->insize;
 
@@ -331,61 +1112,176 @@ static void encode_uncompressible(io_block_t *ib) {
     while ((output - output_start) % 4)
         *output++ = 0;
 
-    // checksum (little endian)
-    if (ib->block.check != LZMA_CHECK_CRC32)
-        die("pixz only supports CRC-32 checksums");
-    uint32_t check = lzma_crc32(ib->input, ib->insize, 0);
-    *output++ = check & 0xFF;
-    *output++ = (check >> 8) & 0xFF;
-    *output++ = (check >> 16) & 0xFF;
-    *output++ = (check >> 24);
+    output += check_finish(check, output);
+    ib->outsize = output - ib->output;
 }
 
-static void encode_thread(size_t thnum) {
-    lzma_stream stream = LZMA_STREAM_INIT;    
-    while (true) {
-        pipeline_item_t *pi;
-        int msg = queue_pop(gPipelineSplitQ, (void**)&pi);
-        if (msg == PIPELINE_STOP)
-            break;
+// A block of one repeated byte compresses to nearly nothing, but LZMA still
+// takes seconds over a large one. Encode a single chunk of the run and
+// repeat it; each copy resets the dictionary, so copies are independent.
+static bool encode_run(lzma_stream *stream, io_block_t *ib,
+        const lzma_options_lzma *lzma_opts) {
+    if (!ib->insize || memcmp(ib->input, ib->input + 1, ib->insize - 1))
+        return false;
+    
+    lzma_options_lzma opts = *lzma_opts;
+    opts.dict_size = RUN_DICT;
+    lzma_filter filters[] = {
+        { .id = LZMA_FILTER_LZMA2, .options = &opts },
+        { .id = LZMA_VLI_UNKNOWN, .options = NULL },
+    };
+    uint8_t *start = ib->output + ib->block.header_size, *out = start,
+        *end = start + size_uncompressible(ib->insize);
+    size_t remain = ib->insize;
+    if (remain > RUN_UNIT) {
+        uint8_t *unit_end = encode_raw(stream, filters, ib->input, RUN_UNIT,
+            out, end - out);
+        if (!unit_end || unit_end - out < 6 || out[0] < 0xE0)
+            return false;
+        size_t usize = (((out[0] & 0x1F) << 16) | (out[1] << 8) | out[2]) + 1;
+        size_t chunk = ((out[3] << 8) | out[4]) + 1 + 6;
+        if (chunk > (size_t)(unit_end - out) || chunk > usize)
+            return false;
+        for (out += chunk, remain -= usize; remain > usize;
+                out += chunk, remain -= usize)
+            memcpy(out, start, chunk);
+    }
+    out = encode_raw(stream, filters, ib->input, remain, out, end - out);
+    if (!out)
+        return false;
+    check_t check;
+    check_init(&check, ib->block.check);
+    check_update(&check, ib->input, ib->insize);
+    encode_trailer(ib, start, out, &check);
+    return true;
+}
+
+// Encode raw LZMA2, returning the end of the output or NULL if it didn't fit
+static uint8_t *encode_raw(lzma_stream *stream, const lzma_filter *filters,
+        const uint8_t *in, size_t size, uint8_t *out, size_t avail) {
+    if (lzma_raw_encoder(stream, filters) != LZMA_OK)
+        die("Error creating raw encoder");
+    stream->next_in = in;
+    stream->avail_in = size;
+    stream->next_out = out;
+    stream->avail_out = avail;
+    lzma_ret err = LZMA_OK;
+    while (err == LZMA_OK)
+        err = lzma_code(stream, LZMA_FINISH);
+    if (err == LZMA_BUF_ERROR)
+        return NULL;
+    if (err != LZMA_STREAM_END)
+        die("Error encoding block");
+    return stream->next_out;
+}
+
+// Compress a block into its output buffer, header and all
+static void encode_block(pipeline_t *pl, lzma_stream *stream,
+        io_block_t *ib, size_t seq) {
+    write_state_t *ws = (write_state_t*)pl->ctx;
+	block_alloc(ws, ib, BLOCK_OUT);
+    size_t uncompressible_size = size_uncompressible(ib->insize) +
+        lzma_check_size(gCheck);
+    
+    // Runs and stored blocks are plain LZMA2
+    filter_chain(ws, ib, FILTER_LZMA);
+    lzma_ret err = LZMA_OK;
+    lzma_vli reused = 0;
+    if (gReference && (ib->outsize = reference_find(stream, ib->input,
+            ib->insize, ib->output, ws->block_out_size, &reused))) {
+        debug("encoder: reused %zu", seq);
+        atomic_fetch_add(&pl->reused_blocks, 1);
+        block_reused(ib, reused);
+        err = LZMA_STREAM_END;
+    } else if (ws->runs && encode_run(stream, ib, &ws->lzma_opts)) {
+        debug("encoder: run %zu", seq);
+        atomic_fetch_add(&pl->run_blocks, 1);
+        err = LZMA_STREAM_END;
+    } else if (ib->filter.kind == FILTER_STORE
+            ? sample_unrepeated(ib->input, ib->insize)
+            : ws->sample && sample_incompressible(ib->input, ib->insize)) {
+        debug("encoder: skipping %zu", seq);
+        atomic_fetch_add(&pl->stored_skipped, 1);
+        err = LZMA_BUF_ERROR;
+    } else {
+        if (ib->filter.kind != FILTER_LZMA)
+            filter_chain(ws, ib, ib->filter.kind);
+        if (lzma_block_encoder(stream, &ib->block) != LZMA_OK)
+            die("Error creating block encoder");
+        stream->next_in = ib->input;
+        stream->avail_in = ib->insize;
+        stream->next_out = ib->output + ib->block.header_size;
+        stream->avail_out = uncompressible_size;
+        
+        // for encoder to change
+        ib->block.uncompressed_size = LZMA_VLI_UNKNOWN;
+        while (err == LZMA_OK) {
+            err = lzma_code(stream, LZMA_FINISH);
+        }
+        if (err == LZMA_STREAM_END)
+            ib->outsize = stream->next_out - ib->output;
+    }
+    if (err == LZMA_BUF_ERROR) {
+        atomic_fetch_add(&pl->stored_blocks, 1);
+        debug("encoder: uncompressible %zu", seq);
+        // Stored data can't go through other filters
+        if (ib->filter.kind != FILTER_LZMA)
+            filter_chain(ws, ib, FILTER_LZMA);
+        encode_uncompressible(ib);
+    } else if (err != LZMA_STREAM_END) {
+        die("Error encoding block");
+    }
+    if (!reused && lzma_block_header_encode(&ib->block, ib->output)
+            != LZMA_OK)
+        die("Error encoding block header");
+}
+
+// A block holds a compressed block copied from elsewhere, header and all.
+// Only the index needs its sizes.
+static void block_reused(io_block_t *ib, lzma_vli unpadded) {
+    ib->block.version = 0;
+    ib->block.check = gCheck;
+    ib->block.header_size = lzma_block_header_size_decode(ib->output[0]);
+    ib->block.compressed_size = unpadded - ib->block.header_size
+        - lzma_check_size(gCheck);
+    ib->block.uncompressed_size = ib->insize;
+}
+
+static void encode_thread(pipeline_t *pl, size_t thnum) {
+    write_state_t *ws = (write_state_t*)pl->ctx;
+    lzma_stream stream = LZMA_STREAM_INIT;
+    stream.allocator = pool_lzma_allocator(pl->workers[thnum].node);
+    pipeline_item_t *pi;
+    while ((pi = pipeline_next(pl, thnum))) {
         
         debug("encoder %zu: received %zu", thnum, pi->seq);
+        uint64_t trace = trace_begin();
         io_block_t *ib = (io_block_t*)(pi->data);
+        PROBE(encode_start, thnum, pi->seq, ib->insize);
         
-		block_alloc(ib, BLOCK_OUT);
-        block_init(&ib->block, ib->insize);
-        size_t header_size = ib->block.header_size;
-        size_t uncompressible_size = size_uncompressible(ib->insize) +
-            lzma_check_size(ib->block.check);
-		        
-        if (lzma_block_encoder(&stream, &ib->block) != LZMA_OK)
-            die("Error creating block encoder");
-        stream.next_in = ib->input;
-        stream.avail_in = ib->insize;
-        stream.next_out = ib->output + header_size;
-        stream.avail_out = uncompressible_size;
-        
-        ib->block.uncompressed_size = LZMA_VLI_UNKNOWN; // for encoder to change
-        lzma_ret err = LZMA_OK;
-        while (err == LZMA_OK) {
-            err = lzma_code(&stream, LZMA_FINISH);
+        bool dup = false;
+        ib->dedup = NULL;
+        if (ws->dedup) {
+            atomic_fetch_add(&pl->dedup_blocks, 1);
+            ib->dedup = dedup_find(ws->dedup, ib->input, ib->insize, pi->seq,
+                &dup);
         }
-        if (err == LZMA_BUF_ERROR) {
-            debug("encoder: uncompressible %zu", pi->seq);
-            encode_uncompressible(ib);
-            ib->outsize = header_size + uncompressible_size;
-        } else if (err == LZMA_STREAM_END) {
-            ib->outsize = stream.next_out - ib->output;
+        ib->dup = dup;
+        if (dup) {
+            // The writer will copy an earlier block's output
+            debug("encoder: duplicate %zu", pi->seq);
+            atomic_fetch_add(&pl->dedup_hits, 1);
+            ib->outsize = 0;
         } else {
-            die("Error encoding block");
+            encode_block(pl, &stream, ib, pi->seq);
         }
         block_dealloc(ib, BLOCK_IN);
         
-        if (lzma_block_header_encode(&ib->block, ib->output) != LZMA_OK)
-            die("Error encoding block header");
-        
 		debug("encoder %zu: sending %zu", thnum, pi->seq);
-        queue_push(gPipelineMergeQ, PIPELINE_ITEM, pi);
+        trace_end("encode", trace, pi->seq, ib->insize, ib->outsize);
+        PROBE(encode_done, thnum, pi->seq, ib->insize, ib->outsize);
+        pipeline_account(pl, PIPELINE_STAGE_PROCESS, ib->insize, ib->outsize);
+        pipeline_done(pl, thnum, pi);
     }
     
     lzma_end(&stream);
@@ -394,19 +1290,20 @@ static void encode_thread(size_t thnum) {
 
 #pragma mark WRITING
 
-static void block_init(lzma_block *block, size_t insize) {
+static void block_init(write_state_t *ws, lzma_block *block,
+        size_t insize, lzma_filter *filters) {
     block->version = 0;
-    block->check = CHECK;
-    block->filters = gFilters;
+    block->check = gCheck;
+    block->filters = filters;
 	block->uncompressed_size = insize ? insize : LZMA_VLI_UNKNOWN;
-    block->compressed_size = insize ? gBlockOutSize : LZMA_VLI_UNKNOWN;
+    block->compressed_size = insize ? ws->block_out_size : LZMA_VLI_UNKNOWN;
 	
     if (lzma_block_header_size(block) != LZMA_OK)
         die("Error getting block header size");
 }
 
-static void stream_edge(lzma_vli backward_size) {
-    lzma_stream_flags flags = { .version = 0, .check = CHECK,
+static void stream_edge(write_state_t *ws, lzma_vli backward_size) {
+    lzma_stream_flags flags = { .version = 0, .check = gCheck,
         .backward_size = backward_size };
     uint8_t buf[LZMA_STREAM_HEADER_SIZE];
     
@@ -417,117 +1314,402 @@ static void stream_edge(lzma_vli backward_size) {
     if ((*encoder)(&flags, buf) != LZMA_OK)
         die("Error encoding stream edge");
     
-    if (fwrite(buf, LZMA_STREAM_HEADER_SIZE, 1, gOutFile) != 1)
-        die("Error writing stream edge");
+    output_write(ws->output, buf, LZMA_STREAM_HEADER_SIZE);
 }
 
-static void write_block(pipeline_item_t *pi) {
+static void write_block(write_state_t *ws, pipeline_item_t *pi) {
     debug("writer: writing %zu", pi->seq);
     io_block_t *ib = (io_block_t*)(pi->data);
+    PROBE(write_block_start, pi->seq, ib->outsize);
     
-    // Does it make sense to chunk this?
-    size_t written = 0;
-    while (ib->outsize > written) {
-        size_t size = ib->outsize - written;
-        if (size > CHUNKSIZE)
-            size = CHUNKSIZE;
-        if (fwrite(ib->output + written, size, 1, gOutFile) != 1)
-            die("Error writing block data");
-        written += size;
-    }
-    
-    if (lzma_index_append(gIndex, NULL,
+    if (lzma_index_append(ws->index, NULL,
             lzma_block_unpadded_size(&ib->block),
             ib->block.uncompressed_size) != LZMA_OK)
         die("Error adding to index");
-
+    
+    // The output buffer goes with the write, the item can be reused now
+    output_block(ws->output, pi->seq, ib->output, ib->outsize);
+    ib->output = NULL;
     block_dealloc(ib, BLOCK_ALL);
-    debug("writer: writing %zu complete", pi->seq);
 }
 
-static void encode_index(void) {
-    if (lzma_index_encoder(&gStream, gIndex) != LZMA_OK)
+// Fill in a duplicate block from the earlier one's output, or offer this
+// block's output to duplicates to come
+static void write_dedup(write_state_t *ws, pipeline_item_t *pi) {
+    io_block_t *ib = (io_block_t*)(pi->data);
+    if (ib->dup) {
+        block_alloc(ws, ib, BLOCK_OUT);
+        lzma_vli unpadded;
+        ib->outsize = dedup_copy(ws->dedup, ib->dedup, ib->output, &unpadded);
+        block_reused(ib, unpadded);
+    } else {
+        dedup_written(ws->dedup, ib->dedup, pi->seq, ib->output, ib->outsize,
+            lzma_block_unpadded_size(&ib->block));
+    }
+    ib->dedup = NULL;
+}
+
+static void encode_index(write_state_t *ws) {
+    if (lzma_index_encoder(&ws->stream, ws->index) != LZMA_OK)
         die("Error creating index encoder");
     uint8_t obuf[CHUNKSIZE] = {};
     lzma_ret err = LZMA_OK;
     while (err != LZMA_STREAM_END) {
-        gStream.next_out = obuf;
-        gStream.avail_out = CHUNKSIZE;
-        err = lzma_code(&gStream, LZMA_RUN);
+        ws->stream.next_out = obuf;
+        ws->stream.avail_out = CHUNKSIZE;
+        err = lzma_code(&ws->stream, LZMA_RUN);
         if (err != LZMA_OK && err != LZMA_STREAM_END)
             die("Error encoding index");
-        if (gStream.avail_out != CHUNKSIZE) {
-            if (fwrite(obuf, CHUNKSIZE - gStream.avail_out, 1, gOutFile) != 1)
-                die("Error writing index data");
+        if (ws->stream.avail_out != CHUNKSIZE) {
+            output_write(ws->output, obuf,
+                CHUNKSIZE - ws->stream.avail_out);
         }
     }
-    lzma_end(&gStream);
+    lzma_end(&ws->stream);
 }
 
-static void write_file_index(void) {
+static void write_file_index(write_state_t *ws) {
     lzma_block block;
-    block_init(&block, 0);
+    block_init(ws, &block, 0, ws->filters);
     uint8_t hdrbuf[block.header_size];
     if (lzma_block_header_encode(&block, hdrbuf) != LZMA_OK)
         die("Error encoding file index header");
-    if (fwrite(hdrbuf, block.header_size, 1, gOutFile) != 1)
-        die("Error writing file index header");
+    output_write(ws->output, hdrbuf, block.header_size);
     
-    if (lzma_block_encoder(&gStream, &block) != LZMA_OK)
+    if (lzma_block_encoder(&ws->stream, &block) != LZMA_OK)
         die("Error creating file index encoder");
     
     uint8_t offbuf[sizeof(uint64_t)];
     xle64enc(offbuf, PIXZ_INDEX_MAGIC);
-    write_file_index_bytes(sizeof(offbuf), offbuf);
-    for (file_index_t *f = gFileIndex; f != NULL; f = f->next) {
+    write_file_index_bytes(ws, sizeof(offbuf), offbuf);
+    for (file_index_t *f = ws->files; f != NULL; f = f->next) {
         char *name = f->name ? f->name : "";
         size_t len = strlen(name);
-        write_file_index_bytes(len + 1, (uint8_t*)name);
+        write_file_index_bytes(ws, len + 1, (uint8_t*)name);
         xle64enc(offbuf, f->offset);
-        write_file_index_bytes(sizeof(offbuf), offbuf);
+        write_file_index_bytes(ws, sizeof(offbuf), offbuf);
     }
-    write_file_index_buf(LZMA_FINISH);
+    write_file_index_buf(ws, LZMA_FINISH);
 
-    if (lzma_index_append(gIndex, NULL, lzma_block_unpadded_size(&block),
+    if (lzma_index_append(ws->index, NULL, lzma_block_unpadded_size(&block),
             block.uncompressed_size) != LZMA_OK)
         die("Error adding file-index to index");
-    lzma_end(&gStream);
+    lzma_end(&ws->stream);
 }
 
-static void write_file_index_bytes(size_t size, uint8_t *buf) {
+static void write_file_index_bytes(write_state_t *ws, size_t size,
+        uint8_t *buf) {
     size_t bufpos = 0;
     while (bufpos < size) {
         size_t len = size - bufpos;
-        size_t space = CHUNKSIZE - gFileIndexBufPos;
+        size_t space = CHUNKSIZE - ws->file_index_buf_pos;
         if (len > space)
             len = space;
-        memcpy(gFileIndexBuf + gFileIndexBufPos, buf + bufpos, len);
-        gFileIndexBufPos += len;
+        memcpy(ws->file_index_buf + ws->file_index_buf_pos, buf + bufpos, len);
+        ws->file_index_buf_pos += len;
         bufpos += len;
         
-        if (gFileIndexBufPos == CHUNKSIZE) {
-            write_file_index_buf(LZMA_RUN);
-            gFileIndexBufPos = 0;
+        if (ws->file_index_buf_pos == CHUNKSIZE) {
+            write_file_index_buf(ws, LZMA_RUN);
+            ws->file_index_buf_pos = 0;
         }
     }
 }
 
-static void write_file_index_buf(lzma_action action) {
+static void write_file_index_buf(write_state_t *ws,
+        lzma_action action) {
     uint8_t obuf[CHUNKSIZE] = {};
-    gStream.avail_in = gFileIndexBufPos;
-    gStream.next_in = gFileIndexBuf;
+    ws->stream.avail_in = ws->file_index_buf_pos;
+    ws->stream.next_in = ws->file_index_buf;
     lzma_ret err = LZMA_OK;
-    while (err != LZMA_STREAM_END && (action == LZMA_FINISH || gStream.avail_in)) {
-        gStream.avail_out = CHUNKSIZE;
-        gStream.next_out = obuf;
-        err = lzma_code(&gStream, action);
+    while (err != LZMA_STREAM_END
+            && (action == LZMA_FINISH || ws->stream.avail_in)) {
+        ws->stream.avail_out = CHUNKSIZE;
+        ws->stream.next_out = obuf;
+        err = lzma_code(&ws->stream, action);
         if (err != LZMA_OK && err != LZMA_STREAM_END)
             die("Error encoding file index");
-        if (gStream.avail_out != CHUNKSIZE) {
-            if (fwrite(obuf, CHUNKSIZE - gStream.avail_out, 1, gOutFile) != 1)
-                die("Error writing file index");
+        if (ws->stream.avail_out != CHUNKSIZE) {
+            output_write(ws->output, obuf,
+                CHUNKSIZE - ws->stream.avail_out);
+        }
+    }
+    
+    ws->file_index_buf_pos = 0;
+}
+
+
+#pragma mark APPENDING
+
+// The archive being appended to, decoded a block at a time
+struct append_reader_t {
+    FILE *file;
+    lzma_index *index;
+    uint8_t *buf;
+    lzma_vli start, size; // of the decoded block, uncompressed
+};
+
+// The archive isn't changed until everything else has worked: a new one is
+// built next to it, and renamed over it at the end
+void pixz_append(FILE *archive, const char *path, FILE *in, uint32_t level) {
+    write_state_t *ws = write_new(in, NULL, true, level);
+    ws->append = true;
+    ws->archive = archive;
+    append_open(ws);
+    append_temp(ws, path);
+    ws->output = output_open(ws->out);
+    write_run(ws);
+}
+
+// Find where the old tar data really ends, before its end-of-archive
+// marker. Blocks wholly before that are kept as they are. The rest of the
+// block it ends in is compressed again, ahead of our input.
+static void append_open(write_state_t *ws) {
+    lzma_index *index = decode_index(ws->archive);
+    if (!index)
+        die("Can't read index of archive");
+    if (lzma_index_stream_count(index) != 1)
+        die("Can only append to an archive with a single stream");
+    file_index_t *files;
+    if (!read_file_index(ws->archive, index, &files))
+        die("Can only append to a pixz tarball");
+    
+    // Tar data ends where the file index starts
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, index);
+    if (lzma_index_iter_locate(&iter, lzma_index_uncompressed_size(index) - 1))
+        die("Can't locate file index block");
+    uint64_t data_end = iter.block.uncompressed_file_offset;
+    
+    // Our blocks get the same check as the old ones
+    gCheck = iter.stream.flags->check;
+    if (!check_supported(gCheck) || !lzma_check_is_supported(gCheck))
+        die("Archive has an unsupported integrity check");
+    
+    // Drop the end entry, and find the last real one
+    file_index_t **end = &files, *last = NULL;
+    for (; *end && (*end)->name; end = &(*end)->next)
+        last = *end;
+    free_file_index(*end);
+    *end = NULL;
+    if (!last)
+        die("Archive has no entries to append to");
+    
+    append_reader_t ar = { .file = ws->archive, .index = index };
+    uint64_t tar_end = append_tar_end(&ar, last->offset, data_end);
+    debug("append: old tar data ends at %" PRIu64 " of %" PRIu64,
+        tar_end, data_end);
+    
+    lzma_index_iter_init(&iter, index);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+        lzma_vli start = iter.block.uncompressed_file_offset;
+        if (start + iter.block.uncompressed_size > tar_end) {
+            ws->append_offset = iter.block.compressed_file_offset;
+            if (tar_end > start) {
+                append_decode(&ar, start);
+                ws->prefix_size = tar_end - start;
+                ws->prefix = xmalloc(ws->prefix_size);
+                memcpy(ws->prefix, ar.buf, ws->prefix_size);
+            }
+            break;
+        }
+        if (lzma_index_append(ws->index, NULL, iter.block.unpadded_size,
+                iter.block.uncompressed_size) != LZMA_OK)
+            die("Error adding to index");
+    }
+    debug("append: keeping %" PRIu64 " blocks, recompressing %zu bytes",
+        (uint64_t)lzma_index_block_count(ws->index), ws->prefix_size);
+    
+    ws->old_files = files;
+    ws->file_base = tar_end;
+    free(ar.buf);
+    lzma_index_end(index, NULL);
+}
+
+// Decode the block of the old archive that holds an offset, unless we
+// already have it
+static void append_decode(append_reader_t *ar, lzma_vli offset) {
+    if (ar->buf && offset >= ar->start && offset < ar->start + ar->size)
+        return;
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, ar->index);
+    if (lzma_index_iter_locate(&iter, offset))
+        die("Can't locate block in archive");
+    
+    size_t total = iter.block.total_size;
+    uint8_t *in = xmalloc(total);
+    if (pread(fileno(ar->file), in, total, iter.block.compressed_file_offset)
+            != (ssize_t)total)
+        die("Error reading archive");
+    
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block = { .version = 0, .check = gCheck, .filters = filters };
+    block.header_size = lzma_block_header_size_decode(in[0]);
+    if (block.header_size > total
+            || lzma_block_header_decode(&block, NULL, in) != LZMA_OK)
+        die("Error decoding block header");
+    if (lzma_block_compressed_size(&block, iter.block.unpadded_size)
+            != LZMA_OK)
+        die("Block size in archive doesn't match its index");
+    
+    free(ar->buf);
+    ar->start = iter.block.uncompressed_file_offset;
+    ar->size = iter.block.uncompressed_size;
+    ar->buf = xmalloc(ar->size);
+    size_t in_pos = block.header_size, out_pos = 0;
+    lzma_ret err = lzma_block_buffer_decode(&block, NULL, in, &in_pos, total,
+        ar->buf, &out_pos, ar->size);
+    for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
+        free(filters[i].options);
+    free(in);
+    if (err != LZMA_OK || out_pos != ar->size)
+        die("Error decoding block of archive");
+}
+
+// Scan on from the last entry to the end-of-archive marker. Only the blocks
+// with headers in them are decoded, file contents are skipped.
+static uint64_t append_tar_end(append_reader_t *ar, uint64_t last,
+        uint64_t data_end) {
+    tar_scan_t *ts = tar_scan_new(append_entry, NULL);
+    tar_status_t st = TAR_MORE;
+    while (st == TAR_MORE) {
+        tar_scan_skip(ts);
+        uint64_t pos = last + tar_scan_pos(ts);
+        if (pos >= data_end) {
+            if (pos > data_end)
+                die("Last entry of archive is truncated");
+            st = tar_scan_finish(ts); // no end marker
+            break;
         }
+        append_decode(ar, pos);
+        st = tar_scan(ts, ar->buf + (pos - ar->start),
+            ar->start + ar->size - pos);
+    }
+    if (st != TAR_END)
+        die("Can't find the end of the archive's tar data");
+    uint64_t end = last + tar_scan_pos(ts);
+    tar_scan_free(ts);
+    return end;
+}
+
+static void append_entry(void *ctx, off_t offset, const char *name) {
+    // Already in the file index
+}
+
+// Until now the archive is untouched. Cut it off where our blocks start.
+// Next to the archive, so it's on the same filesystem and can be renamed
+// over it. It starts with a copy of the blocks we keep, and our output
+// follows them.
+static void append_temp(write_state_t *ws, const char *path) {
+    append_temp_t *t = &ws->temp;
+    if (!(t->target = realpath(path, NULL)))
+        die("can not open archive: %s: %s", path, strerror(errno));
+    size_t len = strlen(t->target);
+    t->path = xmalloc(len + sizeof(".XXXXXX"));
+    memcpy(t->path, t->target, len);
+    memcpy(t->path + len, ".XXXXXX", sizeof(".XXXXXX"));
+    
+    pthread_once(&gAppendTempsOnce, append_temp_install);
+    pthread_mutex_lock(&gAppendTempsMutex);
+    if ((t->fd = mkstemp(t->path)) != -1) {
+        t->next = gAppendTemps;
+        gAppendTemps = t;
     }
+    pthread_mutex_unlock(&gAppendTempsMutex);
+    if (t->fd == -1)
+        die("can not create temporary file: %s: %s", t->path,
+            strerror(errno));
+    
+    struct stat st;
+    int fd = fileno(ws->archive);
+    if (fstat(fd, &st) != 0 || fchmod(t->fd, st.st_mode & 07777) != 0)
+        die("Error creating temporary file");
+    append_copy(fd, t->fd, ws->append_offset);
     
-    gFileIndexBufPos = 0;
+    // Closing the output closes ws->out, keep t->fd to sync it with
+    int out = dup(t->fd);
+    if (out == -1 || lseek(out, ws->append_offset, SEEK_SET) == -1
+            || !(ws->out = fdopen(out, "w")))
+        die("Error opening temporary file");
+}
+
+static void append_temp_install(void) {
+    atexit(append_temp_cleanup);
+}
+
+static void append_temp_cleanup(void) {
+    pthread_mutex_lock(&gAppendTempsMutex);
+    for (append_temp_t *t = gAppendTemps; t; t = t->next)
+        unlink(t->path);
+    pthread_mutex_unlock(&gAppendTempsMutex);
+}
+
+// Share the data where the filesystem can, otherwise copy it
+static void append_copy(int in, int out, off_t size) {
+    off_t pos = 0;
+#ifdef HAVE_COPY_FILE_RANGE
+    while (pos < size) {
+        loff_t ipos = pos, opos = pos;
+        ssize_t n = copy_file_range(in, &ipos, out, &opos, size - pos, 0);
+        if (n <= 0)
+            break;
+        pos += n;
+    }
+#endif
+    uint8_t *buf = xmalloc(APPEND_COPY_SIZE);
+    bool ok = true;
+    while (ok && pos < size) {
+        size_t want = size - pos < APPEND_COPY_SIZE ? size - pos
+            : APPEND_COPY_SIZE;
+        ssize_t n = pread(in, buf, want, pos);
+        ok = n > 0 && pwrite(out, buf, n, pos) == n;
+        pos += n;
+    }
+    free(buf);
+    if (!ok)
+        die("Error copying archive");
+}
+
+// Make the new archive durable before it replaces the old one, so a crash
+// leaves one or the other
+static void append_finish(write_state_t *ws) {
+    append_temp_t *t = &ws->temp;
+    bool ok = fsync(t->fd) == 0;
+    if (close(t->fd) != 0 || !ok)
+        die("Error writing temporary file");
+    
+    pthread_mutex_lock(&gAppendTempsMutex);
+    ok = rename(t->path, t->target) == 0;
+    if (ok) {
+        append_temp_t **p = &gAppendTemps;
+        while (*p != t)
+            p = &(*p)->next;
+        *p = t->next;
+    }
+    pthread_mutex_unlock(&gAppendTempsMutex);
+    if (!ok)
+        die("can not replace archive: %s: %s", t->target, strerror(errno));
+    
+    // Make the rename durable too, where the filesystem allows
+    int dir = open(dirname(t->path), O_RDONLY);
+    if (dir != -1) {
+        fsync(dir);
+        close(dir);
+    }
+    if (fclose(ws->archive) != 0)
+        die("Error closing archive");
+    free(t->path);
+    free(t->target);
+}
+
+// The old entries, then ours after them
+static void append_files(write_state_t *ws) {
+    file_index_t *last = ws->old_files;
+    while (last->next)
+        last = last->next;
+    for (file_index_t *f = ws->files; f; f = f->next)
+        f->offset += ws->file_base;
+    last->next = ws->files;
+    ws->files = ws->old_files;
+    ws->old_files = NULL;
 }
@@ -0,0 +1,47 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+mkdir $DIR/a $DIR/b
+for i in 1 2 3 4 5 6 7 8; do
+    head -c 100000 /dev/urandom | od -An > $DIR/a/file$i
+    seq $i 20000 > $DIR/b/file$i
+done
+(cd $DIR && tar cf a.tar a && tar cf b.tar b) || exit 1
+
+# Small blocks, so the old ones before the end are kept
+$PIXZ -0 -f 0.25 -i $DIR/a.tar -o $DIR/out.tpxz || exit 1
+cp $DIR/out.tpxz $DIR/old.tpxz
+chmod 640 $DIR/out.tpxz
+$PIXZ -a $DIR/out.tpxz < $DIR/b.tar || exit 1
+xz -t $DIR/out.tpxz || exit 1
+test "$(stat -c %a $DIR/out.tpxz)" = 640 || exit 1
+
+# The old archive's start is unchanged
+kept=$(($(stat -c %s $DIR/old.tpxz) / 2))
+cmp -n $kept $DIR/old.tpxz $DIR/out.tpxz || exit 1
+
+# It holds both tarballs' entries
+tar tf $DIR/a.tar > $DIR/old
+(cat $DIR/old; tar tf $DIR/b.tar) > $DIR/want
+$PIXZ -l $DIR/out.tpxz | diff $DIR/want - || exit 1
+$PIXZ -d < $DIR/out.tpxz | tar tf - | diff $DIR/want - || exit 1
+(tar xOf $DIR/a.tar; tar xOf $DIR/b.tar) | cksum > $DIR/sum
+$PIXZ -d < $DIR/out.tpxz | tar xOf - | cksum | diff $DIR/sum - || exit 1
+$PIXZ -x b/file3 < $DIR/out.tpxz | tar xOf - | cmp $DIR/b/file3 - || exit 1
+
+# Input that isn't a tarball leaves the archive alone
+head -c 10000 /dev/urandom > $DIR/junk
+$PIXZ -a $DIR/old.tpxz $DIR/junk 2>/dev/null && exit 1
+$PIXZ -l $DIR/old.tpxz | diff $DIR/old - || exit 1
+
+# So does a truncated one, even after blocks of it are written
+head -c 150000 $DIR/b.tar > $DIR/cut.tar
+$PIXZ -0 -f 0.25 -a $DIR/old.tpxz $DIR/cut.tar 2>/dev/null && exit 1
+xz -t $DIR/old.tpxz || exit 1
+$PIXZ -l $DIR/old.tpxz | diff $DIR/old - || exit 1
+ls $DIR | grep -q 'old\.tpxz\.' && exit 1
+exit 0
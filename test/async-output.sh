@@ -0,0 +1,27 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+TAR=$(mktemp)
+EXPECTED=$(mktemp)
+ACTUAL=$(mktemp)
+trap "rm -f $TAR $EXPECTED $ACTUAL" EXIT
+
+# Several blocks, written out of order by io_uring if it's available
+tar cf $TAR ../src/*.c ../src/*.h
+cat $TAR | $PIXZ -0 -f 0.3 | cat > $EXPECTED || exit 1
+
+# To a regular file
+$PIXZ -0 -f 0.3 < $TAR > $ACTUAL || exit 1
+cmp $EXPECTED $ACTUAL || exit 1
+PIXZ_DISABLE=uring $PIXZ -0 -f 0.3 < $TAR > $ACTUAL || exit 1
+cmp $EXPECTED $ACTUAL || exit 1
+
+# Later writes to the same file descriptor go after ours
+{ $PIXZ -0 -f 0.3 < $TAR; echo end; } > $ACTUAL || exit 1
+{ cat $EXPECTED; echo end; } | cmp - $ACTUAL || exit 1
+
+# Appending
+echo start > $ACTUAL
+$PIXZ -0 -f 0.3 < $TAR >> $ACTUAL || exit 1
+{ echo start; cat $EXPECTED; } | cmp - $ACTUAL
@@ -0,0 +1,38 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+# Small files around one bigger than a block
+mkdir $DIR/in
+for i in $(seq 200); do
+    head -c $((i * 37 % 1500 + 100)) /dev/urandom | od -An > $DIR/in/a$i
+done
+head -c 600000 /dev/urandom > $DIR/in/big
+for i in $(seq 50); do
+    head -c $((i * 53 % 1500 + 100)) /dev/urandom | od -An > $DIR/in/b$i
+done
+tar -C $DIR -cf $DIR/in.tar in
+
+# Read through a pipe, so cut-off block ends are copied
+cat $DIR/in.tar | $PIXZ -0 -f 0.25 --align > $DIR/out.tpxz || exit 1
+xz -t $DIR/out.tpxz || exit 1
+$PIXZ -d -i $DIR/out.tpxz | cmp $DIR/in.tar - || exit 1
+$PIXZ -x in/b7 -i $DIR/out.tpxz | tar -xOf - | cmp $DIR/in/b7 - || exit 1
+
+# Blocks start at entries, except within the big file and at the file index
+tar -tvRf $DIR/in.tar | awk '{ print ($2 + 0) * 512 }' | sort > $DIR/entries
+big=$(tar -tvRf $DIR/in.tar | awk '$NF == "in/big" { print ($2 + 0) * 512 }')
+end=$((big + 600000 + 512))
+xz --robot -lvv $DIR/out.tpxz | awk -v big=$big -v end=$end \
+    '$1 == "block" && ($6 <= big || $6 >= end) { print $6 }' \
+    | sort > $DIR/blocks
+grep -q "^$big\$" $DIR/blocks || exit 1
+[ $(comm -13 $DIR/entries $DIR/blocks | wc -l) -le 1 ] || exit 1
+
+# Mapped input gives the same layout
+$PIXZ -0 -f 0.25 --align -i $DIR/in.tar -o $DIR/mapped.tpxz || exit 1
+cmp $DIR/out.tpxz $DIR/mapped.tpxz || exit 1
+exit 0
@@ -0,0 +1,25 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0)
+
+CGROUP=$INPUT.cgroup
+COMPRESSED=$INPUT.xz
+UNCOMPRESSED=$INPUT.extracted
+STATS=$INPUT.stats
+trap "rm -rf $CGROUP $COMPRESSED $UNCOMPRESSED $STATS" EXIT
+
+# A cgroup v2 hierarchy with a one-CPU quota, and far too little memory
+mkdir -p $CGROUP
+touch $CGROUP/cgroup.controllers
+echo "100000 100000" > $CGROUP/cpu.max
+echo 1048576 > $CGROUP/memory.max
+
+export PIXZ_CGROUP_DIR=$CGROUP
+$PIXZ --stats=json $INPUT $COMPRESSED 2> $STATS || exit 1
+grep -q '"workers":{"threads":1,' $STATS || exit 1
+grep -q 'Warning: memory use may exceed' $STATS || exit 1
+$PIXZ -d $COMPRESSED $UNCOMPRESSED || exit 1
+
+[ "$(cat $INPUT | md5sum)" = "$(cat $UNCOMPRESSED | md5sum)" ] || exit 1
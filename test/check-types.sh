@@ -0,0 +1,19 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+# Stored, run and compressed blocks, of odd sizes
+head -c 300001 /dev/urandom > $DIR/in
+head -c 200003 /dev/zero >> $DIR/in
+seq 1 30000 >> $DIR/in
+
+for check in none crc32 crc64 sha256; do
+    $PIXZ -t -0 -f 0.25 --check $check -i $DIR/in -o $DIR/$check.xz || exit 1
+    xz -t $DIR/$check.xz || exit 1
+    $PIXZ -d -i $DIR/$check.xz | cmp $DIR/in - || exit 1
+done
+xz --robot -lv $DIR/sha256.xz | grep -q 'SHA-256' || exit 1
+exit 0
@@ -0,0 +1,23 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+# A piece four blocks long, repeated around another one
+head -c 200000 /dev/urandom | od -An | head -c 262144 > $DIR/a
+head -c 200000 /dev/urandom | od -An | head -c 262144 > $DIR/b
+cat $DIR/a $DIR/a $DIR/b $DIR/a > $DIR/in
+
+$PIXZ -0 -f 0.25 -t -i $DIR/in -o $DIR/plain.xz || exit 1
+$PIXZ -0 -f 0.25 -t --dedup --stats -i $DIR/in -o $DIR/dedup.xz \
+    2> $DIR/stats || exit 1
+grep -q '^dedup hits: 8 of 16 blocks' $DIR/stats || exit 1
+cmp $DIR/plain.xz $DIR/dedup.xz || exit 1
+$PIXZ -d -i $DIR/dedup.xz | cmp $DIR/in - || exit 1
+
+# With too little room to keep outputs, repeats are compressed again
+$PIXZ -0 -f 0.25 -t --dedup=1K -p 2 -i $DIR/in -o $DIR/small.xz || exit 1
+cmp $DIR/plain.xz $DIR/small.xz || exit 1
+exit 0
@@ -0,0 +1,31 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+# A 16-bit stereo WAV, compressible so it isn't stored, and our own executable
+mkdir $DIR/in
+printf 'RIFF\377\377\377\377WAVEfmt \020\000\000\000\001\000\002\000' \
+    > $DIR/in/sound.wav
+printf '\104\254\000\000\020\261\002\000\004\000\020\000data\377\377\377\377' \
+    >> $DIR/in/sound.wav
+head -c 300000 /dev/urandom | od -An >> $DIR/in/sound.wav
+cp $PIXZ $DIR/in/pixz
+tar -C $DIR -cf $DIR/in.tar in
+
+$PIXZ -0 -f 0.25 -i $DIR/in.tar -o $DIR/out.tpxz || exit 1
+xz -t $DIR/out.tpxz || exit 1
+xz -lvv $DIR/out.tpxz > $DIR/list || exit 1
+grep -q -- '--delta=dist=4 ' $DIR/list || exit 1
+if head -c 20 $PIXZ | od -An -tx1 | tr -d '\n' | grep -q '^ 7f 45 4c 46.* \(3e\|03\|b7\) 00$'
+then
+    grep -q -- '--\(x86\|arm64\) ' $DIR/list || exit 1
+fi
+$PIXZ -d -i $DIR/out.tpxz | cmp $DIR/in.tar - || exit 1
+
+# Without choosing, every block is plain LZMA2
+PIXZ_DISABLE=filters $PIXZ -0 -f 0.25 -i $DIR/in.tar -o $DIR/plain.tpxz || exit 1
+xz -lvv $DIR/plain.tpxz | grep -q -- '--\(delta\|x86\|arm64\)' && exit 1
+exit 0
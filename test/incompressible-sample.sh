@@ -0,0 +1,27 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(mktemp)
+SAMPLED=$(mktemp)
+ENCODED=$(mktemp)
+STATS=$(mktemp)
+OUTPUT=$(mktemp)
+trap "rm -f $INPUT $SAMPLED $ENCODED $STATS $OUTPUT" EXIT
+
+# Random data is stored without running the encoder, and is no bigger
+# than what the encoder makes of it
+head -c 2000000 /dev/urandom > $INPUT
+$PIXZ --stats -0 -t -i $INPUT -o $SAMPLED 2>$STATS || exit 1
+grep -q '^stored blocks: [1-9][0-9]*, [1-9][0-9]* not encoded' $STATS || exit 1
+PIXZ_DISABLE=sample $PIXZ -0 -t -i $INPUT -o $ENCODED || exit 1
+[ $(wc -c < $SAMPLED) -le $(wc -c < $ENCODED) ] || exit 1
+
+$PIXZ -d < $SAMPLED > $OUTPUT || exit 1
+cmp $INPUT $OUTPUT || exit 1
+
+# Compressible data is still compressed
+cat ../src/*.c > $INPUT
+rm -f $SAMPLED
+$PIXZ --stats -0 -t -i $INPUT -o $SAMPLED 2>$STATS || exit 1
+grep -q '^stored blocks: 0, 0 not encoded' $STATS
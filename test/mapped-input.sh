@@ -0,0 +1,23 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+TAR=$(mktemp)
+MAPPED=$(mktemp)
+READ=$(mktemp)
+PIPED=$(mktemp)
+OUTPUT=$(mktemp)
+trap "rm -f $TAR $MAPPED $READ $PIPED $OUTPUT" EXIT
+
+# Several small blocks, so they don't fall on page boundaries
+tar cf $TAR ../src/*.c ../src/*.h
+$PIXZ -0 -f 0.3 -i $TAR -o $MAPPED || exit 1
+PIXZ_DISABLE=mmap $PIXZ -0 -f 0.3 -i $TAR -o $READ || exit 1
+cat $TAR | $PIXZ -0 -f 0.3 > $PIPED || exit 1
+
+# Mapped, read and piped input all give the same result
+cmp $MAPPED $READ || exit 1
+cmp $MAPPED $PIPED || exit 1
+
+$PIXZ -d < $MAPPED > $OUTPUT || exit 1
+cmp $TAR $OUTPUT
@@ -0,0 +1,18 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0)
+
+COMPRESSED=$INPUT.xz
+UNCOMPRESSED=$INPUT.extracted
+trap "rm -f $COMPRESSED $UNCOMPRESSED" EXIT
+
+# Too small for the default preset, should still work with less
+$PIXZ -m 20M $INPUT $COMPRESSED || exit 1
+$PIXZ -m 20MiB -d $COMPRESSED $UNCOMPRESSED || exit 1
+[ "$(cat $INPUT | md5sum)" = "$(cat $UNCOMPRESSED | md5sum)" ] || exit 1
+
+# Garbage sizes are rejected
+$PIXZ -m 20X $INPUT $COMPRESSED 2>/dev/null && exit 1
+exit 0
@@ -0,0 +1,25 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0)
+
+TOPOLOGY=$INPUT.nodes
+COMPRESSED=$INPUT.xz
+UNCOMPRESSED=$INPUT.extracted
+trap "rm -rf $TOPOLOGY $COMPRESSED $UNCOMPRESSED" EXIT
+
+# Two nodes sharing CPU 0, so pinning works on any machine. Node 2 has no
+# CPUs, and should be ignored.
+for node in 0 1 2; do
+    mkdir -p $TOPOLOGY/node$node
+done
+echo 0 > $TOPOLOGY/node0/cpulist
+echo 0 > $TOPOLOGY/node1/cpulist
+echo > $TOPOLOGY/node2/cpulist
+
+export PIXZ_NUMA_DIR=$TOPOLOGY
+$PIXZ --numa -p 3 $INPUT $COMPRESSED || exit 1
+$PIXZ --numa -p 3 -d $COMPRESSED $UNCOMPRESSED || exit 1
+
+[ "$(cat $INPUT | md5sum)" = "$(cat $UNCOMPRESSED | md5sum)" ] || exit 1
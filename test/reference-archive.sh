@@ -0,0 +1,31 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+# Yesterday's input, and today's with a line inserted near the start
+head -c 500000 /dev/urandom | od -An > $DIR/old
+{ head -n 10 $DIR/old; echo new; tail -n +11 $DIR/old; } > $DIR/new
+
+$PIXZ -0 -f 0.25 -t --rsyncable -i $DIR/old -o $DIR/old.xz || exit 1
+$PIXZ -0 -f 0.25 -t --rsyncable -i $DIR/new -o $DIR/plain.xz || exit 1
+
+# Unchanged blocks are copied, and the result is the same as compressing
+$PIXZ -0 -f 0.25 -t --rsyncable --reference $DIR/old.xz --stats \
+    -i $DIR/new -o $DIR/new.xz 2> $DIR/stats || exit 1
+cmp $DIR/plain.xz $DIR/new.xz || exit 1
+total=$(xz --robot -l $DIR/new.xz | awk '$1 == "totals" { print $3 }')
+reused=$(awk '/^reused blocks:/ { print $3 }' $DIR/stats)
+[ $total -ge 10 -a $reused -ge $((total - 2)) ] || exit 1
+
+# A damaged reference block fails to match, and is compressed instead
+size=$(wc -c < $DIR/old.xz)
+{ head -c $((size / 2)) $DIR/old.xz; printf '\377'
+    tail -c +$((size / 2 + 2)) $DIR/old.xz; } > $DIR/bad.xz
+$PIXZ -0 -f 0.25 -t --rsyncable --reference $DIR/bad.xz \
+    -i $DIR/new -o $DIR/new2.xz || exit 1
+cmp $DIR/plain.xz $DIR/new2.xz || exit 1
+$PIXZ -d -i $DIR/new2.xz | cmp $DIR/new - || exit 1
+exit 0
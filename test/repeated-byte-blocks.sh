@@ -0,0 +1,27 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(mktemp)
+COMPRESSED=$(mktemp)
+STATS=$(mktemp)
+OUTPUT=$(mktemp)
+trap "rm -f $INPUT $COMPRESSED $STATS $OUTPUT" EXIT
+
+# Blocks of zeros and of another byte, big enough to need several LZMA2
+# chunks, around some text
+cat ../src/write.c > $INPUT
+head -c 12000000 /dev/zero >> $INPUT
+head -c 7000000 /dev/zero | tr '\0' '\252' >> $INPUT
+cat ../src/read.c >> $INPUT
+
+$PIXZ --stats -0 -f 20 -t -i $INPUT -o $COMPRESSED 2>$STATS || exit 1
+grep -q '^run blocks: [1-9]' $STATS || exit 1
+xz -t $COMPRESSED || exit 1
+
+$PIXZ --stats -d -i $COMPRESSED -o $OUTPUT 2>$STATS || exit 1
+grep -q '^run blocks: [1-9]' $STATS || exit 1
+cmp $INPUT $OUTPUT || exit 1
+
+# The decoder gives the same result the long way
+PIXZ_DISABLE=runs $PIXZ -d < $COMPRESSED | cmp $INPUT -
@@ -0,0 +1,31 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+# Two inputs, differing by one byte inserted near the start
+head -c 1000000 /dev/urandom | od -An > $DIR/a
+{ head -c 100 $DIR/a; printf X; tail -c +101 $DIR/a; } > $DIR/b
+
+# Checksums of each compressed block
+blocks() {
+    xz --robot -lvv $1 | awk '$1 == "block" { print $5, $7 }' \
+        | while read off size; do
+            tail -c +$((off + 1)) $1 | head -c $size | cksum
+        done | sort
+}
+
+for f in a b; do
+    $PIXZ -0 -f 0.25 -t --rsyncable -i $DIR/$f -o $DIR/$f.xz || exit 1
+    xz -t $DIR/$f.xz || exit 1
+    $PIXZ -d -i $DIR/$f.xz | cmp $DIR/$f - || exit 1
+    blocks $DIR/$f.xz > $DIR/$f.blocks
+done
+
+# Only the blocks around the insertion differ
+total=$(wc -l < $DIR/a.blocks)
+shared=$(comm -12 $DIR/a.blocks $DIR/b.blocks | wc -l)
+[ $total -ge 20 -a $shared -ge $((total - 2)) ] || exit 1
+exit 0
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0)
+
+COMPRESSED=$INPUT.xz
+STATS=$INPUT.stats
+trap "rm -f $COMPRESSED $STATS" EXIT
+
+$PIXZ --stats=json $INPUT $COMPRESSED 2>$STATS || exit 1
+grep -q '"workers":{"threads":[0-9]*,"busy":' $STATS || exit 1
+grep -q '"merge":{"high_water":[1-9]' $STATS || exit 1
+
+$PIXZ --stats -d $COMPRESSED -o /dev/null 2>$STATS || exit 1
+grep -q '^merge stalls: ' $STATS || exit 1
+grep -q '^buffers: [0-9]* hits, [1-9][0-9]* misses' $STATS || exit 1
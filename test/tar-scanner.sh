@@ -0,0 +1,21 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+# Long names, links and an empty file exercise the special headers
+mkdir -p $DIR/src/$(printf 'long%.0s' $(seq 30))
+cp ../src/*.c $DIR/src/$(printf 'long%.0s' $(seq 30))/
+ln -s pixz.c $DIR/src/link.c
+ln $DIR/src/long*/pixz.h $DIR/src/hard.h
+: > $DIR/src/empty
+
+for fmt in gnu oldgnu ustar posix v7; do
+    tar -C $DIR --format=$fmt -cf $DIR/$fmt.tar src 2>/dev/null || continue
+    PIXZ_DISABLE=tar-scan $PIXZ -0 -i $DIR/$fmt.tar -o $DIR/libarchive.tpxz || exit 1
+    $PIXZ -0 -i $DIR/$fmt.tar -o $DIR/scan.tpxz || exit 1
+    # The same file index, so the same output
+    cmp $DIR/libarchive.tpxz $DIR/scan.tpxz || exit 1
+done